@@ -18,6 +18,9 @@ typedef struct
 
     void (*set_target)(uint32_t intid, uint32_t cpu);
 
+    uint32_t (*get_cpu)(); // CPU interface number of the calling CPU, as used for routing.
+    void (*send_sgi)(uint32_t intid, uint32_t cpu);
+
     uint32_t (*ack_int)();
     void (*end_of_int)(uint32_t iar);
 }
@@ -1,3 +1,5 @@
 #pragma once
 
+#define AARCH64_INT_SGI_RESCHED 0
+
 void aarch64_int_init_cpu();
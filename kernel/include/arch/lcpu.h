@@ -1,16 +1,53 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
 void arch_lcpu_halt();
 
+/**
+ * @brief Sleep until an interrupt arrives or, where the CPU can watch memory
+ * for writes, until `*wake_flag` is cleared. Called with interrupts masked,
+ * returns with them unmasked.
+ */
+void arch_lcpu_idle(const bool *wake_flag);
+/**
+ * @brief Wake the CPU with the given ID out of arch_lcpu_idle(), once its flag
+ * was cleared. Sends the reschedule IPI, unless the flag being written to is
+ * enough.
+ */
+void arch_lcpu_wake(size_t cpu_id);
+
+/**
+ * @brief Send the reschedule IPI to the CPU with the given ID, which may be
+ * the calling one.
+ */
+void arch_lcpu_resched(size_t cpu_id);
+/**
+ * @brief Registers the handler run by the reschedule IPI.
+ */
+void arch_lcpu_set_resched_handler(void (*handler)());
+
 void arch_lcpu_int_mask();
 void arch_lcpu_int_unmask();
 [[nodiscard]] bool arch_lcpu_int_enabled();
 
 void arch_lcpu_relax();
 
-[[nodiscard]] size_t arch_lcpu_thread_reg_read();
-void arch_lcpu_thread_reg_write(size_t t);
+/**
+ * @brief Point the calling CPU's per-CPU register at its per-CPU area, whose
+ * first word must hold its own address.
+ */
+void arch_lcpu_percpu_set_base(uintptr_t base);
+[[nodiscard]] uintptr_t arch_lcpu_percpu_base();
+
+/**
+ * @brief Access the 64-bit word at `offset` into the calling CPU's per-CPU
+ * area. Each access is done in one go, so that being preempted can't make it
+ * land in another CPU's area halfway through.
+ */
+[[nodiscard]] uint64_t arch_lcpu_percpu_read(size_t offset);
+void arch_lcpu_percpu_write(size_t offset, uint64_t value);
+void arch_lcpu_percpu_add(size_t offset, uint64_t value);
 
 void arch_lcpu_init();
@@ -14,14 +14,53 @@ int arch_paging_map_page(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t padd
 
 int arch_paging_unmap_page(arch_paging_map_t *map, uintptr_t vaddr);
 
+// Maps `count` consecutive 4KiB pages that share one last-level table in a single walk.
+// Entries whose `paddrs` slot is 0 or that are already mapped are left untouched.
+// Returns the number of pages mapped.
+size_t arch_paging_map_batch(arch_paging_map_t *map, uintptr_t vaddr, const uintptr_t *paddrs, size_t count, vm_protection_t prot, vm_cache_t cache);
+
+// Replaces a huge leaf with a table of next-size leaves carrying the same flags.
+int arch_paging_split_page(arch_paging_map_t *map, uintptr_t vaddr);
+
+// Ranges
+
+// Maps the physically contiguous range at `paddr` in one walk, using the largest leaves the alignment of both
+// addresses allows. Returns 0 on success or -1 if out of memory, leaving what was mapped so far in place.
+int arch_paging_map_range(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t paddr, size_t length, vm_protection_t prot, vm_cache_t cache);
+
+// Unmaps every leaf in the range and frees the tables left empty. Huge leaves crossing its ends are split first.
+int arch_paging_unmap_range(arch_paging_map_t *map, uintptr_t vaddr, size_t length);
+
+// Changes the protection of every leaf in the range. Huge leaves crossing its ends are split first.
+int arch_paging_prot_range(arch_paging_map_t *map, uintptr_t vaddr, size_t length, vm_protection_t prot);
+
 // Flags
 
 int arch_paging_prot_page(arch_paging_map_t *map, uintptr_t vaddr, size_t size, vm_protection_t prot);
 
+// Clears the accessed flag of the leaf mapping `vaddr`.
+// Returns whether the page was accessed since the flag was last cleared.
+bool arch_paging_test_and_clear_accessed(arch_paging_map_t *map, uintptr_t vaddr);
+
+// Returns whether the leaf mapping `vaddr` was written to. The flag is left set, clearing it is up to whoever
+// writes the page back. Without a hardware dirty flag, every writable mapping counts as dirty.
+bool arch_paging_is_dirty(const arch_paging_map_t *map, uintptr_t vaddr);
+
+// TLB maintenance
+
+// Invalidations of `map` made between these calls reach the other CPUs in one go when the batch ends.
+// Pages unmapped during the batch must not be freed before it ends. Batches don't migrate between CPUs,
+// so interrupts must stay masked throughout, e.g. by holding the address space lock.
+void arch_paging_batch_begin(arch_paging_map_t *map);
+void arch_paging_batch_end(arch_paging_map_t *map);
+
 // Utils
 
 bool arch_paging_vaddr_to_paddr(const arch_paging_map_t *map, uintptr_t vaddr, uintptr_t *out_paddr);
 
+// Returns the size of the leaf mapping `vaddr` or 0 if it is not mapped.
+size_t arch_paging_get_page_size(const arch_paging_map_t *map, uintptr_t vaddr);
+
 // Map creation and destruction
 
 arch_paging_map_t *arch_paging_map_create();
@@ -30,6 +69,8 @@ void arch_paging_map_destroy(arch_paging_map_t *map);
 // Map loading
 
 void arch_paging_map_load(arch_paging_map_t *map);
+// For threads that only use the kernel half: the CPU may keep the map it has loaded instead.
+void arch_paging_map_load_lazy(arch_paging_map_t *map);
 
 // Init
 
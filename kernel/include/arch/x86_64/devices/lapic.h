@@ -3,9 +3,12 @@
 #include <stdint.h>
 
 #define LAPIC_TIMER_VECTOR 33
+#define LAPIC_RESCHED_VECTOR 35
 
 void x86_64_lapic_send_eoi();
 
 void x86_64_lapic_ipi(uint32_t lapic_id, uint32_t vec);
 
+uint32_t x86_64_lapic_get_id();
+
 void x86_64_lapic_init_cpu();
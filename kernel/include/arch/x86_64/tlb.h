@@ -0,0 +1,22 @@
+#pragma once
+
+/*
+ * TLB shootdown
+ *
+ * Invalidations are sent to the other CPUs that have the address space
+ * loaded, or to all of them for kernel mappings, and waited on. A CPU spinning
+ * with interrupts masked still services them from arch_lcpu_relax(), so two
+ * CPUs shooting at each other can't deadlock.
+ */
+
+#define X86_64_TLB_SHOOTDOWN_VECTOR 34
+
+void x86_64_tlb_handle_ipi();
+
+/**
+ * @brief Service a shootdown aimed at this CPU, if any. Safe to call before
+ * the CPU is initialized.
+ */
+void x86_64_tlb_poll();
+
+void x86_64_tlb_init_cpu();
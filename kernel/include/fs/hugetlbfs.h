@@ -0,0 +1,14 @@
+#pragma once
+
+#include "fs/vfs.h"
+#include "mm/hugetlb.h"
+
+#define HUGETLBFS_IOCTL_GET_STATS 1 // args: hugetlb_stats_t *
+
+vfs_t *hugetlbfs_create(size_t page_size);
+
+/*
+ * Initialization
+ */
+
+void hugetlbfs_init();
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "fs/vfs.h"
+#include "mm/pm.h"
+#include <stdint.h>
+
+/*
+ * Page cache LRU
+ *
+ * Cached vnode pages sit on one of two lists. New pages start out inactive and
+ * are only activated when accessed again, so a single pass over a large file
+ * cycles through the inactive list instead of pushing out the working set.
+ * Reclaim evicts from the tail of the inactive list and keeps it from running
+ * dry by deactivating the oldest active pages. Dirty pages are written back
+ * with no lock held, and evicted on a later pass once they're clean.
+ */
+
+/**
+ * @brief Start tracking a page just inserted at `index` of `vn->pages`.
+ * The caller must hold `vn->pages_slock`.
+ */
+void page_cache_add(vnode_t *vn, uint64_t index, page_t *page);
+
+/**
+ * @brief Keep a cached page from being evicted, so that it can be used without
+ * the owning vnode's `pages_slock` held. The caller must hold it to pin.
+ */
+void page_cache_pin(page_t *page);
+void page_cache_unpin(page_t *page);
+
+/**
+ * @brief Record an access to a cached page. The page must be pinned.
+ */
+void page_cache_mark_accessed(page_t *page);
+
+// Initialization
+
+void page_cache_init();
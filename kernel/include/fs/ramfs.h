@@ -1,6 +1,7 @@
 #pragma once
 
 #include "fs/vfs.h"
+#include "sync/rwsem.h"
 
 typedef struct ramfs_node ramfs_node_t;
 
@@ -10,6 +11,7 @@ struct ramfs_node
     ramfs_node_t *parent;
 
     list_t children;
+    rwsem_t children_sem;
     xarray_t pages;
     size_t page_count;
 
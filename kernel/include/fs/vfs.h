@@ -69,6 +69,7 @@ struct vnode
 
     // Page cache
     xarray_t pages;
+    spinlock_t pages_slock;
 
     // FS-specific ops and data
     vnode_ops_t *ops;
@@ -103,7 +104,7 @@ struct vnode_ops
     // Misc
     int (*ioctl)(vnode_t *vn, uint64_t cmd, void *args);
     int (*mmap) (vnode_t *vn, vm_addrspace_t *as, uintptr_t vaddr, size_t length,
-                 int prot, int flags, uint64_t offset);
+                 int prot, int flags, uint64_t offset, uintptr_t *out);
 };
 
 void vnode_hold(vnode_t *vn);
@@ -123,7 +124,8 @@ void vnode_drop(vnode_t *vn);
 // Misc
 [[nodiscard]] int vfs_ioctl(vnode_t *vn, uint64_t cmd, void *args);
 [[nodiscard]] int vfs_mmap(vnode_t *vn, vm_addrspace_t *as, uintptr_t vaddr,
-                           size_t length, int prot, int flags, uint64_t offset);
+                           size_t length, int prot, int flags, uint64_t offset,
+                           uintptr_t *out);
 
 /*
  * Initialization
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "mm/pm.h"
+#include "sync/spinlock.h"
+#include "utils/list.h"
+#include <stddef.h>
+
+/*
+ * Huge page pools
+ *
+ * Blocks are taken out of the buddy allocator at boot and only ever handed
+ * out to hugetlb mappings. Pages are reserved when a mapping is created so
+ * that faulting them in later can't fail.
+ */
+
+typedef struct hugetlb_pool
+{
+    size_t page_size;
+    uint8_t order;
+
+    list_t free_pages;
+    size_t total;
+    size_t free;
+    size_t reserved; // Promised to a mapping but not faulted in yet.
+
+    spinlock_t slock;
+}
+hugetlb_pool_t;
+
+typedef struct
+{
+    size_t page_size;
+    size_t total;
+    size_t free;
+    size_t reserved;
+}
+hugetlb_stats_t;
+
+/**
+ * @brief Get the pool for the given huge page size.
+ * @return NULL if there is no pool for that size.
+ */
+hugetlb_pool_t *hugetlb_get_pool(size_t page_size);
+
+/**
+ * @brief Set aside `count` free pages for a mapping.
+ * @return false if the pool doesn't have enough unreserved pages.
+ */
+bool hugetlb_reserve(hugetlb_pool_t *pool, size_t count);
+void hugetlb_unreserve(hugetlb_pool_t *pool, size_t count);
+
+/**
+ * @brief Take a previously reserved page out of the pool.
+ */
+page_t *hugetlb_alloc(hugetlb_pool_t *pool);
+void hugetlb_free(hugetlb_pool_t *pool, page_t *page);
+/**
+ * @brief Put back a page from `hugetlb_alloc()` that went unused, reserved again.
+ */
+void hugetlb_free_reserved(hugetlb_pool_t *pool, page_t *page);
+
+// Counters
+
+size_t hugetlb_get_stats(hugetlb_stats_t *out, size_t max);
+
+// Initialization
+
+void hugetlb_init();
@@ -6,7 +6,6 @@
 
 #define MAG_SIZE 32
 #define SLAB_SIZE 0x1000
-#define MAX_CPUS 32
 
 typedef struct
 {
@@ -37,7 +36,7 @@ typedef struct
     list_t magazines_empty; // List of empty magazines.
     spinlock_t magazines_lock;
 
-    kmem_cpu_cache_t cpu_cache[MAX_CPUS];
+    uintptr_t cpu_cache; // Per-CPU kmem_cpu_cache_t, see `percpu_alloc()`.
 }
 kmem_cache_t;
 
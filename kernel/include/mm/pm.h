@@ -7,17 +7,33 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define PM_MAX_PAGE_ORDER 10
+#define PM_MAX_PAGE_ORDER 18 // 1GiB, the largest huge page size.
+
+struct vnode;
+struct vm_ksm_node;
 
 typedef struct page
 {
     uintptr_t addr;
     uint8_t order;
     bool free;
+    uint8_t age;      // Reclaim or working-set scans since the page was last seen accessed.
+    uint8_t wss_pass; // Working-set pass that last aged the page.
 
     atomic_uint mapcount;
     atomic_uint children;
 
+    // Page cache
+    struct vnode *vnode; // Owner, while the page is cached.
+    uint64_t index;
+    bool active;         // On the active LRU list rather than the inactive one.
+    bool referenced;     // Accessed since the LRU last looked at it.
+    atomic_uint pins;    // Users copying to or from it without the vnode locked, which keep it from being evicted.
+
+    // Same-page merging
+    struct vm_ksm_node *ksm; // Set while the page is shared by several objects.
+    uint32_t checksum;       // Contents when last scanned.
+
     list_node_t list_elem;
 }
 page_t;
@@ -47,6 +63,22 @@ page_t *pm_phys_to_page(uintptr_t phys);
 page_t *pm_alloc(uint8_t order);
 void pm_free(page_t *page);
 
+// Counters
+
+size_t pm_get_free_pages();
+size_t pm_get_total_pages();
+
+/**
+ * @brief Have `fn` called after any allocation that leaves fewer than `pages`
+ * pages free.
+ */
+void pm_set_low_watermark(size_t pages, void (*fn)());
+
+/**
+ * @brief Break an allocated block into independently freeable order-0 pages.
+ */
+void pm_split(page_t *page);
+
 // Initialization
 
 void pm_init();
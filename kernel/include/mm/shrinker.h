@@ -0,0 +1,37 @@
+#pragma once
+
+#include "utils/list.h"
+#include <stddef.h>
+
+/*
+ * Shrinkers
+ *
+ * Caches that can give memory back register a shrinker. Reclaim runs them
+ * before it starts compressing anonymous memory, since dropping a cached page
+ * is cheaper than swapping out one that is in use.
+ */
+
+typedef struct shrinker
+{
+    const char *name;
+    /**
+     * @brief Free up to `target` pages.
+     *
+     * With `direct` set it is called from an allocation that may hold any
+     * lock, so it must only try-lock.
+     *
+     * @return The number of pages freed.
+     */
+    size_t (*scan)(size_t target, bool direct);
+
+    list_node_t list_node;
+}
+shrinker_t;
+
+void shrinker_register(shrinker_t *shrinker);
+
+/**
+ * @brief Run the registered shrinkers until `target` pages were freed.
+ * @return The number of pages freed.
+ */
+size_t shrinker_run(size_t target, bool direct);
@@ -1,8 +1,11 @@
 #pragma once
 
 #include "arch/paging.h"
+#include "mm/vm/vm_wss.h"
+#include "sync/mutex.h"
 #include "sync/spinlock.h"
 #include "utils/list.h"
+#include "utils/ref.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -20,9 +23,13 @@ typedef struct vm_addrspace vm_addrspace_t;
 #define VM_MAP_FIXED           0x08
 #define VM_MAP_FIXED_NOREPLACE 0x10
 #define VM_MAP_POPULATE        0x20
+#define VM_MAP_HUGETLB         0x40 // Backed by the reserved 2MiB huge page pool. Shared mappings only.
+#define VM_MAP_HUGE_1GB        0x80 // Use the 1GiB pool instead. Requires VM_MAP_HUGETLB.
+#define VM_MAP_MERGEABLE       0x100 // Scanned for pages identical to others. Private anonymous memory only.
 
 struct vm_segment
 {
+    vm_addrspace_t *as;
     uintptr_t start;
     size_t length;
 
@@ -33,6 +40,7 @@ struct vm_segment
     size_t offset;
 
     list_node_t list_node;
+    list_node_t object_node; // Position in the object's reverse map.
 };
 
 struct vm_addrspace
@@ -43,12 +51,22 @@ struct vm_addrspace
     uintptr_t limit_high;
 
     spinlock_t slock;
+    mutex_t map_mutex; // Held across changes to the layout, which may run long, so that segments stay put without the spinlock.
+
+    vm_wss_histogram_t wss; // As of the last working-set scan.
+
+    ref_t refcount; // One for being on the address space list, plus one per walker holding on with the list unlocked.
+    uint64_t id;    // Creation order, which is also the order of the list.
+    list_node_t list_node;
 };
 
 // Global data
 
 extern vm_addrspace_t *vm_kernel_as;
 
+extern list_t vm_addrspace_list;
+extern spinlock_t vm_addrspace_list_slock;
+
 // Page fault handler
 
 bool vm_page_fault(vm_addrspace_t *as, uintptr_t virt, vm_fault_type_t type);
@@ -61,11 +79,24 @@ int vm_map(vm_addrspace_t *as, uintptr_t vaddr, size_t length,
            uintptr_t *out);
 int vm_unmap(vm_addrspace_t *as, uintptr_t vaddr, size_t length);
 int vm_protect(vm_addrspace_t *as, uintptr_t vaddr, size_t length, vm_protection_t prot);
+/**
+ * @brief Opt a range in or out of same-page merging. Pages that were already
+ * merged stay shared until written to.
+ */
+int vm_set_mergeable(vm_addrspace_t *as, uintptr_t vaddr, size_t length, bool mergeable);
 
 // Memory allocation
 
+/**
+ * @brief Allocate zeroed, page granular kernel memory from the kernel
+ * virtual address arena.
+ */
 void *vm_alloc(size_t size);
-void vm_free(void *obj);
+void *vm_alloc_prot(size_t size, vm_protection_t prot);
+/**
+ * @brief Free memory from vm_alloc(). `size` must be the allocation's size.
+ */
+void vm_free(void *obj, size_t size);
 
 // Userspace utils
 
@@ -76,7 +107,26 @@ size_t vm_zero_out_user(vm_addrspace_t *dest_as, uintptr_t dest, size_t count);
 // Address space creation and destruction
 
 vm_addrspace_t *vm_addrspace_create();
+/**
+ * Takes `as` off the address space list and queues it to be freed in the
+ * background along with its page tables and its references to the backing
+ * objects, once the last reference is dropped. It must not be loaded on any
+ * CPU, except by kernel threads borrowing it.
+ */
 void vm_addrspace_destroy(vm_addrspace_t *as);
+/**
+ * @brief Keep `as` from being freed, for walkers of the address space list
+ * that let go of its lock. Must be taken with the lock held.
+ */
+void vm_addrspace_ref(vm_addrspace_t *as);
+void vm_addrspace_unref(vm_addrspace_t *as);
+/**
+ * @brief Step through the user address spaces without holding the list lock.
+ * Returns the one after `prev`, or the first for NULL, referenced, and drops
+ * the reference to `prev`. Keeps going past one destroyed meanwhile.
+ * @return NULL at the end of the list.
+ */
+vm_addrspace_t *vm_addrspace_iter_next(vm_addrspace_t *prev);
 
 // Address space cloning
 
@@ -85,7 +135,13 @@ vm_addrspace_t *vm_addrspace_clone(vm_addrspace_t *as);
 // Address space loading
 
 void vm_addrspace_load(vm_addrspace_t *as);
+/**
+ * @brief Load the address space of a thread being switched to. Kernel threads
+ * may keep the address space that's loaded instead.
+ */
+void vm_addrspace_switch(vm_addrspace_t *as);
 
 // Initialization
 
 void vm_init();
+void vm_teardown_init();
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "arch/types.h"
+#include "mm/vm.h"
+#include "mm/vm/vm_object.h"
+
+/*
+ * Hugetlb mappings
+ */
+
+static inline size_t vm_hugetlb_page_size(int flags)
+{
+    return (flags & VM_MAP_HUGE_1GB) ? ARCH_PAGE_SIZE_1G : ARCH_PAGE_SIZE_2M;
+}
+
+/**
+ * @brief Create an object backed by the huge page pool of `page_size`, with
+ * enough pages reserved to cover `size` bytes.
+ *
+ * @return NULL if the pool can't cover the request.
+ */
+vm_object_t *vm_hugetlb_object_create(size_t page_size, size_t size);
+
+/**
+ * @brief Grow a hugetlb object to cover `size` bytes, reserving the extra
+ * pages.
+ */
+bool vm_hugetlb_object_grow(vm_object_t *obj, size_t size);
+
+/**
+ * @brief Map the huge page containing `vaddr`. The caller must hold the
+ * address space lock.
+ */
+bool vm_hugetlb_fault(vm_addrspace_t *as, vm_segment_t *seg, uintptr_t vaddr, vm_fault_type_t type);
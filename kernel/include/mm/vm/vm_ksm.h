@@ -0,0 +1,48 @@
+#pragma once
+
+#include "mm/pm.h"
+#include "mm/vm/vm_object.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Same-page merging
+ *
+ * Private anonymous segments marked mergeable are scanned in the background
+ * for pages with identical contents. Identical pages are collapsed into one
+ * read-only page that every object holding a copy refers to, and a write to it
+ * breaks the sharing again by copying it back into a private page.
+ *
+ * A page is only considered once its checksum stayed the same over two scans,
+ * so pages that are being written to don't get merged just to be copied again.
+ */
+
+typedef struct
+{
+    size_t pages_shared;  // Merged pages in use.
+    size_t pages_sharing; // Pages freed by mapping the merged ones instead.
+    size_t full_scans;
+}
+vm_ksm_stats_t;
+
+/**
+ * @brief Drop an object's reference to a merged page, freeing it if it was
+ * the last one.
+ */
+void vm_ksm_put(page_t *page);
+
+/**
+ * @brief Replace the merged page at `offset` of `obj` with a private copy
+ * ahead of a write. The caller must hold the object lock.
+ *
+ * @return The copy, or NULL if out of memory.
+ */
+page_t *vm_ksm_unshare(vm_object_t *obj, size_t offset, page_t *page);
+
+// Counters
+
+void vm_ksm_get_stats(vm_ksm_stats_t *out);
+
+// Initialization
+
+void vm_ksm_init();
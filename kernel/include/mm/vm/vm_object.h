@@ -3,6 +3,7 @@
 #include "fs/vfs.h"
 #include "mm/mm.h"
 #include "mm/pm.h"
+#include "mm/vm/vm_wss.h"
 #include "sync/spinlock.h"
 #include "utils/ref.h"
 #include "utils/xarray.h"
@@ -26,11 +27,14 @@ enum vm_object_type
     VM_OBJ_VNODE,
     VM_OBJ_PHYS,
     VM_OBJ_SHADOW,
+    VM_OBJ_HUGETLB,
 };
 
 struct vm_object_ops
 {
     bool (*get_page)(vm_object_t *obj, size_t offset, vm_fault_type_t fault_type, page_t **page_out);
+    // Optional. Backs an aligned, fully unpopulated huge page range with one physically contiguous block.
+    bool (*get_huge_page)(vm_object_t *obj, size_t offset, page_t **page_out);
     bool (*put_page)(vm_object_t *obj, page_t *page);
     void (*destroy) (vm_object_t *obj);
 };
@@ -65,9 +69,26 @@ struct vm_object
             size_t offset;
         }
         shadow;
+
+        struct
+        {
+            struct hugetlb_pool *pool;
+            size_t reserved; // Pool pages reserved for this object but not faulted in yet.
+        }
+        hugetlb;
     }
     source;
 
+    // Reverse map
+    list_t mappings;         // Segments mapping this object.
+    list_t shadows;          // Shadow objects backed by this one.
+    list_node_t shadow_node; // Position in the parent's `shadows`.
+    spinlock_t rmap_slock;
+
+    // Working-set estimation
+    vm_wss_histogram_t wss;
+    uint8_t wss_pass; // Pass that last reset `wss`.
+
     list_node_t list_node;
     spinlock_t slock;
     ref_t refcount;
@@ -88,8 +109,37 @@ void vm_object_unref(vm_object_t *obj);
 
 void vm_object_insert_page(vm_object_t *obj, page_t *page, size_t offset);
 void vm_object_remove_page(vm_object_t *obj, size_t offset);
+/**
+ * @brief Look up a resident page. Swapped out pages are not resident.
+ */
 page_t *vm_object_lookup_page(vm_object_t *obj, size_t offset);
 
+/*
+ * Swap
+ *
+ * A swapped out page keeps its slot in `cached_pages`, holding a swap entry
+ * instead of a page. All of these must be called with the object locked.
+ */
+
+bool vm_object_is_swapped(vm_object_t *obj, size_t offset);
+
+/**
+ * @brief Compress the resident page at `offset` out of the object and free it.
+ * The page must not be mapped anywhere.
+ */
+bool vm_object_swap_out(vm_object_t *obj, size_t offset);
+
+/**
+ * @brief Bring a swapped out page back in.
+ * @return EOK, ENOENT if the page isn't swapped out or ENOMEM.
+ */
+int vm_object_swap_in(vm_object_t *obj, size_t offset, page_t **page_out);
+
+/**
+ * @brief Free every page and swap entry held by the object.
+ */
+void vm_object_free_pages(vm_object_t *obj);
+
 /*
  * Sync
  */
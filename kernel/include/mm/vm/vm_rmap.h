@@ -0,0 +1,55 @@
+#pragma once
+
+#include "mm/pm.h"
+#include "mm/vm.h"
+#include "mm/vm/vm_object.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Reverse mapping
+ *
+ * Every object keeps the segments that map it and the shadow objects stacked
+ * on top of it. A page of an object is mapped by those segments, and by the
+ * segments of any shadow that has no copy of the page itself. Walking these
+ * lists finds every PTE mapping the page without scanning address spaces.
+ */
+
+// Maintenance
+
+void vm_rmap_add(vm_object_t *obj, vm_segment_t *seg);
+void vm_rmap_remove(vm_object_t *obj, vm_segment_t *seg);
+
+void vm_rmap_add_shadow(vm_object_t *parent, vm_object_t *shadow);
+void vm_rmap_remove_shadow(vm_object_t *parent, vm_object_t *shadow);
+
+// Walking
+
+/**
+ * @brief Called with the address space locked for every address mapping the page.
+ * @return false if the mapping couldn't be dealt with, which stops the walk short.
+ */
+typedef bool (*vm_rmap_fn_t)(vm_addrspace_t *as, uintptr_t vaddr, void *arg);
+
+/**
+ * @brief Call `fn` on every address mapping `page` as page `offset` of `obj`.
+ *
+ * Address spaces other than `locked_as`, which the caller already holds, are
+ * only try-locked so that this can be called with object locks held.
+ *
+ * @return false if a busy address space had to be skipped or `fn` failed.
+ */
+bool vm_rmap_walk(vm_object_t *obj, size_t offset, page_t *page, vm_addrspace_t *locked_as,
+                  vm_rmap_fn_t fn, void *arg);
+
+/**
+ * @brief Zap every PTE mapping the page.
+ * @return false if the page may still be mapped somewhere.
+ */
+bool vm_rmap_unmap(vm_object_t *obj, size_t offset, page_t *page, vm_addrspace_t *locked_as);
+
+/**
+ * @brief Test and clear the accessed flag of every PTE mapping the page.
+ * @return The number of mappings that accessed it since the last check.
+ */
+size_t vm_rmap_referenced(vm_object_t *obj, size_t offset, page_t *page, vm_addrspace_t *locked_as);
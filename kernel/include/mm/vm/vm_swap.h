@@ -0,0 +1,70 @@
+#pragma once
+
+#include "mm/pm.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compressed swap
+ *
+ * There is no swap device. When memory runs low, cold anonymous pages are
+ * compressed into a pool of kernel pages. Each one's slot in its object is
+ * replaced by a swap entry: a tagged pointer to the compressed copy. Faulting
+ * the page back in decompresses it into a new page.
+ *
+ * Cold pages are found by aging them on every scan. A page that was accessed
+ * since the last scan gets its age reset, and otherwise it ages by one. The
+ * working-set scanner ages pages in between, too.
+ *
+ * The swap daemon is also the background reclaimer. It is woken once free
+ * memory drops below the low watermark and runs the shrinkers before it
+ * compresses anything.
+ */
+
+#define VM_SWAP_ENTRY_TAG 1ul
+
+typedef struct
+{
+    size_t stored_pages;     // Pages currently held in compressed form.
+    size_t compressed_bytes; // Their total compressed size.
+    size_t pool_pages;       // Pages backing the compressed pool.
+    size_t swapped_out;
+    size_t swapped_in;
+    size_t rejected;         // Pages that didn't compress well enough to be worth storing.
+}
+vm_swap_stats_t;
+
+static inline bool vm_swap_is_entry(const void *entry)
+{
+    return (uintptr_t)entry & VM_SWAP_ENTRY_TAG;
+}
+
+/**
+ * @brief Store a compressed copy of `page`.
+ * @return The swap entry, or NULL if the page doesn't compress well or the
+ * pool is out of memory.
+ */
+void *vm_swap_out(page_t *page);
+
+/**
+ * @brief Decompress a swap entry into a new page and free the entry.
+ * @return NULL if out of memory, in which case the entry is left untouched.
+ */
+page_t *vm_swap_in(void *entry);
+
+void vm_swap_free(void *entry);
+
+/**
+ * @brief Allocate a page, shrinking caches and compressing cold pages to make
+ * room if memory ran out. Address spaces and objects that are currently locked
+ * are skipped.
+ */
+page_t *vm_swap_alloc_page();
+
+// Counters
+
+void vm_swap_get_stats(vm_swap_stats_t *out);
+
+// Initialization
+
+void vm_swap_init();
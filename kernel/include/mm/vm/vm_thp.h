@@ -0,0 +1,31 @@
+#pragma once
+
+#include "arch/types.h"
+#include "mm/vm.h"
+
+/*
+ * Transparent huge pages
+ */
+
+#define VM_THP_SIZE  ARCH_PAGE_SIZE_2M
+#define VM_THP_PAGES (VM_THP_SIZE / ARCH_PAGE_GRAN)
+#define VM_THP_ORDER 9
+
+/**
+ * @brief Try to back the huge page range containing `vaddr` with a single
+ * 2MiB mapping. The caller must hold the address space lock.
+ *
+ * @return true if a huge page was mapped, false if the caller should fall
+ * back to 4KiB pages.
+ */
+bool vm_thp_fault(vm_addrspace_t *as, vm_segment_t *seg, uintptr_t vaddr, vm_fault_type_t type);
+
+/**
+ * @brief Split the huge page mapping `vaddr`, if any, into 4KiB mappings.
+ * @return ENOMEM if the page table for them couldn't be allocated.
+ */
+int vm_thp_split(vm_addrspace_t *as, uintptr_t vaddr);
+
+// Initialization
+
+void vm_thp_init();
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Forward declarrations
+ */
+
+typedef struct vm_addrspace vm_addrspace_t;
+typedef struct vm_object vm_object_t;
+
+//
+
+/*
+ * Working-set estimation
+ *
+ * A background scanner harvests the accessed flags of every mapped user page
+ * at a fixed interval, clearing them as it goes, and ages the pages that were
+ * not accessed since the last pass. These are the same ages reclaim goes by.
+ *
+ * Each pass leaves every address space and every mapped object with a
+ * histogram of how many of its pages fall into each age bucket. A process's
+ * working set is that of its address space. Pages shared between several
+ * address spaces count towards each of them, but only once towards the object
+ * they were first found through.
+ */
+
+#define VM_WSS_BUCKETS 5 // Pages last accessed 0, 1, 2-3, 4-7 and 8 or more passes ago.
+
+typedef struct
+{
+    size_t pages[VM_WSS_BUCKETS];
+    size_t dirty; // Pages written to since they were last written back, in any bucket.
+}
+vm_wss_histogram_t;
+
+// Counters
+
+/**
+ * @brief Get the histogram of the pages mapped by `as` as of the last pass.
+ */
+void vm_wss_get_addrspace(vm_addrspace_t *as, vm_wss_histogram_t *out);
+
+/**
+ * @brief Get the histogram of the mapped pages of `obj` as of the last pass
+ * that reached it.
+ */
+void vm_wss_get_object(vm_object_t *obj, vm_wss_histogram_t *out);
+
+// Idle page tracking
+
+/**
+ * @brief Set a bit in `bitmap` for every page of [vaddr, vaddr + length) that
+ * is mapped and wasn't accessed for at least `min_age` passes. The caller must
+ * hold the address space lock.
+ *
+ * @return The number of idle pages.
+ */
+size_t vm_wss_get_idle(vm_addrspace_t *as, uintptr_t vaddr, size_t length, uint8_t min_age, uint64_t *bitmap);
+
+// Initialization
+
+void vm_wss_init();
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "sync/spinlock.h"
+#include "utils/list.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Resource arenas
+ *
+ * A vmem arena hands out integer ranges, such as kernel virtual addresses,
+ * in multiples of its quantum. It only tracks ranges. Backing them with
+ * memory is up to the caller.
+ *
+ * Every span, free range and allocated range is described by a boundary tag.
+ * The tags are kept in address order, so a freed range merges with its free
+ * neighbours in constant time. Free tags are also kept in power-of-two size
+ * lists. An allocation takes the first tag of the smallest list whose ranges
+ * are all big enough ("instant fit"). Allocated tags are hashed by address
+ * so that frees can find them.
+ *
+ * Requests of up to VMEM_QCACHE_MAX quanta are served by quantum caches.
+ * These are per-CPU magazines of ready-made ranges, refilled from and flushed
+ * to the arena in batches. Most small allocations never touch the arena lock.
+ */
+
+#define VMEM_FREELISTS 64
+#define VMEM_HASH_BUCKETS 256
+#define VMEM_QCACHE_MAX 8
+#define VMEM_MAG_SIZE 16
+
+typedef enum
+{
+    VMEM_SEG_SPAN,
+    VMEM_SEG_FREE,
+    VMEM_SEG_ALLOC
+}
+vmem_seg_type_t;
+
+typedef struct
+{
+    uintptr_t base;
+    size_t size;
+    vmem_seg_type_t type;
+
+    list_node_t seg_node;  // Position in the address ordered tag list.
+    list_node_t list_node; // Position in a free list or a hash chain.
+}
+vmem_seg_t;
+
+typedef struct
+{
+    size_t count;
+    uintptr_t ranges[VMEM_MAG_SIZE];
+    spinlock_t slock;
+}
+vmem_magazine_t;
+
+typedef struct
+{
+    const char *name;
+    size_t quantum;
+
+    list_t segs;
+    list_t freelists[VMEM_FREELISTS]; // List `i` holds free ranges of [2^i, 2^(i+1)) bytes.
+    list_t hash[VMEM_HASH_BUCKETS];
+    size_t in_use;
+    spinlock_t slock;
+
+    uintptr_t qcache; // Per-CPU array of VMEM_QCACHE_MAX magazines, indexed by the size in quanta minus one. See `percpu_alloc()`.
+}
+vmem_t;
+
+void vmem_init(vmem_t *vmem, const char *name, size_t quantum);
+
+/**
+ * @brief Give the arena a new span of resources to allocate from.
+ * @return false if the span's tags couldn't be allocated.
+ */
+bool vmem_add(vmem_t *vmem, uintptr_t base, size_t size);
+
+/**
+ * @brief Allocate `size` bytes, rounded up to the quantum.
+ * @return 0 if the arena is exhausted. Arenas must not contain address 0.
+ */
+uintptr_t vmem_alloc(vmem_t *vmem, size_t size);
+
+/**
+ * @brief Return a range. `size` must match the size it was allocated with.
+ */
+void vmem_free(vmem_t *vmem, uintptr_t addr, size_t size);
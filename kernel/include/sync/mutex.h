@@ -0,0 +1,41 @@
+#pragma once
+
+#include "sync/spinlock.h"
+#include "sync/waitqueue.h"
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct thread thread_t;
+
+/*
+ * Mutexes
+ *
+ * Sleeping locks for critical sections that may take long or block, which
+ * leave interrupts alone. A contended mutex is spun on for as long as its owner
+ * is running, as it will likely be let go of before a sleep would pay off, and
+ * slept on otherwise. Mutexes can't be taken with a spinlock held or from
+ * interrupt handlers.
+ */
+
+typedef struct
+{
+    uint8_t locked;
+    size_t waiters;
+    thread_t *owner; // Only a hint for spinning.
+
+    waitqueue_t wq;
+    spinlock_t slock;
+}
+mutex_t;
+
+#define MUTEX_INIT { .locked = 0, .waiters = 0, .owner = NULL, .wq = WAITQUEUE_INIT, .slock = SPINLOCK_INIT }
+
+void mutex_acquire(mutex_t *mutex);
+
+/**
+ * @brief Acquire the mutex only if it is free.
+ * @return true if the mutex was acquired.
+ */
+bool mutex_try_acquire(mutex_t *mutex);
+
+void mutex_release(mutex_t *mutex);
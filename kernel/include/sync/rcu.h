@@ -0,0 +1,63 @@
+#pragma once
+
+#include "utils/list.h"
+
+/*
+ * Read-copy-update
+ *
+ * Readers walk shared structures without taking any lock, in read sections
+ * which can't block. Writers serialize among themselves with a lock of their
+ * own, publish new objects with RCU_ASSIGN and only free the ones they took
+ * out once a grace period has passed, that is once every reader that might
+ * still see them has left its read section.
+ *
+ * Read sections run with interrupts masked, so a CPU that went through the
+ * scheduler or the idle loop is known to be outside of any. Grace periods end
+ * once every CPU did so after they started.
+ */
+
+typedef struct rcu_head
+{
+    void (*func)(struct rcu_head *head);
+    list_node_t list_node;
+}
+rcu_head_t;
+
+/// @brief Load a pointer published with RCU_ASSIGN, for use within a read section.
+#define RCU_DEREFERENCE(PTR) __atomic_load_n(&(PTR), __ATOMIC_ACQUIRE)
+
+/// @brief Publish `VALUE` through `PTR`, once whatever it points to is fully set up.
+#define RCU_ASSIGN(PTR, VALUE) __atomic_store_n(&(PTR), (VALUE), __ATOMIC_RELEASE)
+
+/**
+ * @brief Enter a read section, masking interrupts until the outermost one is
+ * left. Read sections nest.
+ */
+void rcu_read_lock();
+
+void rcu_read_unlock();
+
+/**
+ * @brief Wait for a grace period to pass, blocking. Can't be called from a
+ * read section or with a spinlock held.
+ */
+void synchronize_rcu();
+
+/**
+ * @brief Have `func` called with `head` once a grace period has passed,
+ * without blocking. The call comes from a kernel thread of its own.
+ */
+void call_rcu(rcu_head_t *head, void (*func)(rcu_head_t *head));
+
+/**
+ * @brief Report a quiescent state for the calling CPU. Called by the scheduler
+ * with interrupts masked.
+ */
+void rcu_quiescent();
+
+/**
+ * @brief Start waiting on the calling CPU for grace periods to end.
+ */
+void rcu_init_cpu();
+
+void rcu_init();
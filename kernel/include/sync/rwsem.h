@@ -0,0 +1,42 @@
+#pragma once
+
+#include "sync/spinlock.h"
+#include "sync/waitqueue.h"
+#include <stddef.h>
+
+/*
+ * Reader-writer semaphores
+ *
+ * Sleeping locks held by any number of readers or by a single writer. Readers
+ * queue up behind a waiting writer, so that a steady stream of them can't
+ * starve it.
+ */
+
+typedef struct
+{
+    size_t readers;
+    bool writer;
+    size_t writers_waiting;
+
+    waitqueue_t readers_wq;
+    waitqueue_t writers_wq;
+    spinlock_t slock;
+}
+rwsem_t;
+
+#define RWSEM_INIT {                    \
+    .readers = 0,                       \
+    .writer = false,                    \
+    .writers_waiting = 0,               \
+    .readers_wq = WAITQUEUE_INIT,       \
+    .writers_wq = WAITQUEUE_INIT,       \
+    .slock = SPINLOCK_INIT              \
+}
+
+void rwsem_acquire_read(rwsem_t *sem);
+
+void rwsem_release_read(rwsem_t *sem);
+
+void rwsem_acquire_write(rwsem_t *sem);
+
+void rwsem_release_write(rwsem_t *sem);
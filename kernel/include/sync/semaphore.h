@@ -0,0 +1,37 @@
+#pragma once
+
+#include "sync/spinlock.h"
+#include "sync/waitqueue.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Counting semaphores
+ */
+
+typedef struct
+{
+    size_t count;
+
+    waitqueue_t wq;
+    spinlock_t slock;
+}
+semaphore_t;
+
+#define SEMAPHORE_INIT(COUNT) { .count = (COUNT), .wq = WAITQUEUE_INIT, .slock = SPINLOCK_INIT }
+
+/**
+ * @brief Take one unit, blocking until there is one or until the uptime
+ * reaches `deadline` nanoseconds.
+ *
+ * @return EOK, or ETIMEDOUT if none became available by the deadline.
+ */
+int semaphore_down(semaphore_t *sem, uint64_t deadline);
+
+/**
+ * @brief Take one unit only if there is one available.
+ * @return true if a unit was taken.
+ */
+bool semaphore_try_down(semaphore_t *sem);
+
+void semaphore_up(semaphore_t *sem);
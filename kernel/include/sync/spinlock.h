@@ -2,17 +2,41 @@
 
 #include <stdint.h>
 
+/*
+ * Spinlocks
+ *
+ * Queued locks, handed over in the order they were asked for. Each waiter
+ * spins on a node of its own rather than on the lock, so that only the one at
+ * the head of the queue watches the lock word. The word holds the tail of the
+ * queue shifted up by a byte, with the lowest byte set while the lock is held,
+ * so that letting go of the lock is a plain store rather than a locked RMW.
+ */
+
 typedef struct
 {
-    uint8_t lock;
+    union
+    {
+        uintptr_t word;
+        uint8_t locked; // Lowest byte of the word, both architectures being little-endian.
+    };
     bool prev_int_state;
 }
 spinlock_t;
 
-#define SPINLOCK_INIT ((spinlock_t) {.lock = 0, .prev_int_state = 0 })
+#define SPINLOCK_INIT ((spinlock_t) {.word = 0, .prev_int_state = 0 })
 
+/**
+ * @brief Acquire the lock with interrupts masked, which they stay until it is
+ * released.
+ */
 void spinlock_acquire(volatile spinlock_t *slock);
 
+/**
+ * @brief Acquire the lock only if it is free.
+ * @return true if the lock was acquired.
+ */
+bool spinlock_try_acquire(volatile spinlock_t *slock);
+
 void spinlock_release(volatile spinlock_t *slock);
 
 void spinlock_primitive_acquire(volatile spinlock_t *slock);
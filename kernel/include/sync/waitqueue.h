@@ -0,0 +1,58 @@
+#pragma once
+
+#include "sync/spinlock.h"
+#include "uapi/errno.h"
+#include "utils/list.h"
+#include <stdint.h>
+
+/*
+ * Wait queues
+ *
+ * Threads block on a wait queue until a condition, protected by some lock,
+ * holds. They queue up while still holding that lock and only let go of it to
+ * block, so whoever changes the condition under the same lock and wakes the
+ * queue afterwards can't miss them.
+ */
+
+typedef struct
+{
+    list_t waiters;
+    spinlock_t slock;
+}
+waitqueue_t;
+
+#define WAITQUEUE_INIT { .waiters = LIST_INIT, .slock = SPINLOCK_INIT }
+
+#define WAITQUEUE_FOREVER UINT64_MAX // A deadline that never passes.
+
+/**
+ * @brief Block until woken through `wq`, or until the uptime reaches `deadline`
+ * nanoseconds. `lock` is held on entry, let go of while blocked and held again
+ * on return. Wake-ups may be spurious.
+ *
+ * @return EOK, or ETIMEDOUT if the deadline passed without a wake-up.
+ */
+int waitqueue_wait(waitqueue_t *wq, spinlock_t *lock, uint64_t deadline);
+
+/**
+ * @brief Wait on `WQ` until `COND` holds. `COND` is evaluated with `LOCK` held,
+ * which it is on entry and on return.
+ *
+ * @return EOK, or ETIMEDOUT if `COND` still didn't hold by the deadline.
+ */
+#define WAITQUEUE_WAIT_EVENT(WQ, LOCK, COND, DEADLINE) ({           \
+    int __err = EOK;                                                \
+    while (__err == EOK && !(COND))                                 \
+        __err = waitqueue_wait((WQ), (LOCK), (DEADLINE));           \
+    if (__err != EOK && (COND))                                     \
+        __err = EOK;                                                \
+    __err;                                                          \
+})
+
+/**
+ * @brief Wake the thread that has been waiting on `wq` the longest.
+ * @return false if there was none.
+ */
+bool waitqueue_wake_one(waitqueue_t *wq);
+
+void waitqueue_wake_all(waitqueue_t *wq);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "sync/rcu.h"
 #include "sync/spinlock.h"
 #include "sys/types.h"
 #include "utils/ref.h"
@@ -49,6 +50,7 @@ struct file
 
     ref_t refcount;
     spinlock_t slock;
+    rcu_head_t rcu; // Files are freed after a grace period, see `fd_get_file()`.
 };
 
 /*
@@ -83,4 +85,12 @@ file_t *file_create_msgq(msgq_t *mq, int flags);
 file_t *file_create_eventq(eventq_t *eq, int flags);
 
 void file_ref(file_t *file);
+
+/**
+ * @brief Take a reference to a file found in an RCU read section, unless its
+ * last one is already gone.
+ * @return false if the file is on its way out.
+ */
+bool file_try_ref(file_t *file);
+
 void file_unref(file_t *file);
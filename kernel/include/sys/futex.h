@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct vm_addrspace vm_addrspace_t;
+
+/*
+ * Futexes
+ *
+ * Threads wait on a 32-bit word of user memory. Words are told apart by the
+ * object they are mapped from and their offset in it, so a word in shared
+ * memory is the same futex in every address space mapping it. Process-private
+ * futexes go by address space and address alone, which is cheaper to look up.
+ */
+
+/**
+ * @brief Block until woken through the futex at `uaddr`, as long as it holds
+ * `val`. Only wake-ups with a bit in common with `bitset` count.
+ *
+ * @return EOK once woken, EAGAIN if the word didn't hold `val`, ETIMEDOUT once
+ * the uptime reached `deadline` nanoseconds, UINT64_MAX for never.
+ */
+int futex_wait(vm_addrspace_t *as, uintptr_t uaddr, bool private, uint32_t val, uint32_t bitset, uint64_t deadline);
+
+/**
+ * @brief Wake up to `count` of the threads waiting on the futex at `uaddr`
+ * with a bit in common with `bitset`, longest waiting first.
+ */
+int futex_wake(vm_addrspace_t *as, uintptr_t uaddr, bool private, uint32_t bitset, size_t count, size_t *out_woken);
+
+/**
+ * @brief Wake up to `wake_count` threads waiting on the futex at `uaddr` and
+ * move up to `requeue_count` of the others over to the one at `uaddr2`. With
+ * `cmp` set, nothing happens unless the word at `uaddr` still holds `*cmp`.
+ *
+ * @param out Set to the number of threads woken and moved.
+ * @return EOK, or EAGAIN if the word didn't hold `*cmp`.
+ */
+int futex_requeue(vm_addrspace_t *as, uintptr_t uaddr, uintptr_t uaddr2, bool private,
+                  size_t wake_count, size_t requeue_count, const uint32_t *cmp, size_t *out);
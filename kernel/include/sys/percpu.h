@@ -0,0 +1,105 @@
+#pragma once
+
+#include "arch/lcpu.h"
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct thread thread_t;
+
+/*
+ * Per-CPU data
+ *
+ * Every CPU gets an area of its own, copied at boot from the template the
+ * `.percpu` section holds, and finds it through a register of its own: GS on
+ * x86_64, TPIDR_EL1 on aarch64. A per-CPU variable is found by its offset into
+ * the template, which is the same in every area. What's left of an area past
+ * the template is handed out at run time by `percpu_alloc()`.
+ *
+ * The THIS_CPU_READ/WRITE/ADD accessors can be used anywhere, as they access
+ * the calling CPU's copy in one go. A pointer to the calling CPU's copy stays
+ * its own only as long as the thread can't be moved to another CPU, that is
+ * while interrupts are masked.
+ */
+
+extern char __percpu_start[];
+extern char __percpu_end[];
+
+#define PERCPU_DEFINE(TYPE, NAME) __attribute__((section(".percpu"))) TYPE NAME
+#define PERCPU_DECLARE(TYPE, NAME) extern TYPE NAME
+
+/// @brief Offset of per-CPU variable `VAR` into every per-CPU area.
+#define PERCPU_OFFSET(VAR) ((uintptr_t)&(VAR) - (uintptr_t)__percpu_start)
+
+/// @brief Pointer to the copy of per-CPU variable `VAR` belonging to CPU `CPU`.
+#define PERCPU_PTR(VAR, CPU) ((typeof(&(VAR)))percpu_ptr(PERCPU_OFFSET(VAR), (CPU)))
+
+/// @brief Pointer to the calling CPU's copy of per-CPU variable `VAR`. Interrupts must be masked.
+#define THIS_CPU_PTR(VAR) ((typeof(&(VAR)))percpu_this_ptr(PERCPU_OFFSET(VAR)))
+
+#define THIS_CPU_READ(VAR) ({                                           \
+    static_assert(sizeof(VAR) == sizeof(uint64_t));                     \
+    (typeof(VAR))arch_lcpu_percpu_read(PERCPU_OFFSET(VAR));             \
+})
+
+#define THIS_CPU_WRITE(VAR, VALUE) ({                                   \
+    static_assert(sizeof(VAR) == sizeof(uint64_t));                     \
+    arch_lcpu_percpu_write(PERCPU_OFFSET(VAR), (uint64_t)(VALUE));      \
+})
+
+#define THIS_CPU_ADD(VAR, VALUE) ({                                     \
+    static_assert(sizeof(VAR) == sizeof(uint64_t));                     \
+    arch_lcpu_percpu_add(PERCPU_OFFSET(VAR), (uint64_t)(VALUE));        \
+})
+
+/// @brief Sum of 64-bit per-CPU counter `VAR` over all CPUs. Not a snapshot, the counter may move meanwhile.
+#define PERCPU_SUM(VAR) percpu_sum(PERCPU_OFFSET(VAR))
+
+/*
+ * Every area starts with its head.
+ */
+
+typedef struct
+{
+    uintptr_t base; // The area's own address. Must come first, see `arch_lcpu_percpu_set_base()`.
+    size_t cpu_id;
+    thread_t *curr_thread;
+    uint64_t scratch; // Free for use by the arch code with interrupts masked.
+}
+percpu_head_t;
+
+PERCPU_DECLARE(percpu_head_t, percpu_head);
+
+extern size_t percpu_cpu_count;
+
+/**
+ * @brief Allocate `size` bytes in every per-CPU area, zeroed. Never freed.
+ * @return Offset of the allocation into every area.
+ */
+uintptr_t percpu_alloc(size_t size);
+
+/// @brief Address `offset` bytes into the per-CPU area of CPU `cpu_id`.
+void *percpu_ptr(uintptr_t offset, size_t cpu_id);
+
+/// @brief Address `offset` bytes into the calling CPU's per-CPU area. Interrupts must be masked.
+void *percpu_this_ptr(uintptr_t offset);
+
+/// @brief Sum of the 64-bit counter `offset` bytes into every per-CPU area.
+uint64_t percpu_sum(uintptr_t offset);
+
+/**
+ * @brief Run on the template area as CPU 0 until `percpu_init()`, with
+ * `thread` as the current thread.
+ */
+void percpu_init_early(thread_t *thread);
+
+/**
+ * @brief Set up the area of every CPU and move the bootstrap CPU to its own.
+ * Needs the physical memory manager.
+ */
+void percpu_init();
+
+/**
+ * @brief Load the area of CPU `cpu_id` on the calling CPU, with `thread` as
+ * the current thread.
+ */
+void percpu_load(size_t cpu_id, thread_t *thread);
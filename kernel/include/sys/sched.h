@@ -11,4 +11,35 @@ void sched_enqueue(thread_t *t);
 void sched_preempt();
 void sched_yield(thread_status_t status);
 
+/**
+ * @brief Put the current thread to sleep for at least `ns` nanoseconds, or
+ * until woken.
+ */
+void sched_sleep(uint64_t ns);
+/**
+ * @brief Mark the current thread as blocked until woken by sched_wake(), or
+ * until the uptime reaches `deadline` nanoseconds, UINT64_MAX for never. It
+ * keeps running until sched_block() and isn't lost being woken meanwhile.
+ * Interrupts must stay masked until then, being preempted in between would
+ * mark it ready again and lose the wake-up.
+ */
+void sched_block_prepare(uint64_t deadline);
+/**
+ * @brief Switch away from the current thread, marked as blocked by
+ * sched_block_prepare(), until it's woken or its deadline passes.
+ */
+void sched_block();
+
+/**
+ * @brief Wake a thread put to sleep by sched_sleep() ahead of its deadline, or
+ * a blocked one. Other threads are left alone.
+ */
+void sched_wake(thread_t *t);
+
+/**
+ * @brief Run the idle loop of the current CPU. The CPU halts whenever it has
+ * nothing to run, with its timer only armed for what it has to wake up for.
+ */
+[[noreturn]] void sched_idle();
+
 void sched_init_cpu();
@@ -1,18 +1,42 @@
 #pragma once
 
+#include "sync/spinlock.h"
 #include "thread.h"
 #include "utils/list.h"
+#include "utils/pheap.h"
 
 typedef struct smp_cpu smp_cpu_t;
 typedef struct proc proc_t;
 typedef struct thread thread_t;
 
+#define SCHED_MLFQ_LEVELS 16
+
+typedef struct
+{
+    list_t queues[SCHED_MLFQ_LEVELS];
+    size_t count; // Threads queued over all levels. Read without the lock when looking for work to steal.
+    pheap_t sleepers; // Sleeping threads, earliest deadline first. They aren't counted and never stolen.
+    spinlock_t slock;
+}
+sched_runqueue_t;
+
+#define SCHED_RUNQUEUE_INIT { \
+    .queues = { [0 ... SCHED_MLFQ_LEVELS - 1] = LIST_INIT }, \
+    .count = 0, \
+    .sleepers = PHEAP_INIT, \
+    .slock = SPINLOCK_INIT \
+}
+
 typedef struct smp_cpu
 {
     size_t id;
     thread_t *idle_thread;
     thread_t *curr_thread;
 
+    sched_runqueue_t rq; // Ready threads that last ran on this CPU.
+    bool idle; // Halted in the idle loop, or about to be. Cleared by whoever wakes it up.
+    bool need_resched; // Set before sending the reschedule IPI, which does nothing otherwise.
+
     list_node_t cpu_list_node;
 }
 smp_cpu_t;
@@ -6,6 +6,7 @@
 #include "mm/vm.h"
 #include "sys/proc.h"
 #include "sys/thread.h"
+#include "uapi/time.h"
 
 /*
  * Helpers
@@ -50,6 +51,8 @@ sys_ret_t syscall_seek(int fd, size_t offset, int whence);
  */
 
 sys_ret_t syscall_mmap(uintptr_t addr, size_t len, int prot, int flags, int fd, size_t off);
+sys_ret_t syscall_madvise(uintptr_t addr, size_t len, int advice);
+sys_ret_t syscall_get_idle_pages(uintptr_t addr, size_t len, unsigned min_age, uint64_t *bitmap);
 
 /*
  * Process
@@ -63,6 +66,8 @@ sys_ret_t syscall_get_pid();
 sys_ret_t syscall_get_ppid();
 sys_ret_t syscall_get_tid();
 sys_ret_t syscall_tcb_set(void *ptr);
+sys_ret_t syscall_sleep(unsigned us);
+sys_ret_t syscall_nanosleep(const struct timespec *req, struct timespec *rem);
 
 /*
  * Sockets
@@ -81,3 +86,9 @@ sys_ret_t syscall_recv(int sockfd, void *buf, size_t len, int flags);
 sys_ret_t syscall_send(int sockfd, const void *buf, size_t len, int flags);
 sys_ret_t syscall_shutdown(int sockfd, int how);
 sys_ret_t syscall_socket(int domain, int type, int protocol);
+
+/*
+ * Synchronization
+ */
+
+sys_ret_t syscall_futex(uint32_t *uaddr, int op, uint32_t val, const struct timespec *timeout, uint32_t *uaddr2, uint32_t val3);
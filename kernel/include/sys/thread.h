@@ -3,6 +3,7 @@
 #include "arch/thread.h"
 #include "sys/proc.h"
 #include "utils/list.h"
+#include "utils/pheap.h"
 #include "utils/ref.h"
 #include <stdint.h>
 
@@ -38,6 +39,7 @@ struct thread
 
     list_node_t proc_thread_list_node;
     list_node_t sched_thread_list_node;
+    pheap_node_t sleep_node; // Position among the sleepers of the assigned CPU.
     ref_t refcount;
     spinlock_t slock;
 };
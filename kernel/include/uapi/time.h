@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+
+struct timespec
+{
+    int64_t tv_sec;
+    long tv_nsec;
+};
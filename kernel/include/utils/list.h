@@ -45,3 +45,19 @@ void list_remove(list_t *list, list_node_t *node);
 
 list_node_t *list_pop_head(list_t *list);
 list_node_t *list_pop_tail(list_t *list);
+
+/*
+ * RCU variants
+ *
+ * Lists changed only through these can be walked forwards with FOREACH_RCU in
+ * an RCU read section, while writers hold whatever lock they share. A removed
+ * node may still be walked over until a grace period has passed.
+ */
+
+#define FOREACH_RCU(NODE, LIST) for (list_node_t *NODE = __atomic_load_n(&(LIST).head, __ATOMIC_ACQUIRE); \
+                                     NODE != NULL;                                                      \
+                                     NODE = __atomic_load_n(&NODE->next, __ATOMIC_ACQUIRE))
+
+void list_append_rcu(list_t *list, list_node_t *node);
+
+void list_remove_rcu(list_t *list, list_node_t *node);
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * LZ4 block format codec
+ *
+ * Only single blocks are supported, with inputs of at most 64KiB.
+ */
+
+#define LZ4_MAX_INPUT_SIZE 0x10000
+#define LZ4_HASH_LOG 12
+
+typedef struct
+{
+    uint16_t table[1 << LZ4_HASH_LOG];
+}
+lz4_workmem_t;
+
+/**
+ * @brief Compress `src_len` bytes into at most `dst_cap` bytes.
+ * @return The compressed size, or 0 if it would exceed `dst_cap`.
+ */
+size_t lz4_compress(const void *src, size_t src_len, void *dst, size_t dst_cap, lz4_workmem_t *workmem);
+
+/**
+ * @brief Decompress a block into at most `dst_cap` bytes.
+ * @return The decompressed size, or 0 if the block is malformed or too large.
+ */
+size_t lz4_decompress(const void *src, size_t src_len, void *dst, size_t dst_cap);
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Pairing heap
+ *
+ * An intrusive min-heap. Inserting is O(1), popping the minimum and removing
+ * an arbitrary node are O(log n) amortized, and nothing is ever allocated.
+ */
+
+typedef struct pheap_node
+{
+    struct pheap_node *child;
+    struct pheap_node *next;
+    struct pheap_node *prev; // Previous sibling, or the parent for a first child.
+}
+pheap_node_t;
+
+typedef bool (*pheap_less_t)(const pheap_node_t *a, const pheap_node_t *b);
+
+typedef struct
+{
+    pheap_node_t *root;
+}
+pheap_t;
+
+/// @param NODE Heap node.
+/// @param TYPE The type of the container.
+/// @param MEMBER The pheap_node_t member inside of the container.
+/// @return Pointer to the container.
+#define PHEAP_GET_CONTAINER(NODE, TYPE, MEMBER) ((TYPE *)((uintptr_t)(NODE) - __builtin_offsetof(TYPE, MEMBER)))
+
+#define PHEAP_NODE_INIT (pheap_node_t) { .child = NULL, .next = NULL, .prev = NULL }
+
+#define PHEAP_INIT (pheap_t) { .root = NULL }
+
+static inline bool pheap_is_empty(const pheap_t *heap)
+{
+    return heap->root == NULL;
+}
+
+static inline pheap_node_t *pheap_peek(const pheap_t *heap)
+{
+    return heap->root;
+}
+
+// `less` orders the nodes and must be the same for every call on a heap.
+
+void pheap_insert(pheap_t *heap, pheap_node_t *node, pheap_less_t less);
+pheap_node_t *pheap_pop(pheap_t *heap, pheap_less_t less);
+void pheap_remove(pheap_t *heap, pheap_node_t *node, pheap_less_t less);
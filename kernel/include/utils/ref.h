@@ -19,6 +19,20 @@ static inline bool ref_dec(ref_t *r)
     return false;
 }
 
+/**
+ * @brief Take a reference only if there still is one, for objects that can
+ * be found after their last reference was dropped but before they are freed.
+ * @return false if the count already reached zero.
+ */
+static inline bool ref_inc_not_zero(ref_t *r)
+{
+    int old = atomic_load(r);
+    while (old != 0)
+        if (atomic_compare_exchange_weak(r, &old, old + 1))
+            return true;
+    return false;
+}
+
 static inline int ref_read(ref_t *r)
 {
     return atomic_load(r);
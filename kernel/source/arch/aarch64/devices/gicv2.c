@@ -63,6 +63,18 @@ static void gic_set_target(uint32_t intid, uint32_t cpuid)
     REG(GICD_ITARGETSR(intid / 4)) = val;
 }
 
+static uint32_t gic_get_cpu()
+{
+    // The target fields of the banked SGI registers read back as the calling CPU.
+    return __builtin_ctz(REG(GICD_ITARGETSR(0)) & 0xff);
+}
+
+static void gic_send_sgi(uint32_t intid, uint32_t cpuid)
+{
+    // TargetListFilter=0, only the CPUs in the target list.
+    REG(GICD_SGIR) = ((1u << cpuid) << 16) | (intid & 0xf);
+}
+
 // Acknowledge & EOI
 
 static uint32_t gic_ack_int()
@@ -100,6 +112,8 @@ aarch64_gic_t aarch64_gicv2 = (aarch64_gic_t) {
     .enable_int = gic_enable_int,
     .disable_int = gic_disable_int,
     .set_target = gic_set_target,
+    .get_cpu = gic_get_cpu,
+    .send_sgi = gic_send_sgi,
     .ack_int = gic_ack_int,
     .end_of_int = gic_end_of_int
 };
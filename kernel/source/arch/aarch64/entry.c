@@ -6,6 +6,7 @@
 #include "mm/heap.h"
 #include "mm/pm.h"
 #include "mm/vm.h"
+#include "sys/percpu.h"
 #include "sys/smp.h"
 #include "sys/thread.h"
 
@@ -30,7 +31,7 @@ void __entry()
 {
     HHDM = bootreq_hhdm.response->offset;
     // Load pseudo-thread
-    arch_lcpu_thread_reg_write((size_t)&early_thread.context);
+    percpu_init_early(&early_thread);
 
     simplefb_init();
     log(LOG_INFO, "Kernel compiled on %s at %s.", __DATE__, __TIME__);
@@ -40,6 +41,7 @@ void __entry()
 
     // Memory
     pm_init();
+    percpu_init();
     heap_init();
     vm_init();
 
@@ -1,3 +1,5 @@
+#include "arch/aarch64/int.h"
+
 #include "arch/aarch64/devices/gic.h"
 #include "arch/lcpu.h"
 #include "log.h"
@@ -14,12 +16,18 @@ __attribute__((packed))
 cpu_state_t;
 
 static void (*arch_timer_handler)();
+static void (*arch_resched_handler)();
 
 void arch_timer_set_handler_per_cpu(void (*handler)())
 {
     arch_timer_handler = handler;
 }
 
+void arch_lcpu_set_resched_handler(void (*handler)())
+{
+    arch_resched_handler = handler;
+}
+
 void aarch64_int_handler(
     const uint64_t source,
     cpu_state_t const *cpu_state,
@@ -52,7 +60,18 @@ void aarch64_int_handler(
 
             if (intid < 16)// SGIs
             {
-                panic("Unhandled SGI %d", intid);
+                switch (intid)
+                {
+                    case AARCH64_INT_SGI_RESCHED:
+                        // Acknowledged first, as the handler may switch threads.
+                        aarch64_gic->end_of_int(iar);
+                        if (arch_resched_handler)
+                            arch_resched_handler();
+                        return;
+                    default:
+                        panic("Unhandled SGI %d", intid);
+                        break;
+                }
             }
             else if (intid < 32) // PPIs
             {
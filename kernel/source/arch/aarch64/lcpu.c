@@ -4,12 +4,37 @@
 #include "arch/aarch64/devices/gic.h"
 #include "arch/aarch64/devices/timer.h"
 #include "arch/aarch64/int.h"
+#include "sys/percpu.h"
+#include "sys/sched.h"
+
+static PERCPU_DEFINE(uint32_t, gic_cpu);
 
 void arch_lcpu_halt()
 {
     asm volatile("wfi");
 }
 
+void arch_lcpu_idle(const bool *wake_flag)
+{
+    (void)wake_flag;
+
+    // WFI also returns for interrupts that are pending but masked, so one sent before it isn't missed.
+    asm volatile("dsb sy; wfi" ::: "memory");
+    arch_lcpu_int_unmask();
+}
+
+void arch_lcpu_wake(size_t cpu_id)
+{
+    arch_lcpu_resched(cpu_id);
+}
+
+void arch_lcpu_resched(size_t cpu_id)
+{
+    // Make what the IPI is about visible before the IPI is.
+    asm volatile("dsb ishst" ::: "memory");
+    aarch64_gic->send_sgi(AARCH64_INT_SGI_RESCHED, *PERCPU_PTR(gic_cpu, cpu_id));
+}
+
 void arch_lcpu_int_mask()
 {
     asm volatile("msr daifset, #0b1111");
@@ -32,16 +57,56 @@ void arch_lcpu_relax()
     asm volatile("yield");
 }
 
-size_t arch_lcpu_thread_reg_read()
+void arch_lcpu_percpu_set_base(uintptr_t base)
 {
-    size_t ret;
-    asm volatile("mrs %0, tpidr_el1" : "=r"(ret));
-    return ret;
+    asm volatile("msr tpidr_el1, %0" :: "r"(base) : "memory");
 }
 
-void arch_lcpu_thread_reg_write(size_t t)
+uintptr_t arch_lcpu_percpu_base()
 {
-    asm volatile("msr tpidr_el1, %0" : : "r"(t));
+    uintptr_t base;
+    asm volatile("mrs %0, tpidr_el1" : "=r"(base));
+    return base;
+}
+
+/*
+ * Memory can't be addressed relative to TPIDR_EL1, so finding the area and
+ * accessing it takes separate instructions. Interrupts, and with them
+ * preemption, are kept away in between.
+ */
+
+static unsigned long pin()
+{
+    unsigned long daif;
+    asm volatile("mrs %0, daif; msr daifset, #0b1111" : "=r"(daif) :: "memory");
+    return daif;
+}
+
+static void unpin(unsigned long daif)
+{
+    asm volatile("msr daif, %0" :: "r"(daif) : "memory");
+}
+
+uint64_t arch_lcpu_percpu_read(size_t offset)
+{
+    unsigned long daif = pin();
+    uint64_t value = *(volatile uint64_t *)(arch_lcpu_percpu_base() + offset);
+    unpin(daif);
+    return value;
+}
+
+void arch_lcpu_percpu_write(size_t offset, uint64_t value)
+{
+    unsigned long daif = pin();
+    *(volatile uint64_t *)(arch_lcpu_percpu_base() + offset) = value;
+    unpin(daif);
+}
+
+void arch_lcpu_percpu_add(size_t offset, uint64_t value)
+{
+    unsigned long daif = pin();
+    *(volatile uint64_t *)(arch_lcpu_percpu_base() + offset) += value;
+    unpin(daif);
 }
 
 void arch_lcpu_init()
@@ -49,4 +114,7 @@ void arch_lcpu_init()
     aarch64_int_init_cpu();
     aarch64_gic->gicc_init();
     aarch64_timer_init_cpu();
+
+    *PERCPU_PTR(gic_cpu, sched_get_curr_cpuid()) = aarch64_gic->get_cpu();
+    aarch64_gic->enable_int(AARCH64_INT_SGI_RESCHED);
 }
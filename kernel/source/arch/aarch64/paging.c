@@ -1,18 +1,26 @@
 #include "arch/paging.h"
 
+#include "arch/lcpu.h"
 #include "assert.h"
 #include "hhdm.h"
 #include "log.h"
 #include "mm/heap.h"
 #include "mm/pm.h"
+#include "panic.h"
+#include "sync/spinlock.h"
+#include "sys/sched.h"
+#include "utils/list.h"
+#include "utils/math.h"
 
 #define PTE_VALID       (1ull <<  0)
 #define PTE_TABLE       (1ull <<  1)
 #define PTE_BLOCK       (0ull <<  1)
 #define PTE_PAGE_4K     (1ull <<  1)
-#define PTE_READONLY    (1ull <<  6)
-#define PTE_USER        (1ull <<  7)
+#define PTE_USER        (1ull <<  6)
+#define PTE_READONLY    (1ull <<  7)
 #define PTE_ACCESS      (1ull << 10)
+#define PTE_NG          (1ull << 11)
+#define PTE_CONT        (1ull << 52)
 #define PTE_XN          (1ull << 54)
 
 #define PTE_ATTR_IDX(IDX) ((IDX) << 2)
@@ -21,11 +29,276 @@
 
 typedef uint64_t pte_t;
 
+#define MAX_CPUS 64
+#define ASID_BITS 8
+#define ASID_COUNT (1ull << ASID_BITS)
+#define ASID_MASK (ASID_COUNT - 1)
+
+// Entries a contiguous run is made of, at both the 4KiB and the 2MiB level.
+#define CONT_ENTRIES 16
+
 struct arch_paging_map
 {
     pte_t *pml4[2];
+    uint64_t asid; // Generation in the upper bits, 0 until the map is first loaded.
 };
 
+/*
+ * Address space IDs
+ *
+ * User entries are not global and are tagged with the ASID of their map, so
+ * they survive switching TTBR0 to another map and back. ASIDs are handed out
+ * in generations: once they run out, the generation is bumped, the TLBs are
+ * flushed, and every map takes a new ASID the next time it is loaded. The ones
+ * live on a CPU at that point are carried over, as their entries may come back
+ * before that CPU switches away.
+ */
+
+static uint64_t asid_gen = ASID_COUNT;
+static uint64_t asid_bitmap[ASID_COUNT / 64];
+static size_t asid_cursor = 1; // ASID 0 is never handed out.
+static uint64_t active_asids[MAX_CPUS];
+static uint64_t reserved_asids[MAX_CPUS];
+static spinlock_t asid_slock = SPINLOCK_INIT;
+
+#define ASID_FIELD(ASID) (((ASID) & ASID_MASK) << 48)
+
+static inline bool asid_test_and_set(size_t num)
+{
+    bool was_set = asid_bitmap[num / 64] & (1ull << (num % 64));
+    asid_bitmap[num / 64] |= 1ull << (num % 64);
+    return was_set;
+}
+
+static void flush_context()
+{
+    memset(asid_bitmap, 0, sizeof(asid_bitmap));
+    asid_bitmap[0] = 1;
+
+    for (size_t i = 0; i < MAX_CPUS; i++)
+    {
+        // A CPU that hasn't switched since the last rollover still runs with what was reserved for it then.
+        uint64_t asid = __atomic_exchange_n(&active_asids[i], 0, __ATOMIC_RELAXED);
+        if (asid == 0)
+            asid = reserved_asids[i];
+
+        asid_test_and_set(asid & ASID_MASK);
+        reserved_asids[i] = asid;
+    }
+
+    asm volatile("dsb ishst; tlbi vmalle1is; dsb ish; isb" ::: "memory");
+}
+
+static bool update_reserved(uint64_t asid, uint64_t new_asid)
+{
+    bool hit = false;
+    for (size_t i = 0; i < MAX_CPUS; i++)
+        if (reserved_asids[i] == asid)
+        {
+            reserved_asids[i] = new_asid;
+            hit = true;
+        }
+    return hit;
+}
+
+/**
+ * Picks an ASID from the current generation for `map`. Called with `asid_slock` held.
+ */
+static uint64_t new_context(arch_paging_map_t *map)
+{
+    uint64_t asid = map->asid;
+    uint64_t gen = asid_gen;
+
+    if (asid != 0)
+    {
+        size_t num = asid & ASID_MASK;
+
+        // Carried over from before the rollover, or still free: keep it.
+        if (update_reserved(asid, gen | num))
+            return gen | num;
+        if (!asid_test_and_set(num))
+            return gen | num;
+    }
+
+    for (size_t tries = 1; tries < ASID_COUNT; tries++)
+    {
+        size_t num = asid_cursor;
+        asid_cursor = asid_cursor % (ASID_COUNT - 1) + 1;
+
+        if (!asid_test_and_set(num))
+            return gen | num;
+    }
+
+    // Out of ASIDs.
+    gen += ASID_COUNT;
+    __atomic_store_n(&asid_gen, gen, __ATOMIC_RELAXED);
+    flush_context();
+
+    for (size_t num = 1; num < ASID_COUNT; num++)
+        if (!asid_test_and_set(num))
+        {
+            asid_cursor = num % (ASID_COUNT - 1) + 1;
+            return gen | num;
+        }
+
+    panic("More CPUs than ASIDs!");
+}
+
+/**
+ * Makes sure `map` has an ASID of the current generation and marks it live on this CPU.
+ * Called with interrupts masked.
+ */
+static uint64_t asid_get(arch_paging_map_t *map)
+{
+    uint32_t cpu = sched_get_curr_cpuid();
+    ASSERT(cpu < MAX_CPUS);
+
+    // Fast path: the ASID is current and no rollover cleared this CPU's slot in the meantime.
+    uint64_t asid = __atomic_load_n(&map->asid, __ATOMIC_RELAXED);
+    uint64_t old_active = __atomic_load_n(&active_asids[cpu], __ATOMIC_RELAXED);
+    if (old_active != 0 && ((asid ^ __atomic_load_n(&asid_gen, __ATOMIC_RELAXED)) >> ASID_BITS) == 0
+    &&  __atomic_compare_exchange_n(&active_asids[cpu], &old_active, asid, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return asid;
+
+    spinlock_acquire(&asid_slock);
+
+    asid = map->asid;
+    if (((asid ^ asid_gen) >> ASID_BITS) != 0)
+    {
+        asid = new_context(map);
+        __atomic_store_n(&map->asid, asid, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&active_asids[cpu], asid, __ATOMIC_RELAXED);
+
+    spinlock_release(&asid_slock);
+    return asid;
+}
+
+/*
+ * Invalidation
+ *
+ * User entries are invalidated by ASID, kernel entries for every ASID. Runs of
+ * more than a few pages go with one range operation each where FEAT_TLBIRANGE
+ * is there, or with the whole ASID where it isn't.
+ */
+
+#define TLBI_VA(VADDR) (((VADDR) >> 12) & ((1ull << 44) - 1))
+#define TLBI_MAX_PAGES 32
+
+// Range operations cover (NUM + 1) << (5 * SCALE + 1) pages from BaseADDR on.
+#define TLBI_RANGE_VA(VADDR) (((VADDR) >> 12) & ((1ull << 37) - 1))
+#define TLBI_RANGE_TG_4K (1ull << 46)
+#define TLBI_RANGE_SCALE(SCALE) ((uint64_t)(SCALE) << 44)
+#define TLBI_RANGE_NUM(NUM) ((uint64_t)(NUM) << 39)
+#define TLBI_RANGE_MAX_PAGES (32ull << 16)
+
+static bool has_tlbi_range = false;
+
+static inline uint64_t tlbi_asid(arch_paging_map_t *map, uintptr_t vaddr)
+{
+    // The entries have to be written before the ASID is read, or a rollover could slip in between.
+    asm volatile("dsb ish" ::: "memory");
+    return vaddr >= HHDM ? 0 : ASID_FIELD(__atomic_load_n(&map->asid, __ATOMIC_RELAXED));
+}
+
+static inline void tlbi_page(uint64_t asid, uintptr_t vaddr)
+{
+    if (vaddr >= HHDM)
+        asm volatile("tlbi vaae1is, %0" :: "r"(TLBI_VA(vaddr)) : "memory");
+    else
+        asm volatile("tlbi vae1is, %0" :: "r"(asid | TLBI_VA(vaddr)) : "memory");
+}
+
+/**
+ * Invalidates a single page. The caller still has to wait for it to complete.
+ */
+static inline void invalidate(arch_paging_map_t *map, uintptr_t vaddr)
+{
+    tlbi_page(tlbi_asid(map, vaddr), vaddr);
+}
+
+/**
+ * Invalidates [start, end), in which entries are at least `stride` apart, and waits for it to complete.
+ */
+static void flush_range(arch_paging_map_t *map, uintptr_t start, uintptr_t end, size_t stride)
+{
+    uint64_t asid = tlbi_asid(map, start);
+    size_t pages = (end - start) / ARCH_PAGE_GRAN;
+
+    bool too_many = has_tlbi_range ? pages >= TLBI_RANGE_MAX_PAGES : (end - start) / stride > TLBI_MAX_PAGES;
+    if (too_many)
+    {
+        if (start >= HHDM)
+            asm volatile("tlbi vmalle1is" ::: "memory");
+        else
+            asm volatile("tlbi aside1is, %0" :: "r"(asid) : "memory");
+    }
+    else if (!has_tlbi_range)
+    {
+        for (uintptr_t vaddr = start; vaddr < end; vaddr += stride)
+            tlbi_page(asid, vaddr);
+    }
+    else
+    {
+        for (size_t scale = 0; pages > 0; )
+        {
+            if (pages == 1)
+            {
+                tlbi_page(asid, start);
+                break;
+            }
+
+            size_t num = (pages >> (5 * scale + 1)) & 0x1F;
+            if (num > 0)
+            {
+                uint64_t op = asid | TLBI_RANGE_TG_4K | TLBI_RANGE_SCALE(scale) | TLBI_RANGE_NUM(num - 1)
+                            | TLBI_RANGE_VA(start);
+                // RVAAE1IS and RVAE1IS, spelled out for assemblers without FEAT_TLBIRANGE.
+                if (start >= HHDM)
+                    asm volatile("sys #0, c8, c2, #3, %0" :: "r"(op) : "memory");
+                else
+                    asm volatile("sys #0, c8, c2, #1, %0" :: "r"(op) : "memory");
+
+                start += (num << (5 * scale + 1)) * ARCH_PAGE_GRAN;
+                pages -= num << (5 * scale + 1);
+            }
+            scale++;
+        }
+    }
+
+    asm volatile("dsb ish; isb" ::: "memory");
+}
+
+/*
+ * Contiguous runs
+ *
+ * Runs of 16 entries mapping 64KiB or 32MiB of contiguous memory are marked
+ * contiguous so that they take a single TLB entry. Every entry of a run has to
+ * agree, so a run is broken up before any one of its entries is changed.
+ */
+
+#define LEVEL_SHIFT(LEVEL) (12 + 9 * (3 - (LEVEL)))
+#define LEVEL_SIZE(LEVEL) (1ull << LEVEL_SHIFT(LEVEL))
+
+static void unfold(arch_paging_map_t *map, pte_t *table, size_t idx, size_t level, uintptr_t vaddr)
+{
+    size_t first = FLOOR(idx, CONT_ENTRIES);
+    uintptr_t start = FLOOR(vaddr, CONT_ENTRIES * LEVEL_SIZE(level));
+    pte_t saved[CONT_ENTRIES];
+
+    // Break-before-make: the TLB may hold the run as one entry.
+    for (size_t i = 0; i < CONT_ENTRIES; i++)
+    {
+        saved[i] = table[first + i];
+        table[first + i] = 0;
+    }
+    flush_range(map, start, start + CONT_ENTRIES * LEVEL_SIZE(level), LEVEL_SIZE(level));
+
+    for (size_t i = 0; i < CONT_ENTRIES; i++)
+        table[first + i] = saved[i] & ~PTE_CONT;
+    asm volatile("dsb ishst; isb" ::: "memory");
+}
+
 // Mapping and unmapping
 
 static inline void pt_children_inc(pte_t *table)
@@ -56,23 +329,25 @@ static pte_t *get_next_level(pte_t *table, uint64_t idx, bool alloc, bool user)
     pte_t *next_level = (pte_t *)(phys + HHDM);
     memset(next_level, 0, 0x1000);
 
-    table[idx] = phys | PTE_VALID | (user ? PTE_USER : 0);
+    table[idx] = phys | PTE_VALID | PTE_TABLE | (user ? PTE_USER : 0);
     pt_children_inc(table);
 
     return next_level;
 }
 
-int arch_paging_map_page(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t paddr, size_t size, vm_protection_t prot, vm_cache_t cache)
+static bool table_is_empty(const pte_t *table)
 {
-    ASSERT(size == ARCH_PAGE_SIZE_4K
-        || size == ARCH_PAGE_SIZE_2M
-        || size == ARCH_PAGE_SIZE_1G);
-    ASSERT(vaddr % size == 0);
-    ASSERT(paddr % size == 0);
+    for (size_t i = 0; i < 512; i++)
+        if (table[i] & PTE_VALID)
+            return false;
+    return true;
+}
 
+static pte_t leaf_flags(vm_protection_t prot, vm_cache_t cache)
+{
     pte_t _prot = 0;
     if (!(prot & VM_PROTECTION_READ)) log(LOG_ERROR, "No-read mapping is not supported on aarch64!");
-    if (prot & VM_PROTECTION_WRITE) _prot |= PTE_READONLY;
+    if (!(prot & VM_PROTECTION_WRITE)) _prot |= PTE_READONLY;
     if (!(prot & VM_PROTECTION_EXECUTE)) _prot |= PTE_XN;
 
     const int attr_idx[] = {
@@ -83,6 +358,19 @@ int arch_paging_map_page(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t padd
     };
     _prot |= PTE_ATTR_IDX(attr_idx[cache]);
 
+    return _prot;
+}
+
+int arch_paging_map_page(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t paddr, size_t size, vm_protection_t prot, vm_cache_t cache)
+{
+    ASSERT(size == ARCH_PAGE_SIZE_4K
+        || size == ARCH_PAGE_SIZE_2M
+        || size == ARCH_PAGE_SIZE_1G);
+    ASSERT(vaddr % size == 0);
+    ASSERT(paddr % size == 0);
+
+    pte_t _prot = leaf_flags(prot, cache);
+
     bool is_user = vaddr < HHDM;
     pte_t *table = map->pml4[is_user ? 0 : 1];
 
@@ -99,7 +387,7 @@ int arch_paging_map_page(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t padd
     for (size_t level = 0; level < target_level; level++)
     {
         size_t idx = indices[level];
-        ASSERT(table[idx] & PTE_TABLE);
+        ASSERT(!(table[idx] & PTE_VALID) || (table[idx] & PTE_TABLE));
 
         pte_t *next = get_next_level(table, idx, true, is_user);
         if (!next)
@@ -108,9 +396,23 @@ int arch_paging_map_page(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t padd
     }
 
     size_t leaf_idx = indices[target_level];
+
+    // A block may take the place of a table whose pages were all unmapped.
+    if (target_level < 3 && (table[leaf_idx] & PTE_VALID) && (table[leaf_idx] & PTE_TABLE))
+    {
+        pte_t *child = (pte_t *)(PTE_ADDR_MASK(table[leaf_idx]) + HHDM);
+        if (table_is_empty(child))
+        {
+            table[leaf_idx] = 0;
+            pt_children_dec(table);
+            invalidate(map, vaddr);
+            asm volatile("dsb ish; isb" ::: "memory");
+            pm_free(pm_phys_to_page((uintptr_t)child - HHDM));
+        }
+    }
     ASSERT(!(table[leaf_idx] & PTE_VALID));
 
-    pte_t entry = paddr | PTE_VALID | _prot | PTE_ACCESS | (is_user ? PTE_USER : 0);
+    pte_t entry = paddr | PTE_VALID | _prot | PTE_ACCESS | (is_user ? PTE_USER | PTE_NG : 0);
     entry |= (target_level == 3) ? PTE_PAGE_4K : PTE_BLOCK;
     pt_children_inc(table);
 
@@ -119,6 +421,52 @@ int arch_paging_map_page(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t padd
     return 0;
 }
 
+size_t arch_paging_map_batch(arch_paging_map_t *map, uintptr_t vaddr, const uintptr_t *paddrs, size_t count, vm_protection_t prot, vm_cache_t cache)
+{
+    ASSERT(vaddr % ARCH_PAGE_GRAN == 0);
+    ASSERT(((vaddr >> 12) & 0x1FF) + count <= 512);
+
+    bool is_user = vaddr < HHDM;
+    pte_t flags = leaf_flags(prot, cache) | PTE_VALID | PTE_ACCESS | PTE_PAGE_4K | (is_user ? PTE_USER | PTE_NG : 0);
+    pte_t *table = map->pml4[is_user ? 0 : 1];
+
+    size_t indices[] = {
+        (vaddr >> 39) & 0x1FF, // Level 0
+        (vaddr >> 30) & 0x1FF, // Level 1
+        (vaddr >> 21) & 0x1FF, // Level 2
+        (vaddr >> 12) & 0x1FF  // Level 3
+    };
+
+    for (size_t level = 0; level < 3; level++)
+    {
+        size_t idx = indices[level];
+        if ((table[idx] & PTE_VALID) && !(table[idx] & PTE_TABLE))
+            return 0; // Block mapping.
+
+        pte_t *next = get_next_level(table, idx, true, is_user);
+        if (!next)
+            return 0;
+        table = next;
+    }
+
+    // Leaves
+
+    size_t mapped = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t idx = indices[3] + i;
+        if (!paddrs[i] || (table[idx] & PTE_VALID))
+            continue;
+
+        ASSERT(paddrs[i] % ARCH_PAGE_GRAN == 0);
+        table[idx] = paddrs[i] | flags;
+        pt_children_inc(table);
+        mapped++;
+    }
+
+    return mapped;
+}
+
 int arch_paging_unmap_page(arch_paging_map_t *map, uintptr_t vaddr)
 {
     size_t indices[] = {
@@ -148,33 +496,350 @@ int arch_paging_unmap_page(arch_paging_map_t *map, uintptr_t vaddr)
 
     // Clear the mapping.
     size_t leaf_idx = indices[level];
+    if (!(tables[level][leaf_idx] & PTE_VALID))
+        return -1;
+    if (tables[level][leaf_idx] & PTE_CONT)
+        unfold(map, tables[level], leaf_idx, level, vaddr);
     tables[level][leaf_idx] = 0;
 
-    // Ascend
-    while (level <= 3)
+    // Ascend, disconnecting the tables left empty. The root stays.
+    uintptr_t freed[3];
+    size_t freed_count = 0;
+    while (pt_children_dec(tables[level]) && level > 0)
+    {
+        freed[freed_count++] = (uintptr_t)tables[level] - HHDM;
+        level--;
+        tables[level][indices[level]] = 0;
+    }
+
+    // Flush TLB
+    // vae1is = virt addr + EL1 + inner shareable
+    invalidate(map, vaddr);
+    asm volatile("dsb ish" ::: "memory");
+    asm volatile("isb" ::: "memory");
+
+    // Only free the tables once no walk can reach them anymore.
+    for (size_t i = 0; i < freed_count; i++)
+        pm_free(pm_phys_to_page(freed[i]));
+
+    return 0;
+}
+
+int arch_paging_split_page(arch_paging_map_t *map, uintptr_t vaddr)
+{
+    size_t indices[] = {
+        (vaddr >> 39) & 0x1FF, // Level 0
+        (vaddr >> 30) & 0x1FF, // Level 1
+        (vaddr >> 21) & 0x1FF, // Level 2
+        (vaddr >> 12) & 0x1FF  // Level 3
+    };
+
+    bool is_user = vaddr < HHDM;
+
+    // Descend until the block entry is found.
+    pte_t *table = map->pml4[is_user ? 0 : 1];
+    size_t level;
+    for (level = 0; level <= 2; level++)
     {
-        if (!pt_children_dec(tables[level]))
+        pte_t entry = table[indices[level]];
+        if (!(entry & PTE_VALID))
+            return -1;
+        if (!(entry & PTE_TABLE))
             break;
+        if (level == 2)
+            return -1; // Already mapped with 4KiB pages.
+
+        table = (pte_t *)(PTE_ADDR_MASK(entry) + HHDM);
+    }
+    if (level == 0)
+        return -1;
 
-        uintptr_t phys = (uintptr_t)tables[level] - HHDM;
+    page_t *p = pm_alloc(0);
+    if (!p)
+        return -1;
+    pte_t *next = (pte_t *)(p->addr + HHDM);
 
-        // Disconnect from parent before freeing child
-        level++;
-        tables[level][indices[level]] = 0;
+    if (table[indices[level]] & PTE_CONT)
+        unfold(map, table, indices[level], level, vaddr);
+
+    // A 1GiB block becomes 2MiB blocks, a 2MiB block becomes 4KiB pages.
+    pte_t entry = table[indices[level]];
+    size_t step = (level == 1) ? ARCH_PAGE_SIZE_2M : ARCH_PAGE_SIZE_4K;
+    pte_t attrs = entry & ~PTE_ADDR_MASK(entry);
+    if (level == 2)
+        attrs |= PTE_PAGE_4K;
 
-        pm_free(pm_phys_to_page(phys));
+    for (size_t i = 0; i < 512; i++)
+    {
+        next[i] = (PTE_ADDR_MASK(entry) + i * step) | attrs;
+        pt_children_inc(next);
     }
 
-    // Flush TLB
-    // vae1is = virt addr + EL1 + inner shareable
-    uintptr_t vpage = vaddr >> 12;
-    asm volatile("tlbi vae1is, %0" :: "r"(vpage) : "memory");
+    // Break-before-make: the block has to be invalidated before the table replaces it.
+    table[indices[level]] = 0;
+    invalidate(map, vaddr);
     asm volatile("dsb ish" ::: "memory");
+
+    table[indices[level]] = p->addr | PTE_VALID | PTE_TABLE | (is_user ? PTE_USER : 0);
     asm volatile("isb" ::: "memory");
 
     return 0;
 }
 
+bool arch_paging_test_and_clear_accessed(arch_paging_map_t *map, uintptr_t vaddr)
+{
+    size_t indices[] = {
+        (vaddr >> 39) & 0x1FF, // Level 0
+        (vaddr >> 30) & 0x1FF, // Level 1
+        (vaddr >> 21) & 0x1FF, // Level 2
+        (vaddr >> 12) & 0x1FF  // Level 3
+    };
+
+    pte_t *table = map->pml4[vaddr >= HHDM ? 1 : 0];
+    size_t level = 0;
+    for (; level <= 2; level++)
+    {
+        pte_t entry = table[indices[level]];
+        if (!(entry & PTE_VALID))
+            return false;
+        if (!(entry & PTE_TABLE))
+            break;
+
+        table = (pte_t *)(PTE_ADDR_MASK(entry) + HHDM);
+    }
+
+    pte_t *leaf = &table[indices[level]];
+    if (!(*leaf & PTE_VALID) || !(*leaf & PTE_ACCESS))
+        return false;
+    if (*leaf & PTE_CONT)
+        unfold(map, table, indices[level], level, vaddr);
+
+    // Without hardware flag management the next access takes an access flag
+    // fault, which maps the page again with the flag set.
+    __atomic_fetch_and(leaf, ~PTE_ACCESS, __ATOMIC_RELAXED);
+    invalidate(map, vaddr);
+    asm volatile("dsb ish; isb" ::: "memory");
+
+    return true;
+}
+
+bool arch_paging_is_dirty(const arch_paging_map_t *map, uintptr_t vaddr)
+{
+    size_t indices[] = {
+        (vaddr >> 39) & 0x1FF, // Level 0
+        (vaddr >> 30) & 0x1FF, // Level 1
+        (vaddr >> 21) & 0x1FF, // Level 2
+        (vaddr >> 12) & 0x1FF  // Level 3
+    };
+
+    pte_t *table = map->pml4[vaddr >= HHDM ? 1 : 0];
+    size_t level = 0;
+    for (; level <= 2; level++)
+    {
+        pte_t entry = table[indices[level]];
+        if (!(entry & PTE_VALID))
+            return false;
+        if (!(entry & PTE_TABLE))
+            break;
+
+        table = (pte_t *)(PTE_ADDR_MASK(entry) + HHDM);
+    }
+
+    // There is no dirty state management, writable pages are writable from the start.
+    pte_t leaf = table[indices[level]];
+    return (leaf & PTE_VALID) && !(leaf & PTE_READONLY);
+}
+
+// Ranges
+
+static bool run_is_free(const pte_t *table, size_t idx)
+{
+    for (size_t i = 0; i < CONT_ENTRIES; i++)
+        if (table[idx + i] & PTE_VALID)
+            return false;
+    return true;
+}
+
+static bool map_level(pte_t *table, size_t level, uintptr_t *vaddr, uintptr_t *paddr, size_t *remaining,
+                      pte_t flags, bool is_user)
+{
+    size_t size = LEVEL_SIZE(level);
+    size_t cont_left = 0;
+
+    for (size_t idx = (*vaddr >> LEVEL_SHIFT(level)) & 0x1FF; idx < 512 && *remaining > 0; idx++)
+    {
+        // Whole runs of pages or 2MiB blocks are marked contiguous.
+        if (level >= 2 && cont_left == 0 && idx % CONT_ENTRIES == 0
+        &&  *vaddr % (CONT_ENTRIES * size) == 0 && *paddr % (CONT_ENTRIES * size) == 0
+        &&  *remaining >= CONT_ENTRIES * size && run_is_free(table, idx))
+            cont_left = CONT_ENTRIES;
+
+        // The largest block that both addresses are aligned to and that the range fills.
+        bool leaf = level == 3
+                 || (level >= 1 && !(table[idx] & PTE_VALID)
+                 &&  *vaddr % size == 0 && *paddr % size == 0 && *remaining >= size);
+        if (!leaf)
+        {
+            pte_t *next = get_next_level(table, idx, true, is_user);
+            if (!next || !map_level(next, level + 1, vaddr, paddr, remaining, flags, is_user))
+                return false;
+            continue;
+        }
+
+        ASSERT(!(table[idx] & PTE_VALID));
+        table[idx] = *paddr | flags | (level == 3 ? PTE_PAGE_4K : PTE_BLOCK) | (cont_left > 0 ? PTE_CONT : 0);
+        pt_children_inc(table);
+        if (cont_left > 0)
+            cont_left--;
+
+        *vaddr += size;
+        *paddr += size;
+        *remaining -= size;
+    }
+
+    return true;
+}
+
+int arch_paging_map_range(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t paddr, size_t length, vm_protection_t prot, vm_cache_t cache)
+{
+    ASSERT(vaddr % ARCH_PAGE_GRAN == 0);
+    ASSERT(paddr % ARCH_PAGE_GRAN == 0);
+    ASSERT(length % ARCH_PAGE_GRAN == 0);
+
+    bool is_user = vaddr < HHDM;
+    pte_t flags = leaf_flags(prot, cache) | PTE_VALID | PTE_ACCESS | (is_user ? PTE_USER | PTE_NG : 0);
+
+    bool ok = map_level(map->pml4[is_user ? 0 : 1], 0, &vaddr, &paddr, &length, flags, is_user);
+    asm volatile("dsb ishst; isb" ::: "memory");
+    return ok ? 0 : -1;
+}
+
+/**
+ * Calls `fn` on every leaf in the range. Blocks sticking out of it are split
+ * and contiguous runs are broken up first. Leaves and tables are not
+ * invalidated, that is up to the caller once the walk is done.
+ */
+static bool walk_level(arch_paging_map_t *map, pte_t *table, size_t level, uintptr_t *vaddr, size_t *remaining,
+                       void (*fn)(pte_t *table, size_t idx, uintptr_t vaddr, void *arg),
+                       void *arg, list_t *freed)
+{
+    size_t size = LEVEL_SIZE(level);
+
+    for (size_t idx = (*vaddr >> LEVEL_SHIFT(level)) & 0x1FF; idx < 512 && *remaining > 0; idx++)
+    {
+        size_t step = MIN(size - *vaddr % size, *remaining);
+        bool is_block = level > 0 && level < 3 && (table[idx] & PTE_VALID) && !(table[idx] & PTE_TABLE);
+
+        if (is_block && step < size)
+        {
+            if (arch_paging_split_page(map, *vaddr) != 0)
+                return false;
+            is_block = false;
+        }
+
+        if (!(table[idx] & PTE_VALID))
+        {
+            *vaddr += step;
+            *remaining -= step;
+            continue;
+        }
+
+        if (level == 3 || is_block)
+        {
+            if (table[idx] & PTE_CONT)
+                unfold(map, table, idx, level, *vaddr);
+            fn(table, idx, *vaddr, arg);
+            *vaddr += step;
+            *remaining -= step;
+            continue;
+        }
+
+        pte_t *next = (pte_t *)(PTE_ADDR_MASK(table[idx]) + HHDM);
+        if (!walk_level(map, next, level + 1, vaddr, remaining, fn, arg, freed))
+            return false;
+
+        // Tables emptied by unmapping go too.
+        page_t *p = pm_phys_to_page((uintptr_t)next - HHDM);
+        if (freed && atomic_load_explicit(&p->children, memory_order_relaxed) == 0)
+        {
+            table[idx] = 0;
+            pt_children_dec(table);
+            list_append(freed, &p->list_elem);
+        }
+    }
+
+    return true;
+}
+
+static void unmap_leaf(pte_t *table, size_t idx, [[maybe_unused]] uintptr_t vaddr, [[maybe_unused]] void *arg)
+{
+    table[idx] = 0;
+    pt_children_dec(table);
+}
+
+int arch_paging_unmap_range(arch_paging_map_t *map, uintptr_t vaddr, size_t length)
+{
+    ASSERT(vaddr % ARCH_PAGE_GRAN == 0);
+    ASSERT(length % ARCH_PAGE_GRAN == 0);
+
+    list_t freed = LIST_INIT;
+    uintptr_t start = vaddr;
+
+    bool ok = walk_level(map, map->pml4[vaddr >= HHDM ? 1 : 0], 0, &vaddr, &length, unmap_leaf, NULL, &freed);
+    // The invalidation has to complete before the tables can be reused.
+    flush_range(map, start, vaddr, ARCH_PAGE_GRAN);
+
+    list_node_t *n;
+    while ((n = list_pop_head(&freed)))
+        pm_free(LIST_GET_CONTAINER(n, page_t, list_elem));
+
+    return ok ? 0 : -1;
+}
+
+static void prot_leaf(pte_t *table, size_t idx, [[maybe_unused]] uintptr_t vaddr, void *arg)
+{
+    pte_t entry = table[idx] & ~(PTE_READONLY | PTE_XN);
+    entry |= leaf_flags(*(vm_protection_t *)arg, VM_CACHE_STANDARD) & (PTE_READONLY | PTE_XN);
+
+    table[idx] = entry;
+}
+
+int arch_paging_prot_range(arch_paging_map_t *map, uintptr_t vaddr, size_t length, vm_protection_t prot)
+{
+    ASSERT(vaddr % ARCH_PAGE_GRAN == 0);
+    ASSERT(length % ARCH_PAGE_GRAN == 0);
+
+    uintptr_t start = vaddr;
+
+    bool ok = walk_level(map, map->pml4[vaddr >= HHDM ? 1 : 0], 0, &vaddr, &length, prot_leaf, &prot, NULL);
+    flush_range(map, start, vaddr, ARCH_PAGE_GRAN);
+
+    return ok ? 0 : -1;
+}
+
+int arch_paging_prot_page(arch_paging_map_t *map, uintptr_t vaddr, size_t size, vm_protection_t prot)
+{
+    ASSERT(size == ARCH_PAGE_SIZE_4K
+        || size == ARCH_PAGE_SIZE_2M
+        || size == ARCH_PAGE_SIZE_1G);
+    ASSERT(vaddr % size == 0);
+
+    return arch_paging_prot_range(map, vaddr, size, prot);
+}
+
+// TLB maintenance
+
+// TLBI with the inner shareable qualifier already reaches every CPU, and ranges are flushed in one go, so there
+// is nothing to batch.
+
+void arch_paging_batch_begin([[maybe_unused]] arch_paging_map_t *map)
+{
+}
+
+void arch_paging_batch_end([[maybe_unused]] arch_paging_map_t *map)
+{
+}
+
 // Utils
 
 bool arch_paging_vaddr_to_paddr(const arch_paging_map_t *map, uintptr_t vaddr, uintptr_t *out_paddr)
@@ -223,6 +888,31 @@ bool arch_paging_vaddr_to_paddr(const arch_paging_map_t *map, uintptr_t vaddr, u
     return true;
 }
 
+size_t arch_paging_get_page_size(const arch_paging_map_t *map, uintptr_t vaddr)
+{
+    size_t indices[] = {
+        (vaddr >> 39) & 0x1FF, // Level 0
+        (vaddr >> 30) & 0x1FF, // Level 1
+        (vaddr >> 21) & 0x1FF, // Level 2
+        (vaddr >> 12) & 0x1FF  // Level 3
+    };
+    const size_t sizes[] = { 0, ARCH_PAGE_SIZE_1G, ARCH_PAGE_SIZE_2M, ARCH_PAGE_SIZE_4K };
+
+    pte_t *table = map->pml4[vaddr >= HHDM ? 1 : 0];
+    for (size_t level = 0; level <= 2; level++)
+    {
+        pte_t entry = table[indices[level]];
+        if (!(entry & PTE_VALID))
+            return 0;
+        if (!(entry & PTE_TABLE))
+            return sizes[level];
+
+        table = (pte_t *)(PTE_ADDR_MASK(entry) + HHDM);
+    }
+
+    return (table[indices[3]] & PTE_VALID) ? ARCH_PAGE_SIZE_4K : 0;
+}
+
 // Map creation and destruction
 
 pte_t *higher_half_pml4;
@@ -232,27 +922,50 @@ arch_paging_map_t *arch_paging_map_create()
 {
     arch_paging_map_t *map = heap_alloc(sizeof(arch_paging_map_t));
     map->pml4[0] = (pte_t *)(pm_alloc(0)->addr + HHDM);
-    memset(map->pml4, 0, 0x1000);
+    memset(map->pml4[0], 0, 0x1000);
     map->pml4[1] = higher_half_pml4;
+    map->asid = 0;
 
     return map;
 }
 
+static void delete_level(pte_t *table, int level)
+{
+    if (level < 3)
+        for (size_t i = 0; i < 512; i++)
+        {
+            if (!(table[i] & PTE_VALID) || !(table[i] & PTE_TABLE))
+                continue;
+
+            delete_level((pte_t *)(PTE_ADDR_MASK(table[i]) + HHDM), level + 1);
+        }
+
+    pm_free(pm_phys_to_page((uintptr_t)table - HHDM));
+}
+
 void arch_paging_map_destroy(arch_paging_map_t *map)
 {
+    // The ASID isn't freed, it can't be handed out again before the next rollover flushes its entries.
+
+    // Only the user half is private, the kernel half is shared by every map.
+    delete_level(map->pml4[0], 0);
     heap_free(map);
-    // TODO: destroy page tables
 }
 
 // Map loading
 
 void arch_paging_map_load(arch_paging_map_t *map)
 {
+    // The CPU must not change between picking the ASID and loading it.
+    bool int_state = arch_lcpu_int_enabled();
+    arch_lcpu_int_mask();
+
+    uint64_t asid = asid_get(map);
     asm volatile(
         "msr ttbr0_el1, %0\n"
         "isb\n"
         :
-        : "r"((uintptr_t)map->pml4[0] - HHDM)
+        : "r"(((uintptr_t)map->pml4[0] - HHDM) | ASID_FIELD(asid))
         : "memory"
     );
 
@@ -268,6 +981,16 @@ void arch_paging_map_load(arch_paging_map_t *map)
         );
         ttbr1_loaded = true;
     }
+
+    if (int_state)
+        arch_lcpu_int_unmask();
+}
+
+void arch_paging_map_load_lazy(arch_paging_map_t *map)
+{
+    // With ASIDs, switching TTBR0 keeps the entries of both maps. Borrowing the
+    // previous map instead would need its borrowers tracked before it could be freed.
+    arch_paging_map_load(map);
 }
 
 // Init
@@ -285,4 +1008,9 @@ void arch_paging_init()
     asm volatile ("msr mair_el1, %0" : : "r"(mair));
     asm volatile ("dsb ish");
     asm volatile ("isb");
+
+    // ID_AA64ISAR0_EL1.TLB is 2 with FEAT_TLBIRANGE.
+    uint64_t isar0;
+    asm volatile ("mrs %0, id_aa64isar0_el1" : "=r"(isar0));
+    has_tlbi_range = ((isar0 >> 56) & 0xF) >= 2;
 }
@@ -6,6 +6,9 @@
 #include "hhdm.h"
 #include "mm/mm.h"
 #include "mm/pm.h"
+#include "sys/percpu.h"
+#include "sys/thread.h"
+#include "utils/container_of.h"
 
 typedef struct
 {
@@ -117,6 +120,6 @@ void arch_thread_context_init(arch_thread_context_t *context, vm_addrspace_t *as
 
 void arch_thread_context_switch(arch_thread_context_t *curr, arch_thread_context_t *next)
 {
-    arch_lcpu_thread_reg_write((size_t)next);
+    THIS_CPU_WRITE(percpu_head.curr_thread, container_of(next, thread_t, context));
     __thread_context_switch(curr, next); // This function calls `sched_drop` for `curr` too.
 }
@@ -72,6 +72,11 @@ void x86_64_lapic_ipi(uint32_t lapic_id, uint32_t vec)
     lapic_write(REG_ICR0, vec);
 }
 
+uint32_t x86_64_lapic_get_id()
+{
+    return lapic_read(REG_ID) >> 24;
+}
+
 // Initialization
 
 void x86_64_lapic_init_cpu()
@@ -7,6 +7,7 @@
 #include "mm/heap.h"
 #include "mm/pm.h"
 #include "mm/vm.h"
+#include "sys/percpu.h"
 #include "sys/smp.h"
 #include "sys/thread.h"
 
@@ -26,9 +27,6 @@ static cpu_t early_cpu = (cpu_t) {
 };
 
 static thread_t early_thread = (thread_t) {
-    .context = (arch_thread_context_t) {
-        .self = &early_thread.context
-    },
     .tid = 0,
     .assigned_cpu = &early_cpu
 };
@@ -37,7 +35,7 @@ void __entry()
 {
     HHDM = bootreq_hhdm.response->offset;
     // Load pseudo-thread
-    arch_lcpu_thread_reg_write((size_t)&early_thread.context);
+    percpu_init_early(&early_thread);
 
     simplefb_init();
     log(LOG_INFO, "Kernel compiled on %s at %s.", __DATE__, __TIME__);
@@ -52,6 +50,7 @@ void __entry()
 
     // Memory
     pm_init();
+    percpu_init();
     heap_init();
     vm_init();
 
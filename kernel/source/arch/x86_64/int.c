@@ -1,10 +1,13 @@
 #include "arch/irq.h"
 
+#include "arch/lcpu.h"
 #include "arch/x86_64/devices/ioapic.h"
 #include "arch/x86_64/devices/lapic.h"
+#include "arch/x86_64/tlb.h"
 #include "mm/heap.h"
 #include "panic.h"
 #include "sync/spinlock.h"
+#include "sys/percpu.h"
 #include "sys/sched.h"
 #include <stddef.h>
 
@@ -12,7 +15,6 @@
  * Per-CPU vector managament
  */
 
-#define MAX_CPUS 256
 #define MAX_VEC_CPU 128
 
 typedef struct
@@ -21,11 +23,11 @@ typedef struct
     spinlock_t slock;
 }
 cpu_vector_group_t;
-cpu_vector_group_t cpu_vec_grps[MAX_CPUS];
+static PERCPU_DEFINE(cpu_vector_group_t, cpu_vec_grp);
 
 static int alloc_vector(unsigned cpu_id, irq_handler_t handler)
 {
-    cpu_vector_group_t *vg = &cpu_vec_grps[cpu_id];
+    cpu_vector_group_t *vg = PERCPU_PTR(cpu_vec_grp, cpu_id);
     spinlock_acquire(&vg->slock);
 
     for (size_t i = 48; i < MAX_VEC_CPU; i++)
@@ -42,7 +44,7 @@ static int alloc_vector(unsigned cpu_id, irq_handler_t handler)
 
 static void free_vector(unsigned cpu_id, int vector)
 {
-    cpu_vector_group_t *vg = &cpu_vec_grps[cpu_id];
+    cpu_vector_group_t *vg = PERCPU_PTR(cpu_vec_grp, cpu_id);
     spinlock_acquire(&vg->slock);
     vg->handlers[vector] = NULL;
     spinlock_release(&vg->slock);
@@ -158,13 +160,21 @@ __attribute__((packed))
 cpu_state_t;
 
 static void (*arch_timer_handler)();
+static void (*arch_resched_handler)();
 
 void arch_timer_set_handler_per_cpu(void (*handler)())
 {
     arch_timer_handler = handler;
 }
 
+void arch_lcpu_set_resched_handler(void (*handler)())
+{
+    arch_resched_handler = handler;
+}
+
 static_assert(LAPIC_TIMER_VECTOR == 33);
+static_assert(X86_64_TLB_SHOOTDOWN_VECTOR == 34);
+static_assert(LAPIC_RESCHED_VECTOR == 35);
 
 void arch_int_handler(cpu_state_t *cpu_state)
 {
@@ -199,12 +209,22 @@ void arch_int_handler(cpu_state_t *cpu_state)
             x86_64_lapic_send_eoi();
             arch_timer_handler();
         }
+        else if (cpu_state->int_no == X86_64_TLB_SHOOTDOWN_VECTOR)
+        {
+            x86_64_tlb_handle_ipi();
+            x86_64_lapic_send_eoi();
+        }
+        else if (cpu_state->int_no == LAPIC_RESCHED_VECTOR)
+        {
+            x86_64_lapic_send_eoi();
+            if (arch_resched_handler)
+                arch_resched_handler();
+        }
         else
         {
             irq_handler_t handler;
 
-            unsigned cpu_id = sched_get_curr_thread()->assigned_cpu->id;
-            cpu_vector_group_t *vg = &cpu_vec_grps[cpu_id];
+            cpu_vector_group_t *vg = THIS_CPU_PTR(cpu_vec_grp);
             spinlock_acquire(&vg->slock);
             handler = vg->handlers[cpu_state->int_no];
             spinlock_release(&vg->slock);
@@ -1,20 +1,56 @@
 #include "arch/lcpu.h"
 
+#include "arch/x86_64/cpuid.h"
 #include "arch/x86_64/devices/lapic.h"
 #include "arch/x86_64/fpu.h"
 #include "arch/x86_64/msr.h"
 #include "arch/x86_64/syscall.h"
 #include "arch/x86_64/tables/gdt.h"
 #include "arch/x86_64/tables/idt.h"
+#include "arch/x86_64/tlb.h"
 #include "mm/vm.h"
+#include "sys/percpu.h"
+#include "sys/sched.h"
 
 #include <stdint.h>
 
+static PERCPU_DEFINE(uint32_t, lapic_id);
+static bool has_mwait = false;
+
 void arch_lcpu_halt()
 {
     asm volatile("hlt");
 }
 
+void arch_lcpu_idle(const bool *wake_flag)
+{
+    if (!has_mwait)
+    {
+        // STI only takes effect after the next instruction, so an IPI that is already pending ends the HLT.
+        asm volatile("sti; hlt" ::: "memory");
+        return;
+    }
+
+    asm volatile("monitor" :: "a"(wake_flag), "c"(0), "d"(0));
+    // The flag may have been cleared before the monitor was armed, in which case the write was missed.
+    if (__atomic_load_n(wake_flag, __ATOMIC_ACQUIRE))
+        asm volatile("sti; mwait" :: "a"(0), "c"(0) : "memory");
+    else
+        arch_lcpu_int_unmask();
+}
+
+void arch_lcpu_wake(size_t cpu_id)
+{
+    // Clearing the flag already ended MWAIT.
+    if (!has_mwait)
+        arch_lcpu_resched(cpu_id);
+}
+
+void arch_lcpu_resched(size_t cpu_id)
+{
+    x86_64_lapic_ipi(*PERCPU_PTR(lapic_id, cpu_id), LAPIC_RESCHED_VECTOR);
+}
+
 void arch_lcpu_int_mask()
 {
     asm volatile ("cli");
@@ -34,27 +70,56 @@ bool arch_lcpu_int_enabled()
 
 void arch_lcpu_relax()
 {
+    // A CPU spinning with interrupts masked must not hold up a shootdown waiting on it.
+    x86_64_tlb_poll();
     asm volatile ("pause");
 }
 
-size_t arch_lcpu_thread_reg_read()
+void arch_lcpu_percpu_set_base(uintptr_t base)
 {
-    uint64_t gs;
-    asm volatile("mov %%gs:0, %0" : "=r"(gs));
-    return gs;
+    x86_64_msr_write(X86_64_MSR_GS_BASE, base);
 }
 
-void arch_lcpu_thread_reg_write(size_t t)
+uintptr_t arch_lcpu_percpu_base()
 {
-    x86_64_msr_write(X86_64_MSR_GS_BASE, (uint64_t)t);
+    uintptr_t base;
+    asm volatile("movq %%gs:0, %0" : "=r"(base));
+    return base;
+}
+
+uint64_t arch_lcpu_percpu_read(size_t offset)
+{
+    uint64_t value;
+    asm volatile("movq %%gs:(%1), %0" : "=r"(value) : "r"(offset) : "memory");
+    return value;
+}
+
+void arch_lcpu_percpu_write(size_t offset, uint64_t value)
+{
+    asm volatile("movq %1, %%gs:(%0)" :: "r"(offset), "r"(value) : "memory");
+}
+
+void arch_lcpu_percpu_add(size_t offset, uint64_t value)
+{
+    asm volatile("addq %1, %%gs:(%0)" :: "r"(offset), "r"(value) : "memory", "cc");
 }
 
 void arch_lcpu_init()
 {
+    // Kernel mappings are global, so they survive switching address spaces.
+    uint64_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= 1 << 7; // CR4.PGE
+    asm volatile ("mov %0, %%cr4" :: "r"(cr4) : "memory");
+
     vm_addrspace_load(vm_kernel_as);
     x86_64_gdt_init_cpu();
     x86_64_idt_init_cpu();
     x86_64_lapic_init_cpu();
+    x86_64_tlb_init_cpu();
     x86_64_fpu_init_cpu();
     x86_64_syscall_init_cpu();
+
+    *PERCPU_PTR(lapic_id, sched_get_curr_cpuid()) = x86_64_lapic_get_id();
+    has_mwait = x86_64_cpuid_check_feature(X86_64_CPUID_FEATURE_MONITOR);
 }
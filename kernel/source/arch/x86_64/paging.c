@@ -1,11 +1,19 @@
 #include "arch/paging.h"
 
+#include "arch/lcpu.h"
+#include "arch/x86_64/cpuid.h"
+#include "arch/x86_64/devices/lapic.h"
 #include "arch/x86_64/msr.h"
+#include "arch/x86_64/tlb.h"
 #include "assert.h"
 #include "hhdm.h"
 #include "log.h"
 #include "mm/heap.h"
 #include "mm/pm.h"
+#include "sync/spinlock.h"
+#include "sys/sched.h"
+#include "utils/list.h"
+#include "utils/math.h"
 
 #define PTE_PRESENT   (1ull <<  0)
 #define PTE_WRITE     (1ull <<  1)
@@ -22,11 +30,344 @@
 
 typedef uint64_t pte_t;
 
+#define CR3_NOFLUSH (1ull << 63)
+#define CR4_PGE     (1ull <<  7)
+#define CR4_PCIDE   (1ull << 17)
+
+#define MAX_CPUS 64
+#define PCID_COUNT 4096
+
 struct arch_paging_map
 {
     pte_t *pml4;
+    uint16_t pcid; // 0 if none was free, entries tagged with 0 are flushed on every load.
+
+    uint64_t cpus; // CPUs the map is loaded on.
+    uint64_t gen;  // Bumped whenever entries of the map are invalidated.
+    uint64_t synced_gen[MAX_CPUS]; // Generation each CPU last flushed the map's PCID at.
 };
 
+/*
+ * Address space IDs
+ *
+ * Tagging entries with the map's PCID lets them survive switching to another
+ * map and back. They are only kept if the map's generation hasn't moved since
+ * the CPU last flushed them, as invalidations skip CPUs the map isn't loaded
+ * on.
+ */
+
+static uint64_t pcid_bitmap[PCID_COUNT / 64] = { 1 }; // PCID 0 is never handed out.
+static spinlock_t pcid_slock = SPINLOCK_INIT;
+
+static uint16_t pcid_alloc()
+{
+    spinlock_acquire(&pcid_slock);
+
+    for (size_t i = 0; i < PCID_COUNT / 64; i++)
+        if (~pcid_bitmap[i])
+        {
+            size_t bit = __builtin_ctzll(~pcid_bitmap[i]);
+            pcid_bitmap[i] |= 1ull << bit;
+
+            spinlock_release(&pcid_slock);
+            return i * 64 + bit;
+        }
+
+    spinlock_release(&pcid_slock);
+    return 0;
+}
+
+static void pcid_free(uint16_t pcid)
+{
+    if (pcid == 0)
+        return;
+
+    spinlock_acquire(&pcid_slock);
+    pcid_bitmap[pcid / 64] &= ~(1ull << (pcid % 64));
+    spinlock_release(&pcid_slock);
+}
+
+/*
+ * TLB shootdown
+ *
+ * A CPU that loaded the map after its generation was last bumped has reloaded
+ * CR3 since the entries changed, so it has nothing stale cached and skips the
+ * flush.
+ */
+
+#define FLUSH_MAX 32 // Past this many pages, reloading CR3 is cheaper.
+
+typedef struct
+{
+    arch_paging_map_t *map; // NULL for kernel addresses, which every CPU maps.
+    uint64_t gen;
+    size_t count;           // Everything is flushed if above FLUSH_MAX.
+    uintptr_t *vaddrs;
+    bool drop;              // The map is going away, targets still holding it switch away.
+}
+flush_t;
+
+typedef struct
+{
+    uint32_t lapic_id;
+    bool pcid; // CR4.PCIDE is set.
+    arch_paging_map_t *loaded;
+    uint64_t loaded_gen;
+
+    // Invalidations not sent to the other CPUs yet.
+    arch_paging_map_t *batch_map;
+    size_t batch_depth;
+    flush_t batch;
+    uintptr_t batch_vaddrs[FLUSH_MAX];
+
+    bool pending; // `request` is waiting on this CPU.
+}
+tlb_cpu_t;
+
+static tlb_cpu_t tlb_cpus[MAX_CPUS];
+static uint64_t online;
+static bool tlb_ready;
+
+// Holds only the kernel half, for CPUs that have to let go of a dying map.
+static arch_paging_map_t kernel_half;
+
+static const flush_t *request; // Lives on the sender's stack until every target is done.
+static spinlock_t request_slock = SPINLOCK_INIT;
+
+static tlb_cpu_t *this_cpu()
+{
+    uint32_t id = sched_get_curr_cpuid();
+    ASSERT(id < MAX_CPUS);
+    return &tlb_cpus[id];
+}
+
+/**
+ * Kernel entries are global, so reloading CR3 leaves them alone. Toggling
+ * CR4.PGE flushes everything, under every PCID.
+ */
+static void flush_global()
+{
+    uint64_t cr4;
+    asm volatile("movq %%cr4, %0" : "=r"(cr4));
+    asm volatile("movq %0, %%cr4" :: "r"(cr4 ^ CR4_PGE) : "memory");
+    asm volatile("movq %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+static void load(tlb_cpu_t *self, arch_paging_map_t *map)
+{
+    size_t id = self - tlb_cpus;
+    arch_paging_map_t *old = self->loaded;
+
+    // Shootdowns must see this CPU in the mask before it can cache anything from the map.
+    __atomic_fetch_or(&map->cpus, 1ull << id, __ATOMIC_SEQ_CST);
+    self->loaded = map;
+    self->loaded_gen = __atomic_load_n(&map->gen, __ATOMIC_SEQ_CST);
+
+    uint64_t cr3 = (uintptr_t)map->pml4 - HHDM;
+    if (self->pcid && map->pcid)
+    {
+        cr3 |= map->pcid;
+        if (map->synced_gen[id] == self->loaded_gen)
+            cr3 |= CR3_NOFLUSH;
+        map->synced_gen[id] = self->loaded_gen;
+    }
+    asm volatile("movq %0, %%cr3" :: "r"(cr3) : "memory");
+
+    if (old && old != map)
+        __atomic_fetch_and(&old->cpus, ~(1ull << id), __ATOMIC_SEQ_CST);
+}
+
+static void flush_local(tlb_cpu_t *self, const flush_t *f)
+{
+    if (f->drop)
+    {
+        if (self->loaded == f->map)
+            load(self, &kernel_half);
+        return;
+    }
+
+    if (f->count > FLUSH_MAX && !f->map)
+        flush_global();
+    else if (f->count > FLUSH_MAX)
+    {
+        uint64_t cr3;
+        asm volatile("movq %%cr3, %0" : "=r"(cr3));
+        asm volatile("movq %0, %%cr3" :: "r"(cr3) : "memory");
+    }
+    else
+        for (size_t i = 0; i < f->count; i++)
+            asm volatile("invlpg (%0)" ::"r"(f->vaddrs[i]) : "memory");
+}
+
+static void service(tlb_cpu_t *cpu)
+{
+    if (!__atomic_load_n(&cpu->pending, __ATOMIC_ACQUIRE))
+        return;
+
+    const flush_t *f = request;
+    if (!f->map || f->drop || (cpu->loaded == f->map && cpu->loaded_gen < f->gen))
+        flush_local(cpu, f);
+
+    __atomic_store_n(&cpu->pending, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * Makes the other CPUs drop their entries for the addresses in `f`, which the
+ * calling CPU already did.
+ */
+static void shootdown(flush_t *f)
+{
+    if (!__atomic_load_n(&tlb_ready, __ATOMIC_ACQUIRE))
+        return;
+
+    tlb_cpu_t *self = this_cpu();
+
+    // The entries changed before the generation moves on, so any CPU loading the map past this point can't cache
+    // stale ones. A CPU loading it before is in the mask read below.
+    uint64_t targets;
+    if (f->drop)
+        targets = __atomic_load_n(&f->map->cpus, __ATOMIC_SEQ_CST);
+    else if (f->map)
+    {
+        f->gen = __atomic_add_fetch(&f->map->gen, 1, __ATOMIC_SEQ_CST);
+        targets = __atomic_load_n(&f->map->cpus, __ATOMIC_SEQ_CST);
+    }
+    else
+    {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        targets = __atomic_load_n(&online, __ATOMIC_SEQ_CST);
+    }
+    targets &= __atomic_load_n(&online, __ATOMIC_ACQUIRE) & ~(1ull << (self - tlb_cpus));
+    if (!targets)
+        return;
+
+    // Waiting for the lock services requests aimed at this CPU, from arch_lcpu_relax().
+    spinlock_acquire(&request_slock);
+
+    request = f;
+    for (size_t i = 0; i < MAX_CPUS; i++)
+        if (targets & (1ull << i))
+            __atomic_store_n(&tlb_cpus[i].pending, true, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < MAX_CPUS; i++)
+        if (targets & (1ull << i))
+            x86_64_lapic_ipi(tlb_cpus[i].lapic_id, X86_64_TLB_SHOOTDOWN_VECTOR);
+
+    for (size_t i = 0; i < MAX_CPUS; i++)
+        while (__atomic_load_n(&tlb_cpus[i].pending, __ATOMIC_ACQUIRE))
+            asm volatile("pause");
+
+    spinlock_release(&request_slock);
+}
+
+static void batch_send(tlb_cpu_t *self)
+{
+    if (self->batch.count == 0)
+        return;
+
+    shootdown(&self->batch);
+    self->batch.count = 0;
+}
+
+/**
+ * Drops `vaddr` of `map` from the local TLB, and from the other CPUs' either
+ * now or when the batch ends.
+ */
+static void invalidate(arch_paging_map_t *map, uintptr_t vaddr)
+{
+    // Also drops global entries, whatever PCID is current.
+    asm volatile("invlpg (%0)" ::"r"(vaddr) : "memory");
+
+    tlb_cpu_t *self = this_cpu();
+    arch_paging_map_t *target = vaddr >= HHDM ? NULL : map;
+
+    if (self->batch_depth == 0 || self->batch_map != map)
+    {
+        flush_t f = { .map = target, .count = 1, .vaddrs = &vaddr };
+        shootdown(&f);
+        return;
+    }
+
+    if (self->batch.count && self->batch.map != target)
+        batch_send(self);
+
+    self->batch.map = target;
+    if (self->batch.count < FLUSH_MAX)
+        self->batch_vaddrs[self->batch.count] = vaddr;
+    self->batch.count++;
+}
+
+/**
+ * Makes sure no CPU walks the page tables unmapped from `map` so far anymore,
+ * so that they can be freed.
+ */
+static void sync_tables(arch_paging_map_t *map, bool kernel)
+{
+    if (!kernel)
+    {
+        tlb_cpu_t *self = this_cpu();
+        if (self->batch_depth && self->batch_map == map)
+            batch_send(self);
+        return;
+    }
+
+    // INVLPG only drops the cached upper levels of the current PCID, and kernel ones may be cached under any.
+    flush_global();
+    flush_t f = { .map = NULL, .count = FLUSH_MAX + 1 };
+    shootdown(&f);
+}
+
+/**
+ * Like invalidate(), when page tables above `vaddr` were unmapped as well. They
+ * can be freed once this returns.
+ */
+static void invalidate_tables(arch_paging_map_t *map, uintptr_t vaddr)
+{
+    if (vaddr < HHDM)
+        invalidate(map, vaddr);
+    sync_tables(map, vaddr >= HHDM);
+}
+
+void x86_64_tlb_handle_ipi()
+{
+    service(this_cpu());
+}
+
+void x86_64_tlb_poll()
+{
+    if (!__atomic_load_n(&tlb_ready, __ATOMIC_ACQUIRE))
+        return;
+
+    tlb_cpu_t *cpu = this_cpu();
+    if (!__atomic_load_n(&cpu->pending, __ATOMIC_ACQUIRE))
+        return;
+
+    // The IPI could otherwise run the request a second time halfway through.
+    bool int_state = arch_lcpu_int_enabled();
+    arch_lcpu_int_mask();
+    service(cpu);
+    if (int_state)
+        arch_lcpu_int_unmask();
+}
+
+void x86_64_tlb_init_cpu()
+{
+    tlb_cpu_t *self = this_cpu();
+    self->lapic_id = x86_64_lapic_get_id();
+    self->batch.vaddrs = self->batch_vaddrs;
+
+    // The map loaded so far went in untagged, as CR4.PCIDE can only be set while the PCID in CR3 is 0.
+    if (x86_64_cpuid_check_feature(X86_64_CPUID_FEATURE_PCID))
+    {
+        uint64_t cr4;
+        asm volatile("movq %%cr4, %0" : "=r"(cr4));
+        asm volatile("movq %0, %%cr4" :: "r"(cr4 | CR4_PCIDE) : "memory");
+        self->pcid = true;
+    }
+
+    __atomic_fetch_or(&online, 1ull << (self - tlb_cpus), __ATOMIC_SEQ_CST);
+    __atomic_store_n(&tlb_ready, true, __ATOMIC_RELEASE);
+}
+
 // Mapping and unmapping
 
 static inline void pt_children_inc(pte_t *table)
@@ -63,14 +404,16 @@ static pte_t *get_next_level(pte_t *table, uint64_t idx, bool alloc, bool user)
     return next_level;
 }
 
-int arch_paging_map_page(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t paddr, size_t size, vm_protection_t prot, vm_cache_t cache)
+static bool table_is_empty(const pte_t *table)
 {
-    ASSERT(size == ARCH_PAGE_SIZE_4K
-        || size == ARCH_PAGE_SIZE_2M
-        || size == ARCH_PAGE_SIZE_1G);
-    ASSERT(vaddr % size == 0);
-    ASSERT(paddr % size == 0);
+    for (size_t i = 0; i < 512; i++)
+        if (table[i] & PTE_PRESENT)
+            return false;
+    return true;
+}
 
+static pte_t leaf_flags(vm_protection_t prot, vm_cache_t cache)
+{
     pte_t flags = 0;
     if (!(prot & VM_PROTECTION_READ)) log(LOG_ERROR, "No-read mapping is not supported on x86_64!");
     if (prot & VM_PROTECTION_WRITE) flags |= PTE_WRITE;
@@ -83,6 +426,19 @@ int arch_paging_map_page(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t padd
     };
     flags |= PTE_PAT_IDX(attr_idx[cache]);
 
+    return flags;
+}
+
+int arch_paging_map_page(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t paddr, size_t size, vm_protection_t prot, vm_cache_t cache)
+{
+    ASSERT(size == ARCH_PAGE_SIZE_4K
+        || size == ARCH_PAGE_SIZE_2M
+        || size == ARCH_PAGE_SIZE_1G);
+    ASSERT(vaddr % size == 0);
+    ASSERT(paddr % size == 0);
+
+    pte_t flags = leaf_flags(prot, cache);
+
     bool is_user = vaddr < HHDM;
 
     size_t indices[] = {
@@ -110,9 +466,22 @@ int arch_paging_map_page(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t padd
     // Leaf
 
     uint64_t leaf_idx = indices[target_level];
+
+    // A huge leaf may take the place of a table whose pages were all unmapped.
+    if (target_level > 0 && (table[leaf_idx] & PTE_PRESENT) && !(table[leaf_idx] & PTE_HUGE))
+    {
+        pte_t *child = (pte_t *)(PTE_ADDR_MASK(table[leaf_idx]) + HHDM);
+        if (table_is_empty(child))
+        {
+            table[leaf_idx] = 0;
+            pt_children_dec(table);
+            invalidate_tables(map, vaddr);
+            pm_free(pm_phys_to_page((uintptr_t)child - HHDM));
+        }
+    }
     ASSERT(!(table[leaf_idx] & PTE_PRESENT));
 
-    pte_t entry = paddr | PTE_PRESENT | flags | (is_user ? PTE_USER : 0);
+    pte_t entry = paddr | PTE_PRESENT | flags | (is_user ? PTE_USER : PTE_GLOBAL);
     if (target_level > 0)
         entry |= PTE_HUGE;
     pt_children_inc(table);
@@ -122,6 +491,52 @@ int arch_paging_map_page(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t padd
     return 0;
 }
 
+size_t arch_paging_map_batch(arch_paging_map_t *map, uintptr_t vaddr, const uintptr_t *paddrs, size_t count, vm_protection_t prot, vm_cache_t cache)
+{
+    ASSERT(vaddr % ARCH_PAGE_GRAN == 0);
+    ASSERT(((vaddr >> 12) & 0x1FF) + count <= 512);
+
+    bool is_user = vaddr < HHDM;
+    pte_t flags = leaf_flags(prot, cache) | PTE_PRESENT | (is_user ? PTE_USER : PTE_GLOBAL);
+
+    size_t indices[] = {
+        (vaddr >> 12) & 0x1FF,
+        (vaddr >> 21) & 0x1FF,
+        (vaddr >> 30) & 0x1FF,
+        (vaddr >> 39) & 0x1FF
+    };
+
+    pte_t *table = map->pml4;
+    for (size_t level = 3; level > 0; level--)
+    {
+        size_t idx = indices[level];
+        if (table[idx] & PTE_HUGE)
+            return 0;
+
+        pte_t *next = get_next_level(table, idx, true, is_user);
+        if (!next)
+            return 0;
+        table = next;
+    }
+
+    // Leaves
+
+    size_t mapped = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t idx = indices[0] + i;
+        if (!paddrs[i] || (table[idx] & PTE_PRESENT))
+            continue;
+
+        ASSERT(paddrs[i] % ARCH_PAGE_GRAN == 0);
+        table[idx] = paddrs[i] | flags;
+        pt_children_inc(table);
+        mapped++;
+    }
+
+    return mapped;
+}
+
 int arch_paging_unmap_page(arch_paging_map_t *map, uintptr_t vaddr)
 {
     size_t indices[] = {
@@ -154,22 +569,83 @@ int arch_paging_unmap_page(arch_paging_map_t *map, uintptr_t vaddr)
 
     tables[level][leaf_idx] = 0;
     // Ascend
+    uintptr_t freed[3];
+    size_t freed_count = 0;
     while (level <= 3)
     {
-        if (!pt_children_dec(tables[level]))
+        if (!pt_children_dec(tables[level]) || level == 3)
             break;
 
-        uintptr_t phys = (uintptr_t)tables[level] - HHDM;
+        freed[freed_count++] = (uintptr_t)tables[level] - HHDM;
 
         // Disconnect from parent before freeing child
         level++;
         tables[level][indices[level]] = 0;
+    }
+
+    // Flush TLB. No CPU may still walk the tables once they are freed.
+    if (freed_count)
+        invalidate_tables(map, vaddr);
+    else
+        invalidate(map, vaddr);
 
-        pm_free(pm_phys_to_page(phys));
+    for (size_t i = 0; i < freed_count; i++)
+        pm_free(pm_phys_to_page(freed[i]));
+
+    return 0;
+}
+
+int arch_paging_split_page(arch_paging_map_t *map, uintptr_t vaddr)
+{
+    size_t indices[] = {
+        (vaddr >> 12) & 0x1FF,
+        (vaddr >> 21) & 0x1FF,
+        (vaddr >> 30) & 0x1FF,
+        (vaddr >> 39) & 0x1FF
+    };
+
+    bool is_user = vaddr < HHDM;
+
+    // Descend until the huge leaf is found.
+    pte_t *table = map->pml4;
+    size_t level;
+    for (level = 3; level >= 1; level--)
+    {
+        pte_t entry = table[indices[level]];
+        if (!(entry & PTE_PRESENT))
+            return -1;
+        if (entry & PTE_HUGE)
+            break;
+        if (level == 1)
+            return -1; // Already mapped with 4KiB pages.
+
+        table = (pte_t *)(PTE_ADDR_MASK(entry) + HHDM);
     }
+    if (level == 3)
+        return -1;
+
+    page_t *p = pm_alloc(0);
+    if (!p)
+        return -1;
+    pte_t *next = (pte_t *)(p->addr + HHDM);
+
+    // A 1GiB leaf becomes 2MiB leaves, a 2MiB leaf becomes 4KiB leaves.
+    pte_t entry = table[indices[level]];
+    size_t step = (level == 2) ? ARCH_PAGE_SIZE_2M : ARCH_PAGE_SIZE_4K;
+    pte_t flags = entry & ~PTE_ADDR_MASK(entry);
+    if (level == 1)
+        flags &= ~PTE_HUGE;
+
+    for (size_t i = 0; i < 512; i++)
+    {
+        next[i] = (PTE_ADDR_MASK(entry) + i * step) | flags;
+        pt_children_inc(next);
+    }
+
+    table[indices[level]] = p->addr | PTE_PRESENT | PTE_WRITE | (is_user ? PTE_USER : 0);
 
     // Flush TLB
-    asm volatile("invlpg (%0)" ::"r"(vaddr) : "memory");
+    invalidate(map, vaddr);
 
     return 0;
 }
@@ -222,11 +698,249 @@ int arch_paging_prot_page(arch_paging_map_t *map, uintptr_t vaddr, size_t size,
     table[leaf_idx] = entry;
 
     // Flush TLB
-    asm volatile("invlpg (%0)" ::"r"(vaddr) : "memory");
+    invalidate(map, vaddr);
 
     return 0;
 }
 
+bool arch_paging_test_and_clear_accessed(arch_paging_map_t *map, uintptr_t vaddr)
+{
+    size_t indices[] = {
+        (vaddr >> 12) & 0x1FF,
+        (vaddr >> 21) & 0x1FF,
+        (vaddr >> 30) & 0x1FF,
+        (vaddr >> 39) & 0x1FF
+    };
+
+    pte_t *table = map->pml4;
+    int level = 3;
+    for (; level >= 1; level--)
+    {
+        pte_t entry = table[indices[level]];
+        if (!(entry & PTE_PRESENT))
+            return false;
+        if (entry & PTE_HUGE)
+            break;
+
+        table = (pte_t *)(PTE_ADDR_MASK(entry) + HHDM);
+    }
+
+    pte_t *leaf = &table[indices[level]];
+    if (!(*leaf & PTE_PRESENT) || !(*leaf & PTE_ACCESSED))
+        return false;
+
+    // The CPU sets the flag atomically, so clear it the same way. Other CPUs are left alone, a stale entry there
+    // only makes the page look colder than it is.
+    __atomic_fetch_and(leaf, ~PTE_ACCESSED, __ATOMIC_RELAXED);
+    asm volatile("invlpg (%0)" ::"r"(vaddr) : "memory");
+
+    return true;
+}
+
+bool arch_paging_is_dirty(const arch_paging_map_t *map, uintptr_t vaddr)
+{
+    size_t indices[] = {
+        (vaddr >> 12) & 0x1FF,
+        (vaddr >> 21) & 0x1FF,
+        (vaddr >> 30) & 0x1FF,
+        (vaddr >> 39) & 0x1FF
+    };
+
+    pte_t *table = map->pml4;
+    int level = 3;
+    for (; level >= 1; level--)
+    {
+        pte_t entry = table[indices[level]];
+        if (!(entry & PTE_PRESENT))
+            return false;
+        if (entry & PTE_HUGE)
+            break;
+
+        table = (pte_t *)(PTE_ADDR_MASK(entry) + HHDM);
+    }
+
+    pte_t leaf = __atomic_load_n(&table[indices[level]], __ATOMIC_RELAXED);
+    return (leaf & PTE_PRESENT) && (leaf & PTE_DIRTY);
+}
+
+// Ranges
+
+#define LEVEL_SHIFT(LEVEL) (12 + 9 * (LEVEL))
+#define LEVEL_SIZE(LEVEL) (1ull << LEVEL_SHIFT(LEVEL))
+
+static bool map_level(pte_t *table, size_t level, uintptr_t *vaddr, uintptr_t *paddr, size_t *remaining,
+                      pte_t flags, bool is_user)
+{
+    size_t size = LEVEL_SIZE(level);
+
+    for (size_t idx = (*vaddr >> LEVEL_SHIFT(level)) & 0x1FF; idx < 512 && *remaining > 0; idx++)
+    {
+        // The largest leaf that both addresses are aligned to and that the range fills.
+        bool leaf = level == 0
+                 || (level <= 2 && !(table[idx] & PTE_PRESENT)
+                 &&  *vaddr % size == 0 && *paddr % size == 0 && *remaining >= size);
+        if (!leaf)
+        {
+            ASSERT(!(table[idx] & PTE_HUGE));
+
+            pte_t *next = get_next_level(table, idx, true, is_user);
+            if (!next || !map_level(next, level - 1, vaddr, paddr, remaining, flags, is_user))
+                return false;
+            continue;
+        }
+
+        ASSERT(!(table[idx] & PTE_PRESENT));
+        table[idx] = *paddr | flags | (level > 0 ? PTE_HUGE : 0);
+        pt_children_inc(table);
+
+        *vaddr += size;
+        *paddr += size;
+        *remaining -= size;
+    }
+
+    return true;
+}
+
+int arch_paging_map_range(arch_paging_map_t *map, uintptr_t vaddr, uintptr_t paddr, size_t length, vm_protection_t prot, vm_cache_t cache)
+{
+    ASSERT(vaddr % ARCH_PAGE_GRAN == 0);
+    ASSERT(paddr % ARCH_PAGE_GRAN == 0);
+    ASSERT(length % ARCH_PAGE_GRAN == 0);
+
+    bool is_user = vaddr < HHDM;
+    pte_t flags = leaf_flags(prot, cache) | PTE_PRESENT | (is_user ? PTE_USER : PTE_GLOBAL);
+
+    return map_level(map->pml4, 3, &vaddr, &paddr, &length, flags, is_user) ? 0 : -1;
+}
+
+/**
+ * Calls `fn` on every leaf in the range. Huge leaves sticking out of it are split first.
+ */
+static bool walk_level(arch_paging_map_t *map, pte_t *table, size_t level, uintptr_t *vaddr, size_t *remaining,
+                       void (*fn)(arch_paging_map_t *map, pte_t *table, size_t idx, uintptr_t vaddr, void *arg),
+                       void *arg, list_t *freed)
+{
+    size_t size = LEVEL_SIZE(level);
+
+    for (size_t idx = (*vaddr >> LEVEL_SHIFT(level)) & 0x1FF; idx < 512 && *remaining > 0; idx++)
+    {
+        size_t step = MIN(size - *vaddr % size, *remaining);
+
+        if ((table[idx] & PTE_PRESENT) && (table[idx] & PTE_HUGE) && step < size
+        &&  arch_paging_split_page(map, *vaddr) != 0)
+            return false;
+
+        if (!(table[idx] & PTE_PRESENT))
+        {
+            *vaddr += step;
+            *remaining -= step;
+            continue;
+        }
+
+        if (level == 0 || (table[idx] & PTE_HUGE))
+        {
+            fn(map, table, idx, *vaddr, arg);
+            *vaddr += step;
+            *remaining -= step;
+            continue;
+        }
+
+        pte_t *next = (pte_t *)(PTE_ADDR_MASK(table[idx]) + HHDM);
+        if (!walk_level(map, next, level - 1, vaddr, remaining, fn, arg, freed))
+            return false;
+
+        // Tables emptied by unmapping go too, except the kernel's PML3s which every map shares.
+        page_t *p = pm_phys_to_page((uintptr_t)next - HHDM);
+        if (freed && atomic_load_explicit(&p->children, memory_order_relaxed) == 0
+        &&  !(level == 3 && idx >= 256))
+        {
+            table[idx] = 0;
+            pt_children_dec(table);
+            list_append(freed, &p->list_elem);
+        }
+    }
+
+    return true;
+}
+
+static void unmap_leaf(arch_paging_map_t *map, pte_t *table, size_t idx, uintptr_t vaddr, [[maybe_unused]] void *arg)
+{
+    table[idx] = 0;
+    pt_children_dec(table);
+    invalidate(map, vaddr);
+}
+
+int arch_paging_unmap_range(arch_paging_map_t *map, uintptr_t vaddr, size_t length)
+{
+    ASSERT(vaddr % ARCH_PAGE_GRAN == 0);
+    ASSERT(length % ARCH_PAGE_GRAN == 0);
+
+    bool kernel = vaddr >= HHDM;
+    list_t freed = LIST_INIT;
+
+    arch_paging_batch_begin(map);
+    bool ok = walk_level(map, map->pml4, 3, &vaddr, &length, unmap_leaf, NULL, &freed);
+    if (!list_is_empty(&freed))
+        sync_tables(map, kernel);
+    arch_paging_batch_end(map);
+
+    list_node_t *n;
+    while ((n = list_pop_head(&freed)))
+        pm_free(LIST_GET_CONTAINER(n, page_t, list_elem));
+
+    return ok ? 0 : -1;
+}
+
+static void prot_leaf(arch_paging_map_t *map, pte_t *table, size_t idx, uintptr_t vaddr, void *arg)
+{
+    vm_protection_t prot = *(vm_protection_t *)arg;
+
+    pte_t entry = table[idx] & ~(PTE_WRITE | PTE_NX);
+    if (prot & VM_PROTECTION_WRITE) entry |= PTE_WRITE;
+    if (!(prot & VM_PROTECTION_EXECUTE)) entry |= PTE_NX;
+
+    if (entry == table[idx])
+        return;
+    table[idx] = entry;
+    invalidate(map, vaddr);
+}
+
+int arch_paging_prot_range(arch_paging_map_t *map, uintptr_t vaddr, size_t length, vm_protection_t prot)
+{
+    ASSERT(vaddr % ARCH_PAGE_GRAN == 0);
+    ASSERT(length % ARCH_PAGE_GRAN == 0);
+
+    if (!(prot & VM_PROTECTION_READ)) log(LOG_ERROR, "No-read mapping is not supported on x86_64!");
+
+    arch_paging_batch_begin(map);
+    bool ok = walk_level(map, map->pml4, 3, &vaddr, &length, prot_leaf, &prot, NULL);
+    arch_paging_batch_end(map);
+
+    return ok ? 0 : -1;
+}
+
+// TLB maintenance
+
+void arch_paging_batch_begin(arch_paging_map_t *map)
+{
+    tlb_cpu_t *self = this_cpu();
+    if (self->batch_depth++ == 0)
+        self->batch_map = map;
+}
+
+void arch_paging_batch_end(arch_paging_map_t *map)
+{
+    tlb_cpu_t *self = this_cpu();
+    ASSERT(self->batch_depth > 0);
+
+    if (--self->batch_depth > 0)
+        return;
+
+    ASSERT(self->batch_map == map);
+    batch_send(self);
+    self->batch_map = NULL;
+}
+
 // Utils
 
 bool arch_paging_vaddr_to_paddr(const arch_paging_map_t *map, uintptr_t vaddr, uintptr_t *out_paddr)
@@ -274,6 +988,30 @@ bool arch_paging_vaddr_to_paddr(const arch_paging_map_t *map, uintptr_t vaddr, u
     return true;
 }
 
+size_t arch_paging_get_page_size(const arch_paging_map_t *map, uintptr_t vaddr)
+{
+    size_t indices[] = {
+        (vaddr >> 12) & 0x1FF,
+        (vaddr >> 21) & 0x1FF,
+        (vaddr >> 30) & 0x1FF,
+        (vaddr >> 39) & 0x1FF
+    };
+    const size_t sizes[] = { ARCH_PAGE_SIZE_4K, ARCH_PAGE_SIZE_2M, ARCH_PAGE_SIZE_1G };
+
+    pte_t *table = map->pml4;
+    for (size_t level = 3; level >= 1; level--)
+    {
+        pte_t entry = table[indices[level]];
+        if (!(entry & PTE_PRESENT))
+            return 0;
+        if (entry & PTE_HUGE)
+            return sizes[level];
+
+        table = (pte_t *)(PTE_ADDR_MASK(entry) + HHDM);
+    }
+
+    return (table[indices[0]] & PTE_PRESENT) ? ARCH_PAGE_SIZE_4K : 0;
+}
 
 // Map creation and destruction
 
@@ -283,6 +1021,12 @@ arch_paging_map_t *arch_paging_map_create()
 {
     arch_paging_map_t *map = heap_alloc(sizeof(arch_paging_map_t));
     map->pml4 = (pte_t *)(pm_alloc(0)->addr + HHDM);
+    map->pcid = pcid_alloc();
+    map->cpus = 0;
+    map->gen = 0;
+    // Whatever a CPU still has tagged with a reused PCID belongs to some earlier map.
+    for (size_t i = 0; i < MAX_CPUS; i++)
+        map->synced_gen[i] = UINT64_MAX;
     memset(map->pml4, 0, 0x1000);
 
     for (int i = 0; i < 256; i++)
@@ -307,6 +1051,24 @@ static void delete_level(pte_t *level, int depth)
 
 void arch_paging_map_destroy(arch_paging_map_t *map)
 {
+    // Kernel threads may still be borrowing the map.
+    if (__atomic_load_n(&tlb_ready, __ATOMIC_ACQUIRE))
+    {
+        bool int_state = arch_lcpu_int_enabled();
+        arch_lcpu_int_mask();
+
+        tlb_cpu_t *self = this_cpu();
+        if (self->loaded == map)
+            load(self, &kernel_half);
+
+        flush_t f = { .map = map, .drop = true };
+        shootdown(&f);
+        ASSERT(__atomic_load_n(&map->cpus, __ATOMIC_SEQ_CST) == 0);
+
+        if (int_state)
+            arch_lcpu_int_unmask();
+    }
+
     for (int i = 0; i < 256; i++)
     {
         if (!(map->pml4[i] & PTE_PRESENT))
@@ -316,6 +1078,7 @@ void arch_paging_map_destroy(arch_paging_map_t *map)
     }
 
     pm_free(pm_phys_to_page((uintptr_t)map->pml4 - HHDM));
+    pcid_free(map->pcid);
     heap_free(map);
 }
 
@@ -323,7 +1086,31 @@ void arch_paging_map_destroy(arch_paging_map_t *map)
 
 void arch_paging_map_load(arch_paging_map_t *map)
 {
-    asm volatile("movq %0, %%cr3" :: "r"((uintptr_t)map->pml4 - HHDM) : "memory");
+    if (!__atomic_load_n(&tlb_ready, __ATOMIC_ACQUIRE))
+    {
+        asm volatile("movq %0, %%cr3" :: "r"((uintptr_t)map->pml4 - HHDM) : "memory");
+        return;
+    }
+
+    // A shootdown dropping the old map must not slip in halfway through.
+    bool int_state = arch_lcpu_int_enabled();
+    arch_lcpu_int_mask();
+
+    tlb_cpu_t *self = this_cpu();
+    if (self->loaded != map)
+        load(self, map);
+
+    if (int_state)
+        arch_lcpu_int_unmask();
+}
+
+void arch_paging_map_load_lazy(arch_paging_map_t *map)
+{
+    // Any map will do, they all share the kernel half.
+    if (__atomic_load_n(&tlb_ready, __ATOMIC_ACQUIRE) && this_cpu()->loaded)
+        return;
+
+    arch_paging_map_load(map);
 }
 
 // Init
@@ -337,6 +1124,11 @@ void arch_paging_init()
         higher_half_entries[i] = (pte_t)((uintptr_t)pml3 - HHDM) | PTE_PRESENT | PTE_WRITE;
     }
 
+    kernel_half.pml4 = (pte_t *)(pm_alloc(0)->addr + HHDM);
+    memset(kernel_half.pml4, 0, 0x1000);
+    for (int i = 0; i < 256; i++)
+        kernel_half.pml4[i + 256] = higher_half_entries[i];
+
     // Setup PAT register
     uint64_t pat =  6ull         // Write-Back
                  | (4ull <<  8)  // Write-Through
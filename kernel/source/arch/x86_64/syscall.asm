@@ -1,7 +1,12 @@
 global x86_64_arch_syscall_entry
 
-%define KERNEL_STACK_OFFSET 40
-%define SYSCALL_STACK_OFFSET 48
+; percpu_head_t
+%define PERCPU_CURR_THREAD_OFFSET 16
+%define PERCPU_SCRATCH_OFFSET 24
+
+; arch_thread_context_t
+%define KERNEL_STACK_OFFSET 32
+%define SYSCALL_STACK_OFFSET 40
 
 extern syscall_table
 extern syscall_table_length
@@ -9,12 +14,19 @@ extern syscall_table_length
 section .text
 x86_64_arch_syscall_entry:
     swapgs
-    mov qword [gs:SYSCALL_STACK_OFFSET], rsp
-    mov rsp, qword [gs:KERNEL_STACK_OFFSET]
+    ; Interrupts are masked until the user stack pointer is moved from the scratch slot to the thread.
+    mov qword [gs:PERCPU_SCRATCH_OFFSET], rsp
+    mov rsp, qword [gs:PERCPU_CURR_THREAD_OFFSET]
+    mov rsp, qword [rsp + KERNEL_STACK_OFFSET]
 
     ; RAX and RDX are not preserved because they hold the syscall return value and errno, respectively.
 
     push rbx
+
+    mov rbx, qword [gs:PERCPU_CURR_THREAD_OFFSET]
+    push qword [gs:PERCPU_SCRATCH_OFFSET]
+    pop qword [rbx + SYSCALL_STACK_OFFSET]
+
     push rcx
     push rbp
     push rsi
@@ -60,6 +72,7 @@ x86_64_arch_syscall_entry:
     pop rcx
     pop rbx
 
-    mov rsp, qword [gs:SYSCALL_STACK_OFFSET]
+    mov rsp, qword [gs:PERCPU_CURR_THREAD_OFFSET]
+    mov rsp, qword [rsp + SYSCALL_STACK_OFFSET]
     swapgs
     o64 sysret
@@ -10,8 +10,11 @@
 #include "log.h"
 #include "mm/mm.h"
 #include "mm/pm.h"
+#include "sys/percpu.h"
 #include "sys/sched.h"
+#include "sys/thread.h"
 #include "uapi/errno.h"
+#include "utils/container_of.h"
 #include "utils/math.h"
 
 typedef struct
@@ -74,7 +77,6 @@ int arch_thread_context_init(arch_thread_context_t *context, vm_addrspace_t *as,
 {
     int err = EOK;
 
-    context->self = context;
     context->fs = context->gs = 0;
 
     page_t *page = pm_alloc(0);
@@ -140,7 +142,6 @@ arch_thread_syscall_frame_t;
 
 bool arch_thread_context_fork(arch_thread_context_t *dest, arch_thread_context_t *src)
 {
-    dest->self = dest;
     x86_64_fpu_save(src->fpu_area);
     dest->fs = x86_64_msr_read(X86_64_MSR_FS_BASE);
     dest->gs = x86_64_msr_read(X86_64_MSR_KERNEL_GS_BASE);
@@ -194,8 +195,8 @@ void arch_thread_context_switch(arch_thread_context_t *curr, arch_thread_context
     // FPU
     x86_64_fpu_save(curr->fpu_area);
     x86_64_fpu_restore(next->fpu_area);
-    // Thread reg and TSS
-    arch_lcpu_thread_reg_write((size_t)next);
+    // Current thread and TSS
+    THIS_CPU_WRITE(percpu_head.curr_thread, container_of(next, thread_t, context));
     x86_64_tss_set_rsp0(&x86_64_tss[sched_get_curr_cpuid()], next->kernel_stack);
 
     __thread_context_switch(curr, next); // This function calls `sched_drop` internally for `curr`.
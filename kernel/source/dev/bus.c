@@ -1,27 +1,28 @@
 #include "dev/bus.h"
 
 #include "log.h"
+#include "sync/rcu.h"
 #include "utils/string.h"
 
 static list_t bus_list = LIST_INIT;
-static spinlock_t bus_list_slock = SPINLOCK_INIT;
+static spinlock_t bus_list_slock = SPINLOCK_INIT; // Only taken by writers.
 
 bus_t *bus_get(const char *name)
 {
-    spinlock_acquire(&bus_list_slock);
+    rcu_read_lock();
 
-    FOREACH(n, bus_list)
+    FOREACH_RCU(n, bus_list)
     {
         bus_t *bus = LIST_GET_CONTAINER(n, bus_t, list_node);
         if (strcmp(bus->name, name) == 0)
         {
-            spinlock_release(&bus_list_slock);
             ref_inc(&bus->refcount);
+            rcu_read_unlock();
             return bus;
         }
     }
 
-    spinlock_release(&bus_list_slock);
+    rcu_read_unlock();
     return NULL;
 }
 
@@ -46,9 +47,12 @@ bool bus_register(bus_t *bus)
     {
         bus_t *b = LIST_GET_CONTAINER(n, bus_t, list_node);
         if (strcmp(b->name, bus->name) == 0)
+        {
+            spinlock_release(&bus_list_slock);
             return false;
+        }
     }
-    list_append(&bus_list, &bus->list_node);
+    list_append_rcu(&bus_list, &bus->list_node);
 
     spinlock_release(&bus_list_slock);
 
@@ -57,7 +57,7 @@ static int write(vnode_t *vn, const void *buffer, uint64_t offset, uint64_t coun
 }
 
 static int mmap(vnode_t *vn, vm_addrspace_t *as, uintptr_t vaddr, size_t length,
-            int prot, int flags, uint64_t offset)
+            int prot, int flags, uint64_t offset, uintptr_t *out)
 {
     return ENOTSUP;
 }
@@ -0,0 +1,320 @@
+#include "fs/hugetlbfs.h"
+
+#include "arch/clock.h"
+#include "arch/types.h"
+#include "fs/mount.h"
+#include "log.h"
+#include "mm/heap.h"
+#include "mm/mm.h"
+#include "mm/vm.h"
+#include "mm/vm/vm_hugetlb.h"
+#include "panic.h"
+#include "uapi/errno.h"
+#include "utils/list.h"
+#include "utils/math.h"
+#include "utils/string.h"
+
+/*
+ * A flat filesystem of files whose contents live in the huge page pools.
+ * Files have no contents until they are mapped, and every mapping of a file
+ * shares the same pages.
+ */
+
+typedef struct hugetlbfs_node
+{
+    vnode_t vn;
+    size_t page_size;
+
+    list_t children;     // Root only.
+    vm_object_t *object; // Files only, NULL until first mapped.
+
+    list_node_t list_node;
+}
+hugetlbfs_node_t;
+
+// VFS API
+
+static vnode_t *hugetlbfs_get_root(vfs_t *self);
+
+vfs_ops_t hugetlbfs_ops = {
+    .get_root = hugetlbfs_get_root
+};
+
+static int lookup (vnode_t *self, const char *name, vnode_t **out);
+static int create (vnode_t *self, const char *name, vnode_type_t t, vnode_t **out);
+static int remove (vnode_t *self, const char *name);
+static int readdir(vnode_t *self, vfs_dirent_t **out_entries, size_t *out_count);
+static int ioctl  (vnode_t *self, uint64_t cmd, void *args);
+static int mmap   (vnode_t *self, vm_addrspace_t *as, uintptr_t vaddr, size_t length,
+                   int prot, int flags, uint64_t offset, uintptr_t *out);
+
+vnode_ops_t hugetlbfs_node_ops = {
+    .lookup  = lookup,
+    .create  = create,
+    .remove  = remove,
+    .readdir = readdir,
+    .ioctl   = ioctl,
+    .mmap    = mmap
+};
+
+// Filesystem Operations
+
+static vnode_t *hugetlbfs_get_root(vfs_t *self)
+{
+    return (vnode_t *)self->private_data;
+}
+
+// Node Operations
+
+static int lookup(vnode_t *self, const char *name, vnode_t **out)
+{
+    hugetlbfs_node_t *dir = (hugetlbfs_node_t *)self;
+
+    if (self->type != VDIR)
+        return ENOTDIR;
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        *out = self;
+        return EOK;
+    }
+
+    FOREACH(n, dir->children)
+    {
+        hugetlbfs_node_t *child = LIST_GET_CONTAINER(n, hugetlbfs_node_t, list_node);
+        if (strcmp(child->vn.name, name) == 0)
+        {
+            *out = &child->vn;
+            return EOK;
+        }
+    }
+
+    *out = NULL;
+    return ENOENT;
+}
+
+static int create(vnode_t *self, const char *name, vnode_type_t t, vnode_t **out)
+{
+    hugetlbfs_node_t *dir = (hugetlbfs_node_t *)self;
+
+    if (self->type != VDIR)
+        return ENOTDIR;
+    if (t != VREG)
+        return ENOTSUP;
+
+    uint64_t now = arch_clock_get_unix_time();
+
+    hugetlbfs_node_t *child = heap_alloc(sizeof(hugetlbfs_node_t));
+    if (!child)
+        return ENOMEM;
+    *child = (hugetlbfs_node_t) {
+        .vn = (vnode_t) {
+            .name = strdup(name),
+            .type = VREG,
+            .perm = 0,
+            .ctime = now,
+            .mtime = now,
+            .atime = now,
+            .size = 0,
+            .pages = XARRAY_INIT,
+            .ops = &hugetlbfs_node_ops,
+            .inode = child,
+            .refcount = 1,
+            .slock = SPINLOCK_INIT
+        },
+        .page_size = dir->page_size,
+        .children = LIST_INIT,
+        .object = NULL,
+        .list_node = LIST_NODE_INIT
+    };
+
+    spinlock_acquire(&self->slock);
+    list_append(&dir->children, &child->list_node);
+    spinlock_release(&self->slock);
+
+    *out = &child->vn;
+    return EOK;
+}
+
+static int remove(vnode_t *self, const char *name)
+{
+    hugetlbfs_node_t *dir = (hugetlbfs_node_t *)self;
+
+    spinlock_acquire(&self->slock);
+
+    FOREACH(n, dir->children)
+    {
+        hugetlbfs_node_t *child = LIST_GET_CONTAINER(n, hugetlbfs_node_t, list_node);
+        if (strcmp(child->vn.name, name) == 0)
+        {
+            list_remove(&dir->children, &child->list_node);
+            spinlock_release(&self->slock);
+
+            // Existing mappings keep their own reference to the pages.
+            if (child->object)
+                vm_object_unref(child->object);
+            heap_free(child->vn.name);
+            heap_free(child);
+            return EOK;
+        }
+    }
+
+    spinlock_release(&self->slock);
+    return ENOENT;
+}
+
+static int readdir(vnode_t *self, vfs_dirent_t **out_entries, size_t *out_count)
+{
+    if (!out_entries || !out_count)
+        return EINVAL;
+    if (self->type != VDIR)
+        return ENOTDIR;
+
+    hugetlbfs_node_t *dir = (hugetlbfs_node_t *)self;
+
+    spinlock_acquire(&self->slock);
+
+    size_t entry_count = dir->children.length;
+    vfs_dirent_t *entries = NULL;
+    if (entry_count)
+    {
+        entries = heap_alloc(entry_count * sizeof(vfs_dirent_t));
+        if (!entries)
+        {
+            spinlock_release(&self->slock);
+            return ENOMEM;
+        }
+
+        size_t index = 0;
+        FOREACH(n, dir->children)
+        {
+            hugetlbfs_node_t *child = LIST_GET_CONTAINER(n, hugetlbfs_node_t, list_node);
+            strcpy(entries[index].name, child->vn.name);
+            entries[index].type = child->vn.type;
+            index++;
+        }
+    }
+
+    spinlock_release(&self->slock);
+
+    self->atime = arch_clock_get_unix_time();
+    *out_entries = entries;
+    *out_count = entry_count;
+    return EOK;
+}
+
+static int ioctl(vnode_t *self, uint64_t cmd, void *args)
+{
+    hugetlbfs_node_t *node = (hugetlbfs_node_t *)self;
+
+    switch (cmd)
+    {
+        case HUGETLBFS_IOCTL_GET_STATS:
+        {
+            hugetlb_stats_t stats[2];
+            size_t count = hugetlb_get_stats(stats, 2);
+            for (size_t i = 0; i < count; i++)
+                if (stats[i].page_size == node->page_size)
+                {
+                    *(hugetlb_stats_t *)args = stats[i];
+                    return EOK;
+                }
+            return ENODEV;
+        }
+        default:
+            return ENOTSUP;
+    }
+}
+
+static int mmap(vnode_t *self, vm_addrspace_t *as, uintptr_t vaddr, size_t length,
+                int prot, int flags, uint64_t offset, uintptr_t *out)
+{
+    hugetlbfs_node_t *node = (hugetlbfs_node_t *)self;
+
+    if (self->type != VREG)
+        return ENODEV;
+    // Huge pages are never copied on write, so a private mapping would write through to the file.
+    if (!(flags & VM_MAP_SHARED) || offset % node->page_size)
+        return EINVAL;
+
+    // Mapping past the end of the file grows it.
+    size_t end = offset + CEIL(length, node->page_size);
+
+    spinlock_acquire(&self->slock);
+
+    if (!node->object)
+        node->object = vm_hugetlb_object_create(node->page_size, end);
+    if (!node->object || !vm_hugetlb_object_grow(node->object, end))
+    {
+        spinlock_release(&self->slock);
+        return ENOMEM;
+    }
+    if (end > self->size)
+        self->size = end;
+
+    spinlock_release(&self->slock);
+
+    flags &= ~(VM_MAP_ANON | VM_MAP_HUGE_1GB);
+    flags |= VM_MAP_HUGETLB;
+    if (node->page_size == ARCH_PAGE_SIZE_1G)
+        flags |= VM_MAP_HUGE_1GB;
+
+    return vm_map(as, vaddr, length, prot, flags, node->object, offset / ARCH_PAGE_GRAN, out);
+}
+
+//
+
+vfs_t *hugetlbfs_create(size_t page_size)
+{
+    if (!hugetlb_get_pool(page_size))
+        return NULL;
+
+    uint64_t now = arch_clock_get_unix_time();
+
+    hugetlbfs_node_t *root = heap_alloc(sizeof(hugetlbfs_node_t));
+    *root = (hugetlbfs_node_t) {
+        .vn = {
+            .name = strdup("/"),
+            .type = VDIR,
+            .ctime = now,
+            .mtime = now,
+            .atime = now,
+            .size = 0,
+            .pages = XARRAY_INIT,
+            .ops = &hugetlbfs_node_ops,
+            .inode = root,
+            .refcount = 1,
+            .slock = SPINLOCK_INIT
+        },
+        .page_size = page_size,
+        .children = LIST_INIT,
+        .object = NULL,
+        .list_node = LIST_NODE_INIT
+    };
+
+    vfs_t *vfs = heap_alloc(sizeof(vfs_t));
+    *vfs = (vfs_t) {
+        .name = strdup("hugetlbfs"),
+        .vfs_ops = &hugetlbfs_ops,
+        .covered_vn = NULL,
+        .flags = 0,
+        .block_size = page_size,
+        .private_data = root
+    };
+
+    return vfs;
+}
+
+/*
+ * Initialization
+ */
+
+void hugetlbfs_init()
+{
+    if (mount("/dev/hugepages", hugetlbfs_create(ARCH_PAGE_SIZE_2M), 0) != EOK)
+        panic("Could not mount /dev/hugepages !");
+    if (mount("/dev/hugepages-1G", hugetlbfs_create(ARCH_PAGE_SIZE_1G), 0) != EOK)
+        panic("Could not mount /dev/hugepages-1G !");
+
+    log(LOG_INFO, "HugeTLBFS mounted at /dev/hugepages and /dev/hugepages-1G");
+}
@@ -5,6 +5,8 @@
 #include "fs/path.h"
 #include "mm/heap.h"
 #include "mm/mm.h"
+#include "sync/rcu.h"
+#include "sync/spinlock.h"
 #include "uapi/errno.h"
 #include "utils/string.h"
 
@@ -24,9 +26,13 @@ trie_node_t;
 
 /*
  * Global data
+ *
+ * The trie is walked locklessly. Nodes and mounts are only ever added, each
+ * published once it's set up.
  */
 
 static trie_node_t trie_root;
+static spinlock_t slock = SPINLOCK_INIT; // Serializes changes to the trie.
 
 /*
  * Helpers
@@ -34,7 +40,8 @@ static trie_node_t trie_root;
 
 static trie_node_t *find_child(trie_node_t *parent, size_t hash, const char *comp, size_t len)
 {
-    for (size_t i = 0; i < parent->children_cnt; i++)
+    size_t count = __atomic_load_n(&parent->children_cnt, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < count; i++)
     {
         trie_node_t *child = parent->children[i];
 
@@ -56,6 +63,9 @@ int mount(const char *path, vfs_t *vfs, unsigned flags)
     trie_node_t *current = &trie_root;
     char component[PATH_MAX];
     size_t len;
+    int err = EOK;
+
+    spinlock_acquire(&slock);
 
     while (*path)
     {
@@ -73,7 +83,10 @@ int mount(const char *path, vfs_t *vfs, unsigned flags)
 
             next = heap_alloc(sizeof(trie_node_t));
             if (!next)
-                return ENOMEM;
+            {
+                err = ENOMEM;
+                goto cleanup;
+            }
             *next = (trie_node_t) {
                 .hash = hash,
                 .len = len
@@ -85,32 +98,44 @@ int mount(const char *path, vfs_t *vfs, unsigned flags)
             comp_name[len] = '\0';
             next->comp = comp_name;
 
-            current->children[current->children_cnt++] = next;
+            // Readers only look at as many children as the count says.
+            current->children[current->children_cnt] = next;
+            __atomic_store_n(&current->children_cnt, current->children_cnt + 1, __ATOMIC_RELEASE);
         }
         current = next;
     }
 
     // Check if something is already mounted.
     if (current->vfsmount)
-        return EBUSY;
+    {
+        err = EBUSY;
+        goto cleanup;
+    }
 
     vfsmount_t *mnt = heap_alloc(sizeof(vfsmount_t));
     if (!mnt)
-        return ENOMEM;
+    {
+        err = ENOMEM;
+        goto cleanup;
+    }
     *mnt = (vfsmount_t) {
         .vfs = vfs,
         .mountpoint = NULL,
         .flags = flags,
     };
-    current->vfsmount = mnt;
+    RCU_ASSIGN(current->vfsmount, mnt);
 
-    return EOK;
+cleanup:
+    spinlock_release(&slock);
+    return err;
 }
 
 vfsmount_t *find_mount(const char *path, const char **rest)
 {
+    rcu_read_lock();
+
     trie_node_t *current = &trie_root;
-    vfsmount_t *last_match = trie_root.vfsmount;
+    vfsmount_t *last_match = RCU_DEREFERENCE(trie_root.vfsmount);
 
     const char *last_rest = (*path == '/') ? path + 1 : path;
 
@@ -133,16 +158,20 @@ vfsmount_t *find_mount(const char *path, const char **rest)
             break;
 
         current = next;
-        if (current->vfsmount)
+        vfsmount_t *mnt = RCU_DEREFERENCE(current->vfsmount);
+        if (mnt)
         {
-            last_match = current->vfsmount;
+            last_match = mnt;
             last_rest = (*path == '/') ? path + 1 : path;
         }
     }
 
+    rcu_read_unlock();
+
     if (rest)
         *rest = last_rest;
 
+    // Mounts are never freed, so it stays valid past the read section.
     return last_match;
 }
 
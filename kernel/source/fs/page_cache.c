@@ -0,0 +1,217 @@
+#include "fs/page_cache.h"
+
+#include "arch/types.h"
+#include "hhdm.h"
+#include "log.h"
+#include "mm/shrinker.h"
+#include "uapi/errno.h"
+#include "utils/list.h"
+#include "utils/math.h"
+
+static list_t active = LIST_INIT;
+static list_t inactive = LIST_INIT;
+static size_t active_count;
+static size_t inactive_count;
+static spinlock_t slock = SPINLOCK_INIT;
+
+// LRU lists
+
+static void lru_add(page_t *page, bool is_active)
+{
+    page->active = is_active;
+    if (is_active)
+    {
+        list_prepend(&active, &page->list_elem);
+        active_count++;
+    }
+    else
+    {
+        list_prepend(&inactive, &page->list_elem);
+        inactive_count++;
+    }
+}
+
+static void lru_del(page_t *page)
+{
+    if (page->active)
+    {
+        list_remove(&active, &page->list_elem);
+        active_count--;
+    }
+    else
+    {
+        list_remove(&inactive, &page->list_elem);
+        inactive_count--;
+    }
+}
+
+void page_cache_add(vnode_t *vn, uint64_t index, page_t *page)
+{
+    page->vnode = vn;
+    page->index = index;
+    page->referenced = false;
+    page->pins = 0;
+
+    spinlock_acquire(&slock);
+    lru_add(page, false);
+    spinlock_release(&slock);
+}
+
+void page_cache_pin(page_t *page)
+{
+    atomic_fetch_add_explicit(&page->pins, 1, memory_order_relaxed);
+}
+
+void page_cache_unpin(page_t *page)
+{
+    atomic_fetch_sub_explicit(&page->pins, 1, memory_order_release);
+}
+
+void page_cache_mark_accessed(page_t *page)
+{
+    spinlock_acquire(&slock);
+
+    // The first access only marks the page, the second one activates it.
+    if (!page->active && page->referenced)
+    {
+        lru_del(page);
+        lru_add(page, true);
+        page->referenced = false;
+    }
+    else
+        page->referenced = true;
+
+    spinlock_release(&slock);
+}
+
+/**
+ * Moves pages from the tail of the active list to the inactive one until the
+ * inactive list is at least as long. Referenced pages get another round.
+ */
+static void balance()
+{
+    size_t budget = active_count;
+
+    while (inactive_count < active_count && budget--)
+    {
+        page_t *page = LIST_GET_CONTAINER(LIST_LAST(&active), page_t, list_elem);
+        lru_del(page);
+
+        if (page->referenced)
+        {
+            page->referenced = false;
+            lru_add(page, true);
+        }
+        else
+            lru_add(page, false);
+    }
+}
+
+// Eviction
+
+static bool writeback(vnode_t *vn, page_t *page)
+{
+    uint64_t offset = page->index * ARCH_PAGE_GRAN;
+    if (offset >= vn->size)
+        return true;
+
+    uint64_t count = MIN(ARCH_PAGE_GRAN, vn->size - offset);
+    uint64_t written;
+    return vn->ops->write(vn, (void *)(page->addr + HHDM), offset, count, &written) == EOK
+        && written == count;
+}
+
+static size_t shrink(size_t target, bool direct)
+{
+    size_t freed = 0;
+
+    spinlock_acquire(&slock);
+    size_t budget = active_count + inactive_count;
+
+    while (freed < target && budget--)
+    {
+        balance();
+
+        if (list_is_empty(&inactive))
+            break;
+        page_t *page = LIST_GET_CONTAINER(LIST_LAST(&inactive), page_t, list_elem);
+        lru_del(page);
+
+        // Accessed again while inactive.
+        if (page->referenced)
+        {
+            page->referenced = false;
+            lru_add(page, true);
+            continue;
+        }
+
+        vnode_t *vn = page->vnode;
+        if (!spinlock_try_acquire(&vn->pages_slock))
+        {
+            lru_add(page, false);
+            continue;
+        }
+
+        // In use, or to be written back first and evicted once it's clean.
+        bool pinned = atomic_load_explicit(&page->pins, memory_order_acquire) != 0;
+        bool dirty = xa_get_mark(&vn->pages, page->index, XA_MARK_0);
+        if (pinned || dirty)
+        {
+            lru_add(page, false);
+            if (pinned)
+            {
+                spinlock_release(&vn->pages_slock);
+                continue;
+            }
+
+            // Cleared up front, so that a write landing during writeback marks it dirty again.
+            xa_clear_mark(&vn->pages, page->index, XA_MARK_0);
+            page_cache_pin(page);
+            spinlock_release(&vn->pages_slock);
+            spinlock_release(&slock);
+
+            bool ok = writeback(vn, page);
+
+            spinlock_acquire(&vn->pages_slock);
+            if (!ok)
+                xa_set_mark(&vn->pages, page->index, XA_MARK_0);
+            page_cache_unpin(page);
+            spinlock_release(&vn->pages_slock);
+
+            spinlock_acquire(&slock);
+            continue;
+        }
+
+        // Off the lists, unpinned and its vnode locked, nobody else can reach the page now.
+        spinlock_release(&slock);
+
+        xa_remove(&vn->pages, page->index);
+        spinlock_release(&vn->pages_slock);
+
+        page->vnode = NULL;
+        pm_free(page);
+        freed++;
+
+        spinlock_acquire(&slock);
+    }
+
+    spinlock_release(&slock);
+
+    if (freed && !direct)
+        log(LOG_DEBUG, "Evicted %lu page cache pages, %lu active and %lu inactive left.",
+            freed, active_count, inactive_count);
+
+    return freed;
+}
+
+static shrinker_t shrinker = {
+    .name = "page cache",
+    .scan = shrink
+};
+
+// Initialization
+
+void page_cache_init()
+{
+    shrinker_register(&shrinker);
+}
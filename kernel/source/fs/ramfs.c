@@ -99,7 +99,10 @@ static int write(vnode_t *self, const void *buf, uint64_t offset, uint64_t count
         void *page = xa_get(&node->pages, page_idx);
         if (!page)
         {
-            page = (void*)(pm_alloc(0)->addr + HHDM);
+            page_t *new_page = pm_alloc(0);
+            if (!new_page)
+                break;
+            page = (void*)(new_page->addr + HHDM);
             xa_insert(&node->pages, page_idx, page);
         }
 
@@ -131,16 +134,21 @@ static int lookup(vnode_t *self, const char *name, vnode_t **out)
         *out = current->parent ? &current->parent->vn : self;
         return EOK;
     }
+
+    rwsem_acquire_read(&current->children_sem);
+
     FOREACH(n, current->children)
     {
         ramfs_node_t *child = LIST_GET_CONTAINER(n, ramfs_node_t, list_node);
         if (strcmp(child->vn.name, name) == 0)
         {
+            rwsem_release_read(&current->children_sem);
             *out = &child->vn;
             return EOK;
         }
     }
 
+    rwsem_release_read(&current->children_sem);
     *out = NULL;
     return ENOENT;
 }
@@ -166,12 +174,15 @@ static int create(vnode_t *self, const char *name, vnode_type_t t, vnode_t **out
         },
         .parent = current,
         .children = LIST_INIT,
+        .children_sem = RWSEM_INIT,
         .pages = XARRAY_INIT,
         .page_count = 0,
         .list_node = LIST_NODE_INIT,
     };
 
+    rwsem_acquire_write(&current->children_sem);
     list_append(&current->children, &child->list_node);
+    rwsem_release_write(&current->children_sem);
 
     *out = &child->vn;
     return EOK;
@@ -181,12 +192,16 @@ static int remove(vnode_t *self, const char *name)
 {
     ramfs_node_t *current = (ramfs_node_t *)self;
 
+    rwsem_acquire_write(&current->children_sem);
+
     FOREACH(n, current->children)
     {
         ramfs_node_t *child = LIST_GET_CONTAINER(n, ramfs_node_t, list_node);
         if (strcmp(child->vn.name, name) == 0)
         {
             list_remove(&current->children, &child->list_node);
+            rwsem_release_write(&current->children_sem);
+
             FOREACH(c, child->children)
             {
                 ramfs_node_t *grandchild = LIST_GET_CONTAINER(c, ramfs_node_t, list_node);
@@ -198,6 +213,7 @@ static int remove(vnode_t *self, const char *name)
         }
     }
 
+    rwsem_release_write(&current->children_sem);
     return ENOENT;
 }
 
@@ -209,10 +225,13 @@ static int readdir(vnode_t *self, vfs_dirent_t **out_entries, size_t *out_count)
         return ENOTDIR;
 
     ramfs_node_t *dir = (ramfs_node_t *)self;
+
+    rwsem_acquire_read(&dir->children_sem);
     size_t entry_count = dir->children.length;
 
     if (!entry_count)
     {
+        rwsem_release_read(&dir->children_sem);
         *out_entries = NULL;
         *out_count = 0;
         self->atime = arch_clock_get_unix_time();
@@ -230,6 +249,8 @@ static int readdir(vnode_t *self, vfs_dirent_t **out_entries, size_t *out_count)
         index++;
     }
 
+    rwsem_release_read(&dir->children_sem);
+
     self->atime = arch_clock_get_unix_time();
     *out_entries = entries;
     *out_count = entry_count;
@@ -262,6 +283,7 @@ vfs_t *ramfs_create()
         },
         .parent = ramfs_root,
         .children = LIST_INIT,
+        .children_sem = RWSEM_INIT,
         .pages = XARRAY_INIT,
         .page_count = 0,
         .list_node = LIST_NODE_INIT,
@@ -3,12 +3,14 @@
 #include "arch/types.h"
 #include "assert.h"
 #include "fs/mount.h"
+#include "fs/page_cache.h"
 #include "fs/path.h"
 #include "fs/ramfs.h"
 #include "hhdm.h"
 #include "log.h"
 #include "mm/mm.h"
 #include "mm/pm.h"
+#include "mm/vm/vm_swap.h"
 #include "uapi/errno.h"
 #include "utils/list.h"
 #include "utils/math.h"
@@ -31,22 +33,32 @@ void vnode_drop(vnode_t *vn)
  * Veneer layer.
  */
 
+/**
+ * Looks up a page of the page cache, or fills in a new one, and returns it
+ * pinned. Filling a page reads it from the filesystem with no lock held.
+ */
 static int get_page(vnode_t *vn, uint64_t pg_idx, bool read, page_t **out)
 {
+    spinlock_acquire(&vn->pages_slock);
     page_t *page = xa_get(&vn->pages, pg_idx);
+    if (page)
+        page_cache_pin(page);
+    spinlock_release(&vn->pages_slock);
+
     if (page)
     {
         *out = page;
         return EOK;
     }
 
-    page = pm_alloc(0);
+    // Evicts cached pages as needed, so a large file can't fill up memory.
+    page = vm_swap_alloc_page();
     if (!page)
         return ENOMEM;
 
+    uint64_t read_bytes = 0;
     if (read)
     {
-        uint64_t read_bytes;
         int err = vn->ops->read(
             vn,
             (void *)(page->addr + HHDM),
@@ -61,7 +73,34 @@ static int get_page(vnode_t *vn, uint64_t pg_idx, bool read, page_t **out)
         }
     }
 
-    xa_insert(&vn->pages, pg_idx, page);
+    // Past the end of the file.
+    memset((uint8_t *)page->addr + HHDM + read_bytes, 0, ARCH_PAGE_GRAN - read_bytes);
+
+    spinlock_acquire(&vn->pages_slock);
+
+    // Filled in by someone else meanwhile.
+    page_t *cached = xa_get(&vn->pages, pg_idx);
+    if (cached)
+    {
+        page_cache_pin(cached);
+        spinlock_release(&vn->pages_slock);
+
+        pm_free(page);
+        *out = cached;
+        return EOK;
+    }
+
+    if (!xa_insert(&vn->pages, pg_idx, page))
+    {
+        spinlock_release(&vn->pages_slock);
+        pm_free(page);
+        return ENOMEM;
+    }
+    page_cache_add(vn, pg_idx, page);
+    page_cache_pin(page);
+
+    spinlock_release(&vn->pages_slock);
+
     *out = page;
     return EOK;
 }
@@ -82,6 +121,7 @@ int vfs_read(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
         uint64_t pg_off  = pos % ARCH_PAGE_GRAN;
         uint64_t to_copy = MIN(ARCH_PAGE_GRAN - pg_off, count - total_read);
 
+        // Pinned rather than locked, as copying to the buffer may fault.
         page_t *page;
         int err = get_page(vn, pg_idx, true, &page);
         if (err != EOK)
@@ -93,6 +133,12 @@ int vfs_read(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
             to_copy
         );
 
+        // A read starting part way into a page most likely continues the
+        // previous one, so it doesn't count as another access.
+        if (pg_off == 0)
+            page_cache_mark_accessed(page);
+
+        page_cache_unpin(page);
         total_read += to_copy;
     }
 
@@ -117,12 +163,17 @@ int vfs_write(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
         uint64_t pg_off  = pos % ARCH_PAGE_GRAN;
         uint64_t to_copy = MIN(ARCH_PAGE_GRAN - pg_off, count - total_written);
 
+        /*
+         * Read-modify-write only if needed. A page past the end of the file is
+         * all zeroes, so there's nothing to read, and one about to be
+         * overwritten whole is still read if it has data, as it's visible to
+         * readers before the copy is done.
+         */
         page_t *page;
         int err = get_page(
             vn,
             pg_idx,
-            // read-modify-write only if needed
-            (pg_off == 0 && to_copy == ARCH_PAGE_GRAN) ? true : false,
+            (pg_off == 0 && to_copy == ARCH_PAGE_GRAN) ? pos < vn->size : true,
             &page
         );
         if (err != EOK)
@@ -134,10 +185,18 @@ int vfs_write(vnode_t *vn, void *buffer, uint64_t offset, uint64_t count,
             to_copy
         );
 
+        spinlock_acquire(&vn->pages_slock);
         xa_set_mark(&vn->pages, pg_idx, XA_MARK_0); // Mark dirty.
+        spinlock_release(&vn->pages_slock);
+
+        if (pg_off == 0)
+            page_cache_mark_accessed(page);
+
+        page_cache_unpin(page);
         total_written += to_copy;
     }
 
+    // Written back on eviction, which only writes up to the end of the file.
     if (offset + total_written > vn->size)
         vn->size = offset + total_written;
     if (out_bytes_written)
@@ -222,14 +281,14 @@ int vfs_ioctl(vnode_t *vn, uint64_t cmd, void *args)
 }
 
 int vfs_mmap(vnode_t *vn, vm_addrspace_t *as, uintptr_t vaddr, size_t length,
-             int prot, int flags, uint64_t offset)
+             int prot, int flags, uint64_t offset, uintptr_t *out)
 {
-    ASSERT(vn && as);
+    ASSERT(vn && as && out);
 
     if (!vn->ops || !vn->ops->mmap)
         return ENOTSUP;
 
-    return vn->ops->mmap(vn, as, vaddr, length, prot, flags, offset);
+    return vn->ops->mmap(vn, as, vaddr, length, prot, flags, offset, out);
 }
 
 /*
@@ -243,6 +302,7 @@ void vfs_init()
         panic("Failed to crate root ramfs!");
 
     mount_init(ramfs);
+    page_cache_init();
 
     log(LOG_INFO, "VFS initialized.");
 }
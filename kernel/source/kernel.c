@@ -1,12 +1,19 @@
 #include "bootreq.h"
 #include "dev/virtual.h"
 #include "fs/devfs.h"
+#include "fs/hugetlbfs.h"
 #include "fs/ustar.h"
 #include "fs/vfs.h"
 #include "log.h"
+#include "mm/hugetlb.h"
+#include "mm/vm/vm_ksm.h"
+#include "mm/vm/vm_swap.h"
+#include "mm/vm/vm_thp.h"
+#include "mm/vm/vm_wss.h"
 #include "mod/ksym.h"
 #include "mod/module.h"
 #include "panic.h"
+#include "sync/rcu.h"
 #include "sys/elf.h"
 #include "sys/proc.h"
 #include "sys/sched.h"
@@ -82,15 +89,25 @@ static void load_init_proc()
 
 void kernel_main()
 {
+    hugetlb_init();
+
     vfs_init();
 
     devfs_init();
+    hugetlbfs_init();
     virtual_devices_init();
 
     load_initrd();
     load_boot_modules();
     load_init_proc();
 
+    rcu_init();
+    vm_thp_init();
+    vm_swap_init();
+    vm_ksm_init();
+    vm_wss_init();
+    vm_teardown_init();
+
     // Start other CPU cores and scheduler
 
     smp_init();
@@ -0,0 +1,146 @@
+#include "mm/hugetlb.h"
+
+#include "arch/types.h"
+#include "assert.h"
+#include "log.h"
+#include "mm/mm.h"
+
+#ifndef HUGETLB_POOL_PAGES_2M
+#define HUGETLB_POOL_PAGES_2M 16
+#endif
+
+#ifndef HUGETLB_POOL_PAGES_1G
+#define HUGETLB_POOL_PAGES_1G 0
+#endif
+
+static hugetlb_pool_t pools[] = {
+    {
+        .page_size = ARCH_PAGE_SIZE_2M,
+        .order = 9,
+        .free_pages = LIST_INIT,
+        .slock = SPINLOCK_INIT
+    },
+    {
+        .page_size = ARCH_PAGE_SIZE_1G,
+        .order = 18,
+        .free_pages = LIST_INIT,
+        .slock = SPINLOCK_INIT
+    }
+};
+
+#define POOL_COUNT (sizeof(pools) / sizeof(hugetlb_pool_t))
+
+hugetlb_pool_t *hugetlb_get_pool(size_t page_size)
+{
+    for (size_t i = 0; i < POOL_COUNT; i++)
+        if (pools[i].page_size == page_size)
+            return &pools[i];
+
+    return NULL;
+}
+
+bool hugetlb_reserve(hugetlb_pool_t *pool, size_t count)
+{
+    spinlock_acquire(&pool->slock);
+
+    bool ret = pool->free - pool->reserved >= count;
+    if (ret)
+        pool->reserved += count;
+
+    spinlock_release(&pool->slock);
+    return ret;
+}
+
+void hugetlb_unreserve(hugetlb_pool_t *pool, size_t count)
+{
+    spinlock_acquire(&pool->slock);
+
+    ASSERT(pool->reserved >= count);
+    pool->reserved -= count;
+
+    spinlock_release(&pool->slock);
+}
+
+page_t *hugetlb_alloc(hugetlb_pool_t *pool)
+{
+    spinlock_acquire(&pool->slock);
+
+    ASSERT(pool->reserved > 0 && pool->free > 0);
+    page_t *page = LIST_GET_CONTAINER(list_pop_head(&pool->free_pages), page_t, list_elem);
+    pool->reserved--;
+    pool->free--;
+
+    spinlock_release(&pool->slock);
+    return page;
+}
+
+void hugetlb_free(hugetlb_pool_t *pool, page_t *page)
+{
+    spinlock_acquire(&pool->slock);
+
+    list_append(&pool->free_pages, &page->list_elem);
+    pool->free++;
+
+    spinlock_release(&pool->slock);
+}
+
+void hugetlb_free_reserved(hugetlb_pool_t *pool, page_t *page)
+{
+    spinlock_acquire(&pool->slock);
+
+    list_append(&pool->free_pages, &page->list_elem);
+    pool->free++;
+    pool->reserved++;
+
+    spinlock_release(&pool->slock);
+}
+
+// Counters
+
+size_t hugetlb_get_stats(hugetlb_stats_t *out, size_t max)
+{
+    size_t i;
+    for (i = 0; i < POOL_COUNT && i < max; i++)
+    {
+        spinlock_acquire(&pools[i].slock);
+        out[i] = (hugetlb_stats_t) {
+            .page_size = pools[i].page_size,
+            .total = pools[i].total,
+            .free = pools[i].free,
+            .reserved = pools[i].reserved
+        };
+        spinlock_release(&pools[i].slock);
+    }
+
+    return i;
+}
+
+// Initialization
+
+static void fill_pool(hugetlb_pool_t *pool, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        page_t *page = pm_alloc(pool->order);
+        if (!page)
+        {
+            log(LOG_WARN, "Only %lu of %lu %lu KiB huge pages could be reserved.",
+                i, count, pool->page_size / KIB);
+            break;
+        }
+
+        list_append(&pool->free_pages, &page->list_elem);
+        pool->total++;
+        pool->free++;
+    }
+}
+
+void hugetlb_init()
+{
+    // Reserve the largest pages first, before memory gets fragmented.
+    fill_pool(hugetlb_get_pool(ARCH_PAGE_SIZE_1G), HUGETLB_POOL_PAGES_1G);
+    fill_pool(hugetlb_get_pool(ARCH_PAGE_SIZE_2M), HUGETLB_POOL_PAGES_2M);
+
+    for (size_t i = 0; i < POOL_COUNT; i++)
+        log(LOG_INFO, "Huge page pool: %lu x %lu KiB.", pools[i].total, pools[i].page_size / KIB);
+}
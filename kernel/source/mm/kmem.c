@@ -1,11 +1,10 @@
 #include "mm/kmem.h"
 
+#include "arch/lcpu.h"
 #include "arch/types.h"
 #include "hhdm.h"
 #include "mm/pm.h"
-#include "sys/smp.h"
-#include "sys/thread.h"
-#include "sys/sched.h"
+#include "sys/percpu.h"
 #include "utils/list.h"
 
 static kmem_slab_t *cache_make_slab(kmem_cache_t *cache)
@@ -61,11 +60,14 @@ static kmem_magazine_t *cache_make_magazine(kmem_cache_t *cache, bool populate)
     return mag;
 }
 
-void *kmem_alloc_cache(kmem_cache_t *cache)
-{
-    size_t cpu_id = sched_get_curr_thread()->assigned_cpu->id;
-    kmem_cpu_cache_t *cpu_cache = &cache->cpu_cache[cpu_id];
+/*
+ * The CPU caches are only touched with interrupts masked, so that the thread
+ * can neither be preempted by one touching the same cache nor moved to another
+ * CPU halfway through.
+ */
 
+static void *cpu_cache_alloc(kmem_cache_t *cache, kmem_cpu_cache_t *cpu_cache)
+{
     kmem_magazine_t *mag = cpu_cache->loaded;
     if (mag->count > 0)
         return mag->objects[--mag->count];
@@ -98,11 +100,8 @@ void *kmem_alloc_cache(kmem_cache_t *cache)
     return obj;
 }
 
-void kmem_free_cache(kmem_cache_t *cache, void *obj)
+static void cpu_cache_free(kmem_cache_t *cache, kmem_cpu_cache_t *cpu_cache, void *obj)
 {
-    size_t cpu_id = sched_get_curr_thread()->assigned_cpu->id;
-    kmem_cpu_cache_t *cpu_cache = &cache->cpu_cache[cpu_id];
-
     kmem_magazine_t *mag = cpu_cache->loaded;
     if (mag->count < MAG_SIZE)
     {
@@ -134,6 +133,29 @@ void kmem_free_cache(kmem_cache_t *cache, void *obj)
     new_mag->objects[new_mag->count++] = obj;
 }
 
+void *kmem_alloc_cache(kmem_cache_t *cache)
+{
+    bool int_state = arch_lcpu_int_enabled();
+    arch_lcpu_int_mask();
+
+    void *obj = cpu_cache_alloc(cache, percpu_this_ptr(cache->cpu_cache));
+
+    if (int_state)
+        arch_lcpu_int_unmask();
+    return obj;
+}
+
+void kmem_free_cache(kmem_cache_t *cache, void *obj)
+{
+    bool int_state = arch_lcpu_int_enabled();
+    arch_lcpu_int_mask();
+
+    cpu_cache_free(cache, percpu_this_ptr(cache->cpu_cache), obj);
+
+    if (int_state)
+        arch_lcpu_int_unmask();
+}
+
 kmem_cache_t *kmem_new_cache(const char *name, size_t size)
 {
     kmem_cache_t *cache = (kmem_cache_t *)(pm_alloc(0)->addr + HHDM);
@@ -146,12 +168,13 @@ kmem_cache_t *kmem_new_cache(const char *name, size_t size)
         .slabs_lock = SPINLOCK_INIT,
         .magazines_full = LIST_INIT,
         .magazines_empty = LIST_INIT,
-        .magazines_lock = SPINLOCK_INIT
+        .magazines_lock = SPINLOCK_INIT,
+        .cpu_cache = percpu_alloc(sizeof(kmem_cpu_cache_t))
     };
 
-    for (int i = 0; i < MAX_CPUS; i++)
+    for (size_t i = 0; i < percpu_cpu_count; i++)
     {
-        cache->cpu_cache[i] = (kmem_cpu_cache_t) {
+        *(kmem_cpu_cache_t *)percpu_ptr(cache->cpu_cache, i) = (kmem_cpu_cache_t) {
             .loaded = cache_make_magazine(cache, true),
             .previous = cache_make_magazine(cache, false)
         };
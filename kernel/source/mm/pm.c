@@ -12,8 +12,13 @@
 static page_t *blocks;
 static size_t block_count;
 static list_t levels[PM_MAX_PAGE_ORDER + 1];
+static size_t free_pages;
+static size_t total_pages;
 static spinlock_t slock = SPINLOCK_INIT;
 
+static size_t low_watermark;
+static void (*low_watermark_fn)();
+
 uint8_t pm_pagecount_to_order(size_t pages)
 {
     if (pages == 1)
@@ -40,11 +45,16 @@ page_t *pm_alloc(uint8_t order)
     {
         i++;
         if (i > PM_MAX_PAGE_ORDER)
+        {
+            spinlock_release(&slock);
             return 0;
+        }
     }
 
     page_t *page = LIST_GET_CONTAINER(levels[i].head, page_t, list_elem);
     list_remove(&levels[i], levels[i].head);
+    free_pages -= pm_order_to_pagecount(order);
+    bool low = free_pages < low_watermark;
 
     for (; i > order; i--)
     {
@@ -58,10 +68,17 @@ page_t *pm_alloc(uint8_t order)
 
     spinlock_release(&slock);
 
+    if (low && low_watermark_fn)
+        low_watermark_fn();
+
     page->order = order;
     page->free = false;
+    page->age = 0;
+    page->wss_pass = 0;
     page->mapcount = 0;
     page->children = 1;
+    page->ksm = NULL;
+    page->checksum = 0;
     return page;
 }
 
@@ -71,6 +88,7 @@ void pm_free(page_t *block)
 
     size_t idx = block->addr / ARCH_PAGE_GRAN;
     uint8_t i = block->order;
+    free_pages += pm_order_to_pagecount(i);
 
     while (i < PM_MAX_PAGE_ORDER)
     {
@@ -101,6 +119,45 @@ void pm_free(page_t *block)
     spinlock_release(&slock);
 }
 
+void pm_split(page_t *block)
+{
+    size_t idx = block->addr / ARCH_PAGE_GRAN;
+    size_t count = pm_order_to_pagecount(block->order);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        page_t *page = &blocks[idx + i];
+        page->order = 0;
+        page->free = false;
+        page->age = 0;
+        page->wss_pass = 0;
+        page->mapcount = 0;
+        page->children = 1;
+        page->ksm = NULL;
+        page->checksum = 0;
+    }
+}
+
+// Counters
+
+size_t pm_get_free_pages()
+{
+    return __atomic_load_n(&free_pages, __ATOMIC_RELAXED);
+}
+
+size_t pm_get_total_pages()
+{
+    return total_pages;
+}
+
+void pm_set_low_watermark(size_t pages, void (*fn)())
+{
+    spinlock_acquire(&slock);
+    low_watermark = pages;
+    low_watermark_fn = fn;
+    spinlock_release(&slock);
+}
+
 // Initialization
 
 void pm_init()
@@ -184,6 +241,7 @@ void pm_init()
             blocks[idx].order = order;
             blocks[idx].free = true;
             list_append(&levels[order], &blocks[idx].list_elem);
+            free_pages += pm_order_to_pagecount(order);
 
             addr += span;
 
@@ -191,5 +249,7 @@ void pm_init()
         }
     }
 
+    total_pages = free_pages;
+
     log(LOG_INFO, "Phyiscal memory allocator initialized.");
 }
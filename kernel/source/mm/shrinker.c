@@ -0,0 +1,32 @@
+#include "mm/shrinker.h"
+
+#include "sync/spinlock.h"
+
+static list_t shrinkers = LIST_INIT;
+static spinlock_t slock = SPINLOCK_INIT;
+
+void shrinker_register(shrinker_t *shrinker)
+{
+    shrinker->list_node = LIST_NODE_INIT;
+
+    spinlock_acquire(&slock);
+    list_append(&shrinkers, &shrinker->list_node);
+    spinlock_release(&slock);
+}
+
+size_t shrinker_run(size_t target, bool direct)
+{
+    size_t freed = 0;
+
+    // Shrinkers are never unregistered, so the list can be walked unlocked.
+    FOREACH(n, shrinkers)
+    {
+        if (freed >= target)
+            break;
+
+        shrinker_t *shrinker = LIST_GET_CONTAINER(n, shrinker_t, list_node);
+        freed += shrinker->scan(target - freed, direct);
+    }
+
+    return freed;
+}
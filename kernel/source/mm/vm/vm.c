@@ -9,9 +9,18 @@
 #include "mm/heap.h"
 #include "mm/mm.h"
 #include "mm/pm.h"
+#include "mm/vm/vm_hugetlb.h"
 #include "mm/vm/vm_object.h"
+#include "mm/vm/vm_rmap.h"
+#include "mm/vm/vm_thp.h"
+#include "mm/vmem.h"
 #include "panic.h"
+#include "sync/mutex.h"
 #include "sync/spinlock.h"
+#include "sync/waitqueue.h"
+#include "sys/proc.h"
+#include "sys/sched.h"
+#include "sys/thread.h"
 #include "uapi/errno.h"
 #include "utils/container_of.h"
 #include "utils/list.h"
@@ -24,6 +33,14 @@
 
 vm_addrspace_t *vm_kernel_as;
 
+list_t vm_addrspace_list = LIST_INIT;
+spinlock_t vm_addrspace_list_slock = SPINLOCK_INIT;
+
+// Kernel virtual addresses handed out by vm_alloc().
+#define KERNEL_ARENA_SIZE (64ull * GIB)
+
+static vmem_t kernel_arena;
+
 /*
  * Segment utils
  */
@@ -45,15 +62,15 @@ static vm_segment_t *check_collision(vm_addrspace_t *as, uintptr_t base, size_t
     return NULL;
 }
 
-static bool find_space(vm_addrspace_t *as, size_t length, uintptr_t *out)
+static bool find_space(vm_addrspace_t *as, size_t length, size_t align, uintptr_t *out)
 {
     if (list_is_empty(&as->segments))
     {
-        *out = as->limit_low;
+        *out = CEIL(as->limit_low, align);
         return true;
     }
 
-    uintptr_t start = as->limit_low;
+    uintptr_t start = CEIL(as->limit_low, align);
     FOREACH(n, as->segments)
     {
         vm_segment_t *seg = LIST_GET_CONTAINER(n, vm_segment_t, list_node);
@@ -61,7 +78,7 @@ static bool find_space(vm_addrspace_t *as, size_t length, uintptr_t *out)
         if (start + length < seg->start)
             break;
         // Update start to point to the end of this segment.
-        start = seg->start + seg->length;
+        start = CEIL(seg->start + seg->length, align);
     }
 
     // Check if there is space after the last segment.
@@ -93,22 +110,97 @@ static void insert_seg(vm_addrspace_t *as, vm_segment_t *seg)
         list_prepend(&as->segments, &seg->list_node);
 }
 
-static vm_segment_t *find_seg(vm_addrspace_t *as, uintptr_t addr)
+/**
+ * Splits `seg` at `addr` and returns the upper half, which is inserted right
+ * after it, or NULL if out of memory.
+ */
+static vm_segment_t *split_seg(vm_addrspace_t *as, vm_segment_t *seg, uintptr_t addr)
 {
-    FOREACH(n, as->segments)
+    // A huge page can't straddle two segments.
+    if (addr % VM_THP_SIZE && vm_thp_split(as, addr) != EOK)
+        return NULL;
+
+    vm_segment_t *upper = heap_alloc(sizeof(vm_segment_t));
+    if (!upper)
+        return NULL;
+
+    size_t delta = addr - seg->start;
+    *upper = (vm_segment_t) {
+        .as = as,
+        .start = addr,
+        .length = seg->length - delta,
+        .prot = seg->prot,
+        .flags = seg->flags,
+        .object = seg->object,
+        .offset = seg->offset + delta / ARCH_PAGE_GRAN
+    };
+    seg->length = delta;
+
+    list_insert_after(&as->segments, &seg->list_node, &upper->list_node);
+    if (upper->object)
     {
-        vm_segment_t *seg = LIST_GET_CONTAINER(n, vm_segment_t, list_node);
+        vm_object_ref(upper->object);
+        vm_rmap_add(upper->object, upper);
+    }
 
-        if (seg->start <= addr && addr - seg->start < seg->length)
-            return seg;
+    return upper;
+}
+
+// Page fault handler
+
+#define FAULT_AROUND_PAGES 16
+
+/**
+ * Looks up a page that is already resident in `obj` or, for shadows, in one
+ * of the objects it shadows. Such pages may only be mapped read-only.
+ */
+static page_t *lookup_resident(vm_object_t *obj, size_t pgidx)
+{
+    while (obj)
+    {
+        spinlock_acquire(&obj->slock);
+        page_t *page = vm_object_lookup_page(obj, pgidx);
+        bool swapped = !page && vm_object_is_swapped(obj, pgidx);
+        spinlock_release(&obj->slock);
+
+        if (page)
+            return page;
+        // A swapped out copy hides the pages of the objects below it.
+        if (swapped || obj->type != VM_OBJ_SHADOW)
+            return NULL;
+
+        pgidx += obj->source.shadow.offset;
+        obj = obj->source.shadow.parent;
     }
 
     return NULL;
 }
 
-// Page fault handler
+/**
+ * Maps the resident pages surrounding a read fault so that touching them
+ * doesn't fault again.
+ */
+static void fault_around(vm_addrspace_t *as, vm_segment_t *seg, uintptr_t vaddr, vm_protection_t prot)
+{
+    // The window is aligned so that it never spans two last-level tables.
+    uintptr_t start = MAX(FLOOR(vaddr, FAULT_AROUND_PAGES * ARCH_PAGE_GRAN), seg->start);
+    uintptr_t end = MIN(FLOOR(vaddr, FAULT_AROUND_PAGES * ARCH_PAGE_GRAN) + FAULT_AROUND_PAGES * ARCH_PAGE_GRAN,
+                        seg->start + seg->length);
 
-bool vm_page_fault(vm_addrspace_t *as, uintptr_t virt, vm_fault_type_t type)
+    size_t count = (end - start) / ARCH_PAGE_GRAN;
+    size_t pgidx = ((start - seg->start) / ARCH_PAGE_GRAN) + seg->offset;
+
+    uintptr_t paddrs[FAULT_AROUND_PAGES];
+    for (size_t i = 0; i < count; i++)
+    {
+        page_t *page = lookup_resident(seg->object, pgidx + i);
+        paddrs[i] = page ? page->addr : 0;
+    }
+
+    arch_paging_map_batch(as->page_map, start, paddrs, count, prot & ~VM_PROTECTION_WRITE, VM_CACHE_STANDARD);
+}
+
+static bool handle_fault(vm_addrspace_t *as, uintptr_t virt, vm_fault_type_t type)
 {
     vm_segment_t *seg = check_collision(as, virt, 1);
     if (!seg)
@@ -120,6 +212,22 @@ bool vm_page_fault(vm_addrspace_t *as, uintptr_t virt, vm_fault_type_t type)
     ||  (type == VM_FAULT_INSTRUCTION_FETCH  && !(seg->prot & VM_PROTECTION_EXECUTE)))
         return false;
 
+    if (seg->flags & VM_MAP_HUGETLB)
+        return vm_hugetlb_fault(as, seg, virt, type);
+
+    /*
+     * Transparent huge pages are only ever backed by private anonymous memory, so a fault
+     * on one is a write to a page that was mapped on a read fault.
+     */
+    if (arch_paging_get_page_size(as->page_map, virt) == VM_THP_SIZE)
+    {
+        arch_paging_prot_page(as->page_map, FLOOR(virt, VM_THP_SIZE), VM_THP_SIZE, seg->prot);
+        return true;
+    }
+
+    if (vm_thp_fault(as, seg, virt, type))
+        return true;
+
     uintptr_t vaddr_aligned = FLOOR(virt, ARCH_PAGE_GRAN);
     size_t pgidx = ((vaddr_aligned - seg->start) / ARCH_PAGE_GRAN) + seg->offset;
     vm_object_t *obj = seg->object;
@@ -162,18 +270,30 @@ bool vm_page_fault(vm_addrspace_t *as, uintptr_t virt, vm_fault_type_t type)
             VM_CACHE_STANDARD
         );
 
+    if (type != VM_FAULT_WRITE)
+        fault_around(as, seg, vaddr_aligned, prot);
+
     return true;
 }
 
+bool vm_page_fault(vm_addrspace_t *as, uintptr_t virt, vm_fault_type_t type)
+{
+    spinlock_acquire(&as->slock);
+    bool ret = handle_fault(as, virt, type);
+    spinlock_release(&as->slock);
+
+    return ret;
+}
+
 // Mapping and unmapping
 
-static int resolve_vaddr(vm_addrspace_t *as, uintptr_t vaddr, uintptr_t length, int flags, uintptr_t *out)
+static int resolve_vaddr(vm_addrspace_t *as, uintptr_t vaddr, uintptr_t length, int flags, size_t align, uintptr_t *out)
 {
-    if (vaddr < as->limit_low || length > as->limit_high - vaddr)
+    if (vaddr < as->limit_low || length > as->limit_high - vaddr || vaddr % align)
     {
         if (flags & (VM_MAP_FIXED | VM_MAP_FIXED_NOREPLACE))
             return EINVAL;
-        if (!find_space(as, length, &vaddr))
+        if (!find_space(as, length, align, &vaddr))
             return ENOMEM;
     }
 
@@ -183,7 +303,7 @@ static int resolve_vaddr(vm_addrspace_t *as, uintptr_t vaddr, uintptr_t length,
             return EEXIST;
         if (flags & VM_MAP_FIXED)
             return EINVAL;
-        if (!find_space(as, length, &vaddr))
+        if (!find_space(as, length, align, &vaddr))
             return ENOMEM;
     }
 
@@ -191,29 +311,117 @@ static int resolve_vaddr(vm_addrspace_t *as, uintptr_t vaddr, uintptr_t length,
     return EOK;
 }
 
+#define POPULATE_BATCH 64
+
+/**
+ * Faults in the whole of a new segment. The layout is held still, so the
+ * segment stays put while the spinlock is only taken a batch at a time,
+ * letting interrupts in between batches.
+ */
+static void populate(vm_addrspace_t *as, vm_segment_t *seg)
+{
+    vm_fault_type_t fault_type = (seg->prot & VM_PROTECTION_WRITE) ? VM_FAULT_WRITE : VM_FAULT_READ;
+
+    if (seg->flags & VM_MAP_HUGETLB)
+    {
+        size_t align = vm_hugetlb_page_size(seg->flags);
+        for (size_t i = 0; i < seg->length; i += align)
+        {
+            spinlock_acquire(&as->slock);
+            bool ok = vm_hugetlb_fault(as, seg, seg->start + i, fault_type);
+            spinlock_release(&as->slock);
+
+            if (!ok)
+                panic("Fault handler failed!");
+        }
+        return;
+    }
+
+    // Pages are mapped in runs sharing a last-level table, walking to it once per run.
+    uintptr_t paddrs[POPULATE_BATCH];
+
+    for (size_t i = 0; i < seg->length; )
+    {
+        spinlock_acquire(&as->slock);
+
+        // Looked up again every batch, in case the segment got a new object meanwhile.
+        vm_object_t *obj = seg->object;
+        size_t count = 0;
+        uintptr_t batch_start = seg->start + i;
+
+        while (i < seg->length && count < POPULATE_BATCH)
+        {
+            uintptr_t curr_addr = seg->start + i;
+
+            if (curr_addr % VM_THP_SIZE == 0)
+            {
+                if (count)
+                    break;
+                if (vm_thp_fault(as, seg, curr_addr, fault_type))
+                {
+                    i += VM_THP_SIZE;
+                    break;
+                }
+            }
+
+            page_t *page;
+            if (!obj->ops->get_page(obj, seg->offset + i / ARCH_PAGE_GRAN, fault_type, &page))
+                panic("Fault handler failed!");
+
+            paddrs[count++] = page->addr;
+            i += ARCH_PAGE_GRAN;
+        }
+
+        if (count)
+            arch_paging_map_batch(as->page_map, batch_start, paddrs, count, seg->prot, VM_CACHE_STANDARD);
+
+        spinlock_release(&as->slock);
+    }
+}
+
 int vm_map(vm_addrspace_t *as, uintptr_t vaddr, size_t length,
            vm_protection_t prot, int flags,
            vm_object_t *obj, size_t offset,
            uintptr_t *out)
 {
+    // Hugetlb segments are made of whole huge pages.
+    size_t align = ARCH_PAGE_GRAN;
+    if (flags & VM_MAP_HUGETLB)
+    {
+        align = vm_hugetlb_page_size(flags);
+        length = CEIL(length, align);
+
+        // Huge pages are shared with the child on fork rather than copied on write, so they can't be private.
+        if (!(flags & VM_MAP_SHARED)
+        ||  (obj && obj->type != VM_OBJ_HUGETLB) || offset % (align / ARCH_PAGE_GRAN))
+            return EINVAL;
+    }
+
+    mutex_acquire(&as->map_mutex);
     spinlock_acquire(&as->slock);
 
     // Determine where the segment goes in the virtual address space.
-    int ret = resolve_vaddr(as, vaddr, length, flags, &vaddr);
+    int ret = resolve_vaddr(as, vaddr, length, flags, align, &vaddr);
     if (ret != EOK)
-    {
-        spinlock_release(&as->slock);
-        return ret;
-    }
+        goto fail;
 
     // Manage assigned object
-    if (!obj) // anon
+    if (!obj && (flags & VM_MAP_HUGETLB))
+    {
+        obj = vm_hugetlb_object_create(align, length);
+        if (!obj)
+        {
+            ret = ENOMEM;
+            goto fail;
+        }
+    }
+    else if (!obj) // anon
     {
         obj = vm_object_create(VM_OBJ_ANON, length);
         if (!obj)
         {
-            spinlock_release(&as->slock);
-            return ENOMEM;
+            ret = ENOMEM;
+            goto fail;
         }
     }
     else
@@ -223,11 +431,15 @@ int vm_map(vm_addrspace_t *as, uintptr_t vaddr, size_t length,
     vm_segment_t *seg = heap_alloc(sizeof(vm_segment_t));
     if (!seg)
     {
-        // TODO: if anon obj was created we need to free it
         spinlock_release(&as->slock);
+        mutex_release(&as->map_mutex);
+
+        // Frees the object if it was created above.
+        vm_object_unref(obj);
         return ENOMEM;
     }
     *seg = (vm_segment_t) {
+        .as = as,
         .start = vaddr,
         .length = length,
         .prot = prot,
@@ -236,111 +448,231 @@ int vm_map(vm_addrspace_t *as, uintptr_t vaddr, size_t length,
         .offset = offset
     };
     insert_seg(as, seg);
+    vm_rmap_add(obj, seg);
+
+    spinlock_release(&as->slock);
 
     if (flags & VM_MAP_POPULATE)
+        populate(as, seg);
+
+    mutex_release(&as->map_mutex);
+    *out = vaddr;
+    return EOK;
+
+fail:
+    spinlock_release(&as->slock);
+    mutex_release(&as->map_mutex);
+    return ret;
+}
+
+/**
+ * Cuts the segments overlapping [vaddr, vaddr + length) so that none of them
+ * crosses either boundary and calls `fn` on each one inside the range,
+ * stopping at the first error it returns.
+ */
+static int for_each_seg_in_range(vm_addrspace_t *as, uintptr_t vaddr, size_t length,
+                                 int (*fn)(vm_addrspace_t *as, vm_segment_t *seg, void *arg), void *arg)
+{
+    uintptr_t end = vaddr + length;
+    bool found = false;
+
+    list_node_t *n = as->segments.head;
+    while (n)
     {
-        uint32_t fault_flags = (prot & VM_PROTECTION_WRITE) ? VM_FAULT_WRITE : VM_FAULT_READ;
+        vm_segment_t *seg = LIST_GET_CONTAINER(n, vm_segment_t, list_node);
+        n = n->next;
 
-        for (size_t i = 0; i < length; i += ARCH_PAGE_GRAN)
-        {
-            uintptr_t curr_addr = vaddr + i;
-            size_t pgidx = i / ARCH_PAGE_GRAN;
+        if (seg->start + seg->length <= vaddr || seg->start >= end)
+            continue;
+        found = true;
 
-            page_t *page;
-            if (!obj->ops->get_page(obj, pgidx, fault_flags, &page))
-                panic("Fault handler failed!");
+        // Hugetlb segments can only be cut at huge page boundaries.
+        size_t gran = (seg->flags & VM_MAP_HUGETLB) ? vm_hugetlb_page_size(seg->flags) : ARCH_PAGE_GRAN;
+        if ((seg->start < vaddr && vaddr % gran)
+        ||  (seg->start + seg->length > end && end % gran))
+            return EINVAL;
 
-            arch_paging_map_page(
-                as->page_map,
-                curr_addr, page->addr,
-                ARCH_PAGE_GRAN,
-                prot, VM_CACHE_STANDARD
-            );
+        if (seg->start < vaddr)
+        {
+            seg = split_seg(as, seg, vaddr);
+            if (!seg)
+                return ENOMEM;
         }
+        if (seg->start + seg->length > end && !split_seg(as, seg, end))
+            return ENOMEM;
+
+        int err = fn(as, seg, arg);
+        if (err != EOK)
+            return err;
     }
 
-    spinlock_release(&as->slock);
-    *out = vaddr;
-    return EOK;
+    return found ? EOK : ENOENT;
 }
 
-int vm_unmap(vm_addrspace_t *as, uintptr_t vaddr, size_t length)
+static int unmap_seg(vm_addrspace_t *as, vm_segment_t *seg, [[maybe_unused]] void *arg)
 {
-    spinlock_acquire(&as->slock);
+    // The pages are only freed once the object is dropped below, after the invalidations went out.
+    // If a huge page crossing the range couldn't be split, the segment stays so that nothing is left mapping freed pages.
+    if (arch_paging_unmap_range(as->page_map, seg->start, seg->length) != 0)
+        return ENOMEM;
 
-    FOREACH(n, as->segments)
+    list_remove(&as->segments, &seg->list_node);
+    if (seg->object)
     {
-        vm_segment_t *seg = LIST_GET_CONTAINER(n, vm_segment_t, list_node);
+        vm_rmap_remove(seg->object, seg);
+        vm_object_unref(seg->object);
+    }
+    heap_free(seg);
 
-        if (seg->start == vaddr && seg->length == length)
-        {
-            for (size_t i = 0; i < seg->length; i += ARCH_PAGE_GRAN)
-                arch_paging_unmap_page(as->page_map, seg->start + i);
+    return EOK;
+}
 
-            list_remove(&as->segments, n);
-            heap_free(seg);
+static int protect_seg(vm_addrspace_t *as, vm_segment_t *seg, void *arg)
+{
+    vm_protection_t prot = *(vm_protection_t *)arg;
 
-            spinlock_release(&as->slock);
-            return EOK;
-        }
-    }
+    // Write access is handed out by the fault handler so copy-on-write keeps working.
+    if (arch_paging_prot_range(as->page_map, seg->start, seg->length, prot & ~VM_PROTECTION_WRITE) != 0)
+        return ENOMEM;
 
-    spinlock_release(&as->slock);
-    return ENOENT;
+    seg->prot = prot;
+    return EOK;
+}
+
+static int mergeable_seg([[maybe_unused]] vm_addrspace_t *as, vm_segment_t *seg, void *arg)
+{
+    if (*(bool *)arg)
+        seg->flags |= VM_MAP_MERGEABLE;
+    else
+        seg->flags &= ~VM_MAP_MERGEABLE;
+
+    return EOK;
 }
 
 int vm_unmap_locked(vm_addrspace_t *as, uintptr_t vaddr, size_t length)
 {
-    FOREACH(n, as->segments)
-    {
-        vm_segment_t *seg = LIST_GET_CONTAINER(n, vm_segment_t, list_node);
+    return for_each_seg_in_range(as, vaddr, length, unmap_seg, NULL);
+}
 
-        if (seg->start == vaddr && seg->length == length)
-        {
-            for (size_t i = 0; i < seg->length; i += ARCH_PAGE_GRAN)
-                arch_paging_unmap_page(as->page_map, seg->start + i);
+int vm_unmap(vm_addrspace_t *as, uintptr_t vaddr, size_t length)
+{
+    mutex_acquire(&as->map_mutex);
+    spinlock_acquire(&as->slock);
+    int ret = vm_unmap_locked(as, vaddr, length);
+    spinlock_release(&as->slock);
+    mutex_release(&as->map_mutex);
 
-            list_remove(&as->segments, n);
-            heap_free(seg);
+    return ret;
+}
 
-            return EOK;
-        }
-    }
+int vm_protect(vm_addrspace_t *as, uintptr_t vaddr, size_t length, vm_protection_t prot)
+{
+    mutex_acquire(&as->map_mutex);
+    spinlock_acquire(&as->slock);
+    int ret = for_each_seg_in_range(as, vaddr, length, protect_seg, &prot);
+    spinlock_release(&as->slock);
+    mutex_release(&as->map_mutex);
 
-    return ENOENT;
+    return ret;
+}
+
+int vm_set_mergeable(vm_addrspace_t *as, uintptr_t vaddr, size_t length, bool mergeable)
+{
+    mutex_acquire(&as->map_mutex);
+    spinlock_acquire(&as->slock);
+    int ret = for_each_seg_in_range(as, vaddr, length, mergeable_seg, &mergeable);
+    spinlock_release(&as->slock);
+    mutex_release(&as->map_mutex);
+
+    return ret;
 }
 
 /*
  * Memory allocation
  */
 
-void *vm_alloc(size_t size)
+#define UNBACK_BATCH 32
+
+static void unback_range(uintptr_t base, size_t length)
 {
-    size = CEIL(size, ARCH_PAGE_GRAN);
+    // Pages are freed a batch at a time, once no CPU can reach them anymore.
+    uintptr_t batch[UNBACK_BATCH];
+    for (uintptr_t vaddr = base; vaddr < base + length; )
+    {
+        size_t count = 0;
 
-    uintptr_t out = 0;
-    vm_map(
-        vm_kernel_as,
-        0, size,
-        VM_PROTECTION_READ | VM_PROTECTION_WRITE,
-        VM_MAP_ANON | VM_MAP_POPULATE,
-        NULL, 0,
-        &out
-    );
+        arch_paging_batch_begin(vm_kernel_as->page_map);
+        for (; vaddr < base + length && count < UNBACK_BATCH; vaddr += ARCH_PAGE_GRAN)
+        {
+            uintptr_t phys;
+            if (!arch_paging_vaddr_to_paddr(vm_kernel_as->page_map, vaddr, &phys))
+                continue;
 
-    return out ? (void *)out : NULL;
+            arch_paging_unmap_page(vm_kernel_as->page_map, vaddr);
+            batch[count++] = phys;
+        }
+        arch_paging_batch_end(vm_kernel_as->page_map);
+
+        for (size_t i = 0; i < count; i++)
+            pm_free(pm_phys_to_page(batch[i]));
+    }
 }
 
-void vm_free(void *obj)
+void *vm_alloc_prot(size_t size, vm_protection_t prot)
 {
-    // TODO: use a better algo here
+    size = CEIL(size, ARCH_PAGE_GRAN);
 
-    spinlock_acquire(&vm_kernel_as->slock);
+    uintptr_t base = vmem_alloc(&kernel_arena, size);
+    if (!base)
+        return NULL;
 
-    vm_segment_t *seg = find_seg(vm_kernel_as, (uintptr_t)obj);
-    vm_unmap_locked(vm_kernel_as, (uintptr_t)obj, seg->length);
+    // The range is ours alone, so only the page tables need the lock; pages are allocated and cleared without it.
+    uintptr_t vaddr;
+    for (vaddr = base; vaddr < base + size; vaddr += ARCH_PAGE_GRAN)
+    {
+        page_t *page = pm_alloc(0);
+        if (!page)
+            break;
+        memset((void *)(page->addr + HHDM), 0, ARCH_PAGE_GRAN);
+
+        spinlock_acquire(&vm_kernel_as->slock);
+        int err = arch_paging_map_page(vm_kernel_as->page_map, vaddr, page->addr, ARCH_PAGE_GRAN, prot, VM_CACHE_STANDARD);
+        spinlock_release(&vm_kernel_as->slock);
+
+        // Out of memory for the page tables.
+        if (err != 0)
+        {
+            pm_free(page);
+            break;
+        }
+    }
+
+    if (vaddr < base + size)
+    {
+        spinlock_acquire(&vm_kernel_as->slock);
+        unback_range(base, vaddr - base);
+        spinlock_release(&vm_kernel_as->slock);
+        vmem_free(&kernel_arena, base, size);
+        return NULL;
+    }
+
+    return (void *)base;
+}
 
+void *vm_alloc(size_t size)
+{
+    return vm_alloc_prot(size, VM_PROTECTION_READ | VM_PROTECTION_WRITE);
+}
+
+void vm_free(void *obj, size_t size)
+{
+    size = CEIL(size, ARCH_PAGE_GRAN);
+
+    spinlock_acquire(&vm_kernel_as->slock);
+    unback_range((uintptr_t)obj, size);
     spinlock_release(&vm_kernel_as->slock);
+
+    vmem_free(&kernel_arena, (uintptr_t)obj, size);
 }
 
 /*
@@ -354,7 +686,9 @@ size_t vm_copy_to_user(vm_addrspace_t *dest_as, uintptr_t dest, const void *src,
     {
         size_t offset = (dest + i) % ARCH_PAGE_GRAN;
         uintptr_t phys;
-        if(!arch_paging_vaddr_to_paddr(dest_as->page_map, dest + i, &phys))
+        // Merged pages are shared read-only and have to be copied before being written to.
+        if(!arch_paging_vaddr_to_paddr(dest_as->page_map, dest + i, &phys)
+        || pm_phys_to_page(phys)->ksm)
         {
             vm_page_fault(dest_as, dest + i, VM_FAULT_WRITE);
             arch_paging_vaddr_to_paddr(dest_as->page_map, dest + i, &phys);
@@ -399,7 +733,9 @@ size_t vm_zero_out_user(vm_addrspace_t *dest_as, uintptr_t dest, size_t count)
     {
         size_t offset = (dest + i) % ARCH_PAGE_GRAN;
         uintptr_t phys;
-        if(!arch_paging_vaddr_to_paddr(dest_as->page_map, dest + i, &phys))
+        // Merged pages are shared read-only and have to be copied before being written to.
+        if(!arch_paging_vaddr_to_paddr(dest_as->page_map, dest + i, &phys)
+        || pm_phys_to_page(phys)->ksm)
         {
             vm_page_fault(dest_as, dest + i, VM_FAULT_WRITE);
             arch_paging_vaddr_to_paddr(dest_as->page_map, dest + i, &phys);
@@ -415,6 +751,8 @@ size_t vm_zero_out_user(vm_addrspace_t *dest_as, uintptr_t dest, size_t count)
 
 // Map creation and destruction
 
+static uint64_t next_id = 0;
+
 vm_addrspace_t *vm_addrspace_create()
 {
     vm_addrspace_t *as = heap_alloc(sizeof(vm_addrspace_t));
@@ -423,18 +761,43 @@ vm_addrspace_t *vm_addrspace_create()
         .page_map = arch_paging_map_create(),
         .limit_low = 0,
         .limit_high = HHDM,
-        .slock = SPINLOCK_INIT
+        .slock = SPINLOCK_INIT,
+        .map_mutex = MUTEX_INIT,
+        .wss = {},
+        .refcount = REF_INIT,
+        .list_node = LIST_NODE_INIT
     };
 
+    spinlock_acquire(&vm_addrspace_list_slock);
+    as->id = next_id++;
+    list_append(&vm_addrspace_list, &as->list_node);
+    spinlock_release(&vm_addrspace_list_slock);
+
     return as;
 }
 
-void vm_addrspace_destroy(vm_addrspace_t *as)
+/*
+ * Address spaces are torn down by a worker so that exiting stays cheap. By the
+ * time the worker gets to one, only kernel threads may still have it loaded,
+ * and they never touch the user half, so nothing has to be unmapped or flushed
+ * page by page: dropping the objects frees the data pages, and the page tables
+ * are freed a level at a time in one pass once the borrowers have let go.
+ */
+
+static list_t teardown_queue = LIST_INIT;
+static spinlock_t teardown_slock = SPINLOCK_INIT;
+static waitqueue_t teardown_wq = WAITQUEUE_INIT;
+
+static void teardown(vm_addrspace_t *as)
 {
-    while (as->segments.length)
+    while (!list_is_empty(&as->segments))
     {
         vm_segment_t *seg = container_of(list_pop_head(&as->segments), vm_segment_t, list_node);
-        //vm_unmap(as, seg->start, seg->length);
+        if (seg->object)
+        {
+            vm_rmap_remove(seg->object, seg);
+            vm_object_unref(seg->object);
+        }
         heap_free(seg);
     }
 
@@ -442,10 +805,88 @@ void vm_addrspace_destroy(vm_addrspace_t *as)
     heap_free(as);
 }
 
+static void teardown_main()
+{
+    while (true)
+    {
+        spinlock_acquire(&teardown_slock);
+        WAITQUEUE_WAIT_EVENT(&teardown_wq, &teardown_slock, !list_is_empty(&teardown_queue), WAITQUEUE_FOREVER);
+        list_node_t *n = list_pop_head(&teardown_queue);
+        spinlock_release(&teardown_slock);
+
+        teardown(LIST_GET_CONTAINER(n, vm_addrspace_t, list_node));
+    }
+}
+
+void vm_addrspace_destroy(vm_addrspace_t *as)
+{
+    if (!as)
+        return;
+    ASSERT(as != vm_kernel_as);
+
+    // Walkers still holding on find the node reset.
+    spinlock_acquire(&vm_addrspace_list_slock);
+    list_remove(&vm_addrspace_list, &as->list_node);
+    as->list_node = LIST_NODE_INIT;
+    spinlock_release(&vm_addrspace_list_slock);
+
+    vm_addrspace_unref(as);
+}
+
+void vm_addrspace_ref(vm_addrspace_t *as)
+{
+    ref_inc(&as->refcount);
+}
+
+void vm_addrspace_unref(vm_addrspace_t *as)
+{
+    if (!ref_dec(&as->refcount))
+        return;
+
+    spinlock_acquire(&teardown_slock);
+    list_append(&teardown_queue, &as->list_node);
+    spinlock_release(&teardown_slock);
+
+    waitqueue_wake_one(&teardown_wq);
+}
+
+vm_addrspace_t *vm_addrspace_iter_next(vm_addrspace_t *prev)
+{
+    spinlock_acquire(&vm_addrspace_list_slock);
+
+    list_node_t *n;
+    if (!prev)
+        n = LIST_FIRST(&vm_addrspace_list);
+    else if (prev->list_node.prev || LIST_FIRST(&vm_addrspace_list) == &prev->list_node)
+        n = prev->list_node.next;
+    else
+    {
+        // Destroyed meanwhile, the rest of the list is found by the creation order.
+        n = LIST_FIRST(&vm_addrspace_list);
+        while (n && LIST_GET_CONTAINER(n, vm_addrspace_t, list_node)->id < prev->id)
+            n = n->next;
+    }
+
+    while (n && LIST_GET_CONTAINER(n, vm_addrspace_t, list_node) == vm_kernel_as)
+        n = n->next;
+
+    vm_addrspace_t *next = n ? LIST_GET_CONTAINER(n, vm_addrspace_t, list_node) : NULL;
+    if (next)
+        vm_addrspace_ref(next);
+
+    spinlock_release(&vm_addrspace_list_slock);
+
+    if (prev)
+        vm_addrspace_unref(prev);
+    return next;
+}
+
 // Address space cloning
 
 vm_addrspace_t *vm_addrspace_clone(vm_addrspace_t *parent_as)
 {
+    // Swapping the parent's objects for shadows mustn't happen halfway through a populate.
+    mutex_acquire(&parent_as->map_mutex);
     spinlock_acquire(&parent_as->slock);
 
     // Create new address space
@@ -459,6 +900,33 @@ vm_addrspace_t *vm_addrspace_clone(vm_addrspace_t *parent_as)
     {
         vm_segment_t *parent_seg = LIST_GET_CONTAINER(node, vm_segment_t, list_node);
 
+        // Hugetlb memory is shared with the child instead of being copied on write.
+        if (parent_seg->flags & VM_MAP_HUGETLB)
+        {
+            vm_segment_t *child_seg = heap_alloc(sizeof(vm_segment_t));
+            if (!child_seg)
+                goto fail;
+            memcpy(child_seg, parent_seg, sizeof(vm_segment_t));
+            child_seg->as = new_as;
+            vm_object_ref(child_seg->object);
+
+            list_append(&new_as->segments, &child_seg->list_node);
+            vm_rmap_add(child_seg->object, child_seg);
+            continue;
+        }
+
+        // Copy-on-write works on 4KiB pages, so huge pages are split first. The
+        // parent loses write access before anything is shared, so that failing
+        // here leaves the segment as it was.
+        uintptr_t seg_end = parent_seg->start + parent_seg->length;
+        for (uintptr_t addr = CEIL(parent_seg->start, VM_THP_SIZE); addr < seg_end; addr += VM_THP_SIZE)
+            if (vm_thp_split(parent_as, addr) != EOK)
+                goto fail;
+
+        if (arch_paging_prot_range(parent_as->page_map, parent_seg->start, parent_seg->length,
+                                   parent_seg->prot & ~VM_PROTECTION_WRITE) != 0)
+            goto fail;
+
         // The parent segment's backing object becomes the shared backing object.
         vm_object_t *shared_backing = parent_seg->object;
 
@@ -469,6 +937,7 @@ vm_addrspace_t *vm_addrspace_clone(vm_addrspace_t *parent_as)
         child_shadow->source.shadow.parent = shared_backing;
         child_shadow->source.shadow.offset = 0;
         vm_object_ref(shared_backing);
+        vm_rmap_add_shadow(shared_backing, child_shadow);
 
         // Create shadow for parent.
         vm_object_t *parent_shadow = vm_object_create(VM_OBJ_SHADOW, shared_backing->size);
@@ -480,6 +949,7 @@ vm_addrspace_t *vm_addrspace_clone(vm_addrspace_t *parent_as)
         parent_shadow->source.shadow.parent = shared_backing;
         parent_shadow->source.shadow.offset = 0;
         vm_object_ref(shared_backing);
+        vm_rmap_add_shadow(shared_backing, parent_shadow);
 
         // Create segment for child.
         vm_segment_t *child_seg = heap_alloc(sizeof(vm_segment_t));
@@ -489,30 +959,26 @@ vm_addrspace_t *vm_addrspace_clone(vm_addrspace_t *parent_as)
             goto fail;
         }
         memcpy(child_seg, parent_seg, sizeof(vm_segment_t));
+        child_seg->as = new_as;
         child_seg->object = child_shadow;
 
         list_append(&new_as->segments, &child_seg->list_node);
+        vm_rmap_add(child_shadow, child_seg);
 
-        // Update segment for parent.
+        // Update segment for parent. Both shadows sit at offset 0 of the
+        // backing object, so the segments keep their offset.
+        vm_rmap_remove(shared_backing, parent_seg);
         parent_seg->object = parent_shadow;
-        parent_seg->offset = 0;
-
-        for (size_t i = 0; i < parent_seg->length; i += ARCH_PAGE_GRAN)
-        {
-            uintptr_t curr_addr = parent_seg->start + i;
-            arch_paging_prot_page(
-                parent_as->page_map,
-                curr_addr, ARCH_PAGE_GRAN,
-                (parent_seg->prot & ~VM_PROTECTION_WRITE)
-            );
-        }
+        vm_rmap_add(parent_shadow, parent_seg);
     }
 
     spinlock_release(&parent_as->slock);
+    mutex_release(&parent_as->map_mutex);
     return new_as;
 
 fail:
     spinlock_release(&parent_as->slock);
+    mutex_release(&parent_as->map_mutex);
     log(LOG_ERROR, "Failed to duplicate address space!");
     vm_addrspace_destroy(new_as);
     return NULL;
@@ -525,6 +991,15 @@ void vm_addrspace_load(vm_addrspace_t *as)
     arch_paging_map_load(as->page_map);
 }
 
+void vm_addrspace_switch(vm_addrspace_t *as)
+{
+    // Kernel threads get by with whichever map is loaded, sparing the next user thread of the same process a TLB refill.
+    if (as == vm_kernel_as)
+        arch_paging_map_load_lazy(as->page_map);
+    else
+        arch_paging_map_load(as->page_map);
+}
+
 // Initialization
 
 static void do_big_mappings(uintptr_t vaddr, uintptr_t paddr, size_t length)
@@ -537,33 +1012,9 @@ static void do_big_mappings(uintptr_t vaddr, uintptr_t paddr, size_t length)
     };
     insert_seg(vm_kernel_as, seg);
 
-    size_t i = 0; // Progress
-    while (i < length)
-    {
-        size_t remaining = length - i;
-        size_t page_size;
-
-        // Try largest -> smallest
-        for (int j = ARCH_PAGE_SIZES_LEN - 1; j >= 0; j--)
-        {
-            page_size = ARCH_PAGE_SIZES[j];
-            if ((vaddr + i) % page_size == 0
-            &&  (paddr + i) % page_size == 0
-            &&  remaining >= page_size)
-                break;
-        }
-
-        arch_paging_map_page(
-            vm_kernel_as->page_map,
-            vaddr + i,
-            paddr + i,
-            page_size,
-            VM_PROTECTION_FULL,
-            VM_CACHE_STANDARD
-        );
-
-        i += page_size;
-    }
+    // Picks the largest pages the alignment allows by itself.
+    if (arch_paging_map_range(vm_kernel_as->page_map, vaddr, paddr, length, VM_PROTECTION_FULL, VM_CACHE_STANDARD) != 0)
+        panic("Could not map the kernel's address space!");
 }
 
 void vm_init()
@@ -628,7 +1079,39 @@ void vm_init()
         );
     }
 
+    // Set aside a range for the kernel arena so vm_map() never hands it out.
+    uintptr_t arena_base;
+    if (!find_space(vm_kernel_as, KERNEL_ARENA_SIZE, ARCH_PAGE_GRAN, &arena_base))
+        panic("Could not reserve the kernel virtual address arena!");
+
+    vm_segment_t *arena_seg = heap_alloc(sizeof(vm_segment_t));
+    *arena_seg = (vm_segment_t) {
+        .start = arena_base,
+        .length = KERNEL_ARENA_SIZE
+    };
+    insert_seg(vm_kernel_as, arena_seg);
+
+    vmem_init(&kernel_arena, "kernel-va", ARCH_PAGE_GRAN);
+    if (!vmem_add(&kernel_arena, arena_base, KERNEL_ARENA_SIZE))
+        panic("Could not reserve the kernel virtual address arena!");
+
     vm_addrspace_load(vm_kernel_as);
 
     log(LOG_INFO, "Virtual memory initialized.");
 }
+
+void vm_teardown_init()
+{
+    proc_t *teardown_proc;
+    thread_t *teardown_thread;
+
+    if (proc_create_kernel("VM Teardown", &teardown_proc) != EOK)
+        panic("Could not initialize the address space teardown worker!");
+
+    if (thread_create_kernel(teardown_proc->as, (uintptr_t)&teardown_main, 4096, &teardown_thread) != EOK)
+        panic("Could not initialize the address space teardown worker!");
+    teardown_thread->owner = teardown_proc;
+    list_append(&teardown_proc->threads, &teardown_thread->proc_thread_list_node);
+
+    sched_enqueue(teardown_thread);
+}
@@ -3,9 +3,12 @@
 #include "hhdm.h"
 #include "mm/mm.h"
 #include "mm/pm.h"
+#include "mm/vm/vm_ksm.h"
+#include "mm/vm/vm_swap.h"
+#include "mm/vm/vm_thp.h"
+#include "uapi/errno.h"
 
-static bool anon_get_page(vm_object_t *obj, size_t offset,
-                          [[maybe_unused]] vm_fault_type_t fault_type,
+static bool anon_get_page(vm_object_t *obj, size_t offset, vm_fault_type_t fault_type,
                           page_t **page_out)
 {
     spinlock_acquire(&obj->slock);
@@ -14,13 +17,26 @@ static bool anon_get_page(vm_object_t *obj, size_t offset,
     page_t *page = vm_object_lookup_page(obj, offset);
     if (page)
     {
+        // Merged pages are shared with other objects and copied before being written to.
+        if (page->ksm && fault_type == VM_FAULT_WRITE)
+            page = vm_ksm_unshare(obj, offset, page);
+
         *page_out = page;
         spinlock_release(&obj->slock);
-        return true;
+        return page != NULL;
+    }
+
+    // Swapped out: Decompress it into a new page.
+    int err = vm_object_swap_in(obj, offset, &page);
+    if (err != ENOENT)
+    {
+        *page_out = page;
+        spinlock_release(&obj->slock);
+        return err == EOK;
     }
 
     // Not resident: Allocate a new physical page.
-    page = pm_alloc(0);
+    page = vm_swap_alloc_page();
     if (!page)
     {
         spinlock_release(&obj->slock);
@@ -38,6 +54,37 @@ static bool anon_get_page(vm_object_t *obj, size_t offset,
     return true;
 }
 
+static bool anon_get_huge_page(vm_object_t *obj, size_t offset, page_t **page_out)
+{
+    spinlock_acquire(&obj->slock);
+
+    // Only a range without any resident page can be backed by a single block.
+    size_t index = offset;
+    if (xa_find(&obj->cached_pages, &index, offset + VM_THP_PAGES - 1))
+    {
+        spinlock_release(&obj->slock);
+        return false;
+    }
+
+    page_t *page = pm_alloc(VM_THP_ORDER);
+    if (!page)
+    {
+        spinlock_release(&obj->slock);
+        return false; // Let the caller fall back to 4KiB pages.
+    }
+
+    memset((void *)(page->addr + HHDM), 0, VM_THP_SIZE);
+
+    // Each 4KiB page is tracked on its own so the block can be split later.
+    pm_split(page);
+    for (size_t i = 0; i < VM_THP_PAGES; i++)
+        vm_object_insert_page(obj, pm_phys_to_page(page->addr + i * ARCH_PAGE_GRAN), offset + i);
+
+    *page_out = page;
+    spinlock_release(&obj->slock);
+    return true;
+}
+
 static bool anon_put_page([[maybe_unused]] vm_object_t *obj,
                           [[maybe_unused]] page_t *page)
 {
@@ -46,15 +93,12 @@ static bool anon_put_page([[maybe_unused]] vm_object_t *obj,
 
 static void anon_destroy(vm_object_t *obj)
 {
-    void *ptr;
-    size_t index = 0;
-
-    xa_foreach(&obj->cached_pages, index, ptr)
-        pm_free((page_t *)ptr);
+    vm_object_free_pages(obj);
 }
 
 vm_object_ops_t anon_ops = {
-    .get_page  = anon_get_page,
-    .put_page  = anon_put_page,
-    .destroy   = anon_destroy
+    .get_page      = anon_get_page,
+    .get_huge_page = anon_get_huge_page,
+    .put_page      = anon_put_page,
+    .destroy       = anon_destroy
 };
@@ -0,0 +1,169 @@
+#include "mm/vm/vm_hugetlb.h"
+
+#include "arch/lcpu.h"
+#include "hhdm.h"
+#include "mm/hugetlb.h"
+#include "mm/mm.h"
+#include "utils/math.h"
+
+/*
+ * Pages are cached by huge page index rather than by 4KiB page index.
+ */
+
+static bool hugetlb_get_page(vm_object_t *obj, size_t offset,
+                             [[maybe_unused]] vm_fault_type_t fault_type,
+                             page_t **page_out)
+{
+    hugetlb_pool_t *pool = obj->source.hugetlb.pool;
+    size_t idx = offset / (pool->page_size / ARCH_PAGE_GRAN);
+
+    while (true)
+    {
+        spinlock_acquire(&obj->slock);
+
+        page_t *page = vm_object_lookup_page(obj, idx);
+        if (page)
+        {
+            *page_out = page;
+            spinlock_release(&obj->slock);
+            return true;
+        }
+
+        if ((idx + 1) * pool->page_size > obj->size)
+        {
+            spinlock_release(&obj->slock);
+            return false; // Outside of what was reserved.
+        }
+
+        // The rest of the reservation is taken by others faulting the same pages in, one of them gives it back.
+        if (obj->source.hugetlb.reserved == 0)
+        {
+            spinlock_release(&obj->slock);
+            arch_lcpu_relax();
+            continue;
+        }
+
+        page = hugetlb_alloc(pool);
+        obj->source.hugetlb.reserved--;
+
+        // Zeroing up to 1GiB takes a while, the object isn't held up meanwhile.
+        spinlock_release(&obj->slock);
+        memset((void *)(page->addr + HHDM), 0, pool->page_size);
+        spinlock_acquire(&obj->slock);
+
+        // Faulted in by someone else meanwhile.
+        page_t *cached = vm_object_lookup_page(obj, idx);
+        if (cached)
+        {
+            obj->source.hugetlb.reserved++;
+            hugetlb_free_reserved(pool, page);
+            page = cached;
+        }
+        else
+            vm_object_insert_page(obj, page, idx);
+
+        *page_out = page;
+        spinlock_release(&obj->slock);
+        return true;
+    }
+}
+
+static bool hugetlb_put_page([[maybe_unused]] vm_object_t *obj,
+                             [[maybe_unused]] page_t *page)
+{
+    return true;
+}
+
+static void hugetlb_destroy(vm_object_t *obj)
+{
+    hugetlb_pool_t *pool = obj->source.hugetlb.pool;
+
+    void *ptr;
+    size_t index = 0;
+
+    xa_foreach(&obj->cached_pages, index, ptr)
+        hugetlb_free(pool, (page_t *)ptr);
+
+    hugetlb_unreserve(pool, obj->source.hugetlb.reserved);
+}
+
+vm_object_ops_t hugetlb_ops = {
+    .get_page = hugetlb_get_page,
+    .put_page = hugetlb_put_page,
+    .destroy  = hugetlb_destroy
+};
+
+/*
+ * Object creation
+ */
+
+vm_object_t *vm_hugetlb_object_create(size_t page_size, size_t size)
+{
+    hugetlb_pool_t *pool = hugetlb_get_pool(page_size);
+    if (!pool)
+        return NULL;
+
+    size = CEIL(size, page_size);
+    if (!hugetlb_reserve(pool, size / page_size))
+        return NULL;
+
+    vm_object_t *obj = vm_object_create(VM_OBJ_HUGETLB, size);
+    if (!obj)
+    {
+        hugetlb_unreserve(pool, size / page_size);
+        return NULL;
+    }
+    obj->source.hugetlb.pool = pool;
+    obj->source.hugetlb.reserved = size / page_size;
+
+    return obj;
+}
+
+bool vm_hugetlb_object_grow(vm_object_t *obj, size_t size)
+{
+    hugetlb_pool_t *pool = obj->source.hugetlb.pool;
+
+    spinlock_acquire(&obj->slock);
+
+    size = CEIL(size, pool->page_size);
+    if (size <= obj->size)
+    {
+        spinlock_release(&obj->slock);
+        return true;
+    }
+
+    size_t count = (size - obj->size) / pool->page_size;
+    if (!hugetlb_reserve(pool, count))
+    {
+        spinlock_release(&obj->slock);
+        return false;
+    }
+    obj->source.hugetlb.reserved += count;
+    obj->size = size;
+
+    spinlock_release(&obj->slock);
+    return true;
+}
+
+/*
+ * Fault handling
+ */
+
+bool vm_hugetlb_fault(vm_addrspace_t *as, vm_segment_t *seg, uintptr_t vaddr, vm_fault_type_t type)
+{
+    size_t page_size = vm_hugetlb_page_size(seg->flags);
+    uintptr_t base = FLOOR(vaddr, page_size);
+
+    // Already mapped: this is a write to a page that was mapped read-only.
+    if (arch_paging_get_page_size(as->page_map, base) == page_size)
+        return arch_paging_prot_page(as->page_map, base, page_size, seg->prot) == 0;
+
+    size_t pgidx = ((base - seg->start) / ARCH_PAGE_GRAN) + seg->offset;
+
+    page_t *page;
+    if (!seg->object->ops->get_page(seg->object, pgidx, type, &page))
+        return false;
+
+    // Hugetlb memory is never copy-on-write, so write access can be granted right away.
+    return arch_paging_map_page(as->page_map, base, page->addr, page_size, seg->prot, VM_CACHE_STANDARD) == 0;
+}
@@ -0,0 +1,375 @@
+#include "mm/vm/vm_ksm.h"
+
+#include "hhdm.h"
+#include "log.h"
+#include "mm/heap.h"
+#include "mm/mm.h"
+#include "mm/vm.h"
+#include "mm/vm/vm_rmap.h"
+#include "mm/vm/vm_swap.h"
+#include "panic.h"
+#include "sys/proc.h"
+#include "sys/sched.h"
+#include "sys/thread.h"
+#include "uapi/errno.h"
+#include "utils/list.h"
+#include "utils/math.h"
+
+#define SCAN_INTERVAL_NS (2000ull * 1000 * 1000)
+#define BUCKETS 256
+
+/*
+ * Merged pages
+ *
+ * Merged pages are looked up by checksum. Their contents never change, as
+ * they are only ever mapped read-only.
+ */
+
+typedef struct vm_ksm_node
+{
+    page_t *page;
+    uint32_t checksum;
+    size_t sharers; // Object slots holding the page.
+
+    list_node_t list_node;
+}
+vm_ksm_node_t;
+
+static list_t stable[BUCKETS];
+static vm_ksm_stats_t stats;
+static spinlock_t slock = SPINLOCK_INIT;
+
+static uint32_t checksum(page_t *page)
+{
+    const uint64_t *words = (const uint64_t *)(page->addr + HHDM);
+
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < ARCH_PAGE_GRAN / sizeof(uint64_t); i++)
+        hash = (hash ^ words[i]) * 0x100000001B3ull;
+
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static bool same(page_t *a, page_t *b)
+{
+    return memcmp((void *)(a->addr + HHDM), (void *)(b->addr + HHDM), ARCH_PAGE_GRAN) == 0;
+}
+
+/**
+ * Finds a merged page with the same contents as `page` and takes a reference
+ * to it.
+ */
+static page_t *stable_get(page_t *page, uint32_t sum)
+{
+    spinlock_acquire(&slock);
+
+    FOREACH(n, stable[sum % BUCKETS])
+    {
+        vm_ksm_node_t *node = LIST_GET_CONTAINER(n, vm_ksm_node_t, list_node);
+        if (node->checksum == sum && same(node->page, page))
+        {
+            node->sharers++;
+            stats.pages_sharing++;
+
+            spinlock_release(&slock);
+            return node->page;
+        }
+    }
+
+    spinlock_release(&slock);
+    return NULL;
+}
+
+void vm_ksm_put(page_t *page)
+{
+    vm_ksm_node_t *node = page->ksm;
+
+    spinlock_acquire(&slock);
+
+    if (--node->sharers > 0)
+    {
+        stats.pages_sharing--;
+        spinlock_release(&slock);
+        return;
+    }
+
+    list_remove(&stable[node->checksum % BUCKETS], &node->list_node);
+    stats.pages_shared--;
+
+    spinlock_release(&slock);
+
+    heap_free(node);
+    page->ksm = NULL;
+    pm_free(page);
+}
+
+page_t *vm_ksm_unshare(vm_object_t *obj, size_t offset, page_t *page)
+{
+    page_t *copy = vm_swap_alloc_page();
+    if (!copy)
+        return NULL;
+    memcpy((void *)(copy->addr + HHDM), (void *)(page->addr + HHDM), ARCH_PAGE_GRAN);
+
+    vm_object_insert_page(obj, copy, offset);
+    vm_ksm_put(page);
+
+    return copy;
+}
+
+/*
+ * Candidates
+ *
+ * Pages that didn't match any merged page are remembered for the rest of the
+ * scan, so that the next identical one can be merged with them.
+ */
+
+typedef struct
+{
+    vm_object_t *obj; // Referenced until the end of the scan.
+    size_t offset;
+    page_t *page;     // NULL once merged.
+    uint32_t checksum;
+
+    list_node_t list_node;
+}
+candidate_t;
+
+static list_t unstable[BUCKETS];
+
+static void unstable_add(vm_object_t *obj, size_t offset, page_t *page, uint32_t sum)
+{
+    candidate_t *c = heap_alloc(sizeof(candidate_t));
+    if (!c)
+        return;
+
+    vm_object_ref(obj);
+    *c = (candidate_t) {
+        .obj = obj,
+        .offset = offset,
+        .page = page,
+        .checksum = sum,
+        .list_node = LIST_NODE_INIT
+    };
+    list_append(&unstable[sum % BUCKETS], &c->list_node);
+}
+
+static void unstable_clear()
+{
+    for (size_t i = 0; i < BUCKETS; i++)
+    {
+        list_node_t *n;
+        while ((n = list_pop_head(&unstable[i])))
+        {
+            candidate_t *c = LIST_GET_CONTAINER(n, candidate_t, list_node);
+            vm_object_unref(c->obj);
+            heap_free(c);
+        }
+    }
+}
+
+/*
+ * Merging
+ */
+
+/**
+ * Makes `page`, the page at `offset` of `obj`, the merged copy shared with the
+ * page of candidate `c`. The caller holds the locks of the address space and
+ * of `obj`.
+ */
+static bool merge_candidate(vm_addrspace_t *as, vm_object_t *obj, size_t offset, page_t *page, candidate_t *c)
+{
+    if (c->obj != obj && !spinlock_try_acquire(&c->obj->slock))
+        return false;
+
+    bool merged = false;
+
+    // Either page may have changed hands since it was looked at. Once unmapped
+    // they can't be written to anymore, so the comparison sticks.
+    if (vm_object_lookup_page(c->obj, c->offset) == c->page && !c->page->ksm
+    &&  vm_rmap_unmap(c->obj, c->offset, c->page, as)
+    &&  vm_rmap_unmap(obj, offset, page, as)
+    &&  same(c->page, page))
+    {
+        vm_ksm_node_t *node = heap_alloc(sizeof(vm_ksm_node_t));
+        if (node)
+        {
+            *node = (vm_ksm_node_t) {
+                .page = c->page,
+                .checksum = c->checksum,
+                .sharers = 2,
+                .list_node = LIST_NODE_INIT
+            };
+            c->page->ksm = node;
+
+            spinlock_acquire(&slock);
+            list_append(&stable[node->checksum % BUCKETS], &node->list_node);
+            stats.pages_shared++;
+            stats.pages_sharing++;
+            spinlock_release(&slock);
+
+            vm_object_insert_page(obj, c->page, offset);
+            pm_free(page);
+
+            c->page = NULL;
+            merged = true;
+        }
+    }
+
+    if (c->obj != obj)
+        spinlock_release(&c->obj->slock);
+    return merged;
+}
+
+static void scan_page(vm_addrspace_t *as, vm_object_t *obj, size_t offset, page_t *page)
+{
+    // Only pages that held still since the last scan are worth merging.
+    uint32_t sum = checksum(page);
+    if (sum != page->checksum)
+    {
+        page->checksum = sum;
+        return;
+    }
+
+    page_t *shared = stable_get(page, sum);
+    if (shared)
+    {
+        if (vm_rmap_unmap(obj, offset, page, as) && same(shared, page))
+        {
+            vm_object_insert_page(obj, shared, offset);
+            pm_free(page);
+        }
+        else
+            vm_ksm_put(shared);
+        return;
+    }
+
+    FOREACH(n, unstable[sum % BUCKETS])
+    {
+        candidate_t *c = LIST_GET_CONTAINER(n, candidate_t, list_node);
+        if (c->page && c->page != page && c->checksum == sum && same(c->page, page)
+        &&  merge_candidate(as, obj, offset, page, c))
+            return;
+    }
+
+    unstable_add(obj, offset, page, sum);
+}
+
+static void scan_segment(vm_addrspace_t *as, vm_segment_t *seg)
+{
+    vm_object_t *obj = seg->object;
+
+    for (uintptr_t vaddr = seg->start; vaddr < seg->start + seg->length; vaddr += ARCH_PAGE_GRAN)
+    {
+        spinlock_acquire(&as->slock);
+
+        // Huge pages stay as they are.
+        size_t size = arch_paging_get_page_size(as->page_map, vaddr);
+        if (size != ARCH_PAGE_GRAN)
+        {
+            spinlock_release(&as->slock);
+            if (size)
+                vaddr = FLOOR(vaddr, size) + size - ARCH_PAGE_GRAN;
+            continue;
+        }
+
+        uintptr_t phys;
+        arch_paging_vaddr_to_paddr(as->page_map, vaddr, &phys);
+        size_t pgidx = ((vaddr - seg->start) / ARCH_PAGE_GRAN) + seg->offset;
+
+        spinlock_acquire(&obj->slock);
+
+        // Only pages held by the segment's own object; those of the objects it shadows are skipped.
+        page_t *page = vm_object_lookup_page(obj, pgidx);
+        if (page && page->addr == phys && !page->ksm)
+            scan_page(as, obj, pgidx, page);
+
+        spinlock_release(&obj->slock);
+        spinlock_release(&as->slock);
+    }
+}
+
+/**
+ * Holds the layout still rather than the spinlock, which is only taken a page
+ * at a time.
+ */
+static void scan_addrspace(vm_addrspace_t *as)
+{
+    mutex_acquire(&as->map_mutex);
+
+    FOREACH(n, as->segments)
+    {
+        vm_segment_t *seg = LIST_GET_CONTAINER(n, vm_segment_t, list_node);
+        vm_object_t *obj = seg->object;
+
+        if (!(seg->flags & VM_MAP_MERGEABLE) || !(seg->flags & VM_MAP_PRIVATE)
+        ||  !obj || (obj->type != VM_OBJ_ANON && obj->type != VM_OBJ_SHADOW))
+            continue;
+
+        scan_segment(as, seg);
+    }
+
+    mutex_release(&as->map_mutex);
+}
+
+static void ksm_main()
+{
+    while (true)
+    {
+        vm_ksm_stats_t before;
+        vm_ksm_get_stats(&before);
+
+        // Scanning can sleep, so the address space is held on to rather than the list.
+        vm_addrspace_t *as = NULL;
+        while ((as = vm_addrspace_iter_next(as)))
+            scan_addrspace(as);
+
+        // Dropping the candidates' object references may destroy objects, so no locks may be held.
+        unstable_clear();
+
+        spinlock_acquire(&slock);
+        stats.full_scans++;
+        vm_ksm_stats_t s = stats;
+        spinlock_release(&slock);
+
+        if (s.pages_shared != before.pages_shared || s.pages_sharing != before.pages_sharing)
+            log(LOG_DEBUG, "Same-page merging: %lu pages shared, %lu pages sharing them.",
+                s.pages_shared, s.pages_sharing);
+
+        sched_sleep(SCAN_INTERVAL_NS);
+    }
+}
+
+// Counters
+
+void vm_ksm_get_stats(vm_ksm_stats_t *out)
+{
+    spinlock_acquire(&slock);
+    *out = stats;
+    spinlock_release(&slock);
+}
+
+// Initialization
+
+void vm_ksm_init()
+{
+    for (size_t i = 0; i < BUCKETS; i++)
+    {
+        stable[i] = LIST_INIT;
+        unstable[i] = LIST_INIT;
+    }
+
+    proc_t *ksm_proc;
+    thread_t *ksm_thread;
+
+    if (proc_create_kernel("KSM", &ksm_proc) != EOK)
+        panic("Could not initialize the same-page merging daemon!");
+
+    if (thread_create_kernel(ksm_proc->as, (uintptr_t)&ksm_main, 4096, &ksm_thread) != EOK)
+        panic("Could not initialize the same-page merging daemon!");
+    ksm_thread->owner = ksm_proc;
+    list_append(&ksm_proc->threads, &ksm_thread->proc_thread_list_node);
+
+    sched_enqueue(ksm_thread);
+
+    log(LOG_INFO, "Same-page merging initialized.");
+}
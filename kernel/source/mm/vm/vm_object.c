@@ -3,15 +3,20 @@
 #include "assert.h"
 #include "mm/heap.h"
 #include "mm/mm.h"
+#include "mm/vm/vm_ksm.h"
+#include "mm/vm/vm_swap.h"
+#include "uapi/errno.h"
 
 extern vm_object_ops_t anon_ops;
 extern vm_object_ops_t phys_ops;
 extern vm_object_ops_t shadow_ops;
+extern vm_object_ops_t hugetlb_ops;
 
 static vm_object_ops_t *ops_table[] = {
-    [VM_OBJ_ANON]   = &anon_ops,
-    [VM_OBJ_PHYS]   = &phys_ops,
-    [VM_OBJ_SHADOW] = &shadow_ops
+    [VM_OBJ_ANON]    = &anon_ops,
+    [VM_OBJ_PHYS]    = &phys_ops,
+    [VM_OBJ_SHADOW]  = &shadow_ops,
+    [VM_OBJ_HUGETLB] = &hugetlb_ops
 };
 
 /*
@@ -30,6 +35,12 @@ vm_object_t *vm_object_create(vm_object_type_t type, size_t size)
     obj->cached_pages = XARRAY_INIT;
     obj->ops = ops_table[type];
     memset(&obj->source, 0, sizeof(obj->source));
+    obj->mappings = LIST_INIT;
+    obj->shadows = LIST_INIT;
+    obj->shadow_node = LIST_NODE_INIT;
+    obj->rmap_slock = SPINLOCK_INIT;
+    obj->wss = (vm_wss_histogram_t) {};
+    obj->wss_pass = 0;
     obj->slock = SPINLOCK_INIT;
     obj->refcount = REF_INIT;
 
@@ -38,7 +49,8 @@ vm_object_t *vm_object_create(vm_object_type_t type, size_t size)
 
 static void vm_object_destroy(vm_object_t *obj)
 {
-    ASSERT(ref_read(&obj->refcount) == 1);
+    ASSERT(ref_read(&obj->refcount) == 0);
+    ASSERT(list_is_empty(&obj->mappings) && list_is_empty(&obj->shadows));
 
     obj->ops->destroy(obj);
     heap_free(obj);
@@ -66,8 +78,8 @@ void vm_object_insert_page(vm_object_t *obj, page_t *page, size_t offset)
 
 page_t *vm_object_lookup_page(vm_object_t *obj, size_t offset)
 {
-    page_t *page = xa_get(&obj->cached_pages, offset);
-    return page;
+    void *entry = xa_get(&obj->cached_pages, offset);
+    return vm_swap_is_entry(entry) ? NULL : entry;
 }
 
 void vm_object_remove_page(vm_object_t *obj, size_t offset)
@@ -75,6 +87,62 @@ void vm_object_remove_page(vm_object_t *obj, size_t offset)
     xa_remove(&obj->cached_pages, offset);
 }
 
+/*
+ * Swap
+ */
+
+bool vm_object_is_swapped(vm_object_t *obj, size_t offset)
+{
+    return vm_swap_is_entry(xa_get(&obj->cached_pages, offset));
+}
+
+bool vm_object_swap_out(vm_object_t *obj, size_t offset)
+{
+    // Merged pages are kept resident for the other objects sharing them.
+    page_t *page = vm_object_lookup_page(obj, offset);
+    if (!page || page->ksm)
+        return false;
+
+    void *entry = vm_swap_out(page);
+    if (!entry)
+        return false;
+
+    xa_insert(&obj->cached_pages, offset, entry);
+    pm_free(page);
+    return true;
+}
+
+int vm_object_swap_in(vm_object_t *obj, size_t offset, page_t **page_out)
+{
+    void *entry = xa_get(&obj->cached_pages, offset);
+    if (!vm_swap_is_entry(entry))
+        return ENOENT;
+
+    page_t *page = vm_swap_in(entry);
+    if (!page)
+        return ENOMEM;
+
+    xa_insert(&obj->cached_pages, offset, page);
+    *page_out = page;
+    return EOK;
+}
+
+void vm_object_free_pages(vm_object_t *obj)
+{
+    void *entry;
+    size_t index = 0;
+
+    xa_foreach(&obj->cached_pages, index, entry)
+    {
+        if (vm_swap_is_entry(entry))
+            vm_swap_free(entry);
+        else if (((page_t *)entry)->ksm)
+            vm_ksm_put((page_t *)entry);
+        else
+            pm_free((page_t *)entry);
+    }
+}
+
 /*
  * Sync
  */
@@ -0,0 +1,163 @@
+#include "mm/vm/vm_rmap.h"
+
+#include "arch/types.h"
+#include "mm/vm/vm_thp.h"
+#include "uapi/errno.h"
+#include "utils/list.h"
+#include "utils/math.h"
+
+// Maintenance
+
+void vm_rmap_add(vm_object_t *obj, vm_segment_t *seg)
+{
+    spinlock_acquire(&obj->rmap_slock);
+    list_append(&obj->mappings, &seg->object_node);
+    spinlock_release(&obj->rmap_slock);
+}
+
+void vm_rmap_remove(vm_object_t *obj, vm_segment_t *seg)
+{
+    spinlock_acquire(&obj->rmap_slock);
+    list_remove(&obj->mappings, &seg->object_node);
+    spinlock_release(&obj->rmap_slock);
+}
+
+void vm_rmap_add_shadow(vm_object_t *parent, vm_object_t *shadow)
+{
+    spinlock_acquire(&parent->rmap_slock);
+    list_append(&parent->shadows, &shadow->shadow_node);
+    spinlock_release(&parent->rmap_slock);
+}
+
+void vm_rmap_remove_shadow(vm_object_t *parent, vm_object_t *shadow)
+{
+    spinlock_acquire(&parent->rmap_slock);
+    list_remove(&parent->shadows, &shadow->shadow_node);
+    spinlock_release(&parent->rmap_slock);
+}
+
+// Walking
+
+typedef struct
+{
+    page_t *page;
+    vm_addrspace_t *locked_as;
+    vm_rmap_fn_t fn;
+    void *arg;
+
+    bool complete; // No address space had to be skipped, and `fn` never failed.
+    bool stop;
+}
+walk_t;
+
+static bool seg_covers(vm_segment_t *seg, size_t offset)
+{
+    return offset >= seg->offset && offset - seg->offset < seg->length / ARCH_PAGE_GRAN;
+}
+
+static void walk_segment(vm_segment_t *seg, size_t offset, walk_t *w)
+{
+    if (!seg_covers(seg, offset))
+        return;
+
+    vm_addrspace_t *as = seg->as;
+    if (as != w->locked_as && !spinlock_try_acquire(&as->slock))
+    {
+        w->complete = false;
+        return;
+    }
+
+    // The segment may have been cut while the address space wasn't locked.
+    uintptr_t vaddr = seg->start + (offset - seg->offset) * ARCH_PAGE_GRAN;
+    uintptr_t phys;
+    if (seg_covers(seg, offset)
+    &&  arch_paging_vaddr_to_paddr(as->page_map, vaddr, &phys)
+    &&  FLOOR(phys, ARCH_PAGE_GRAN) == w->page->addr
+    &&  !w->fn(as, vaddr, w->arg))
+    {
+        w->complete = false;
+        w->stop = true;
+    }
+
+    if (as != w->locked_as)
+        spinlock_release(&as->slock);
+}
+
+static void walk_object(vm_object_t *obj, size_t offset, walk_t *w)
+{
+    spinlock_acquire(&obj->rmap_slock);
+
+    FOREACH(n, obj->mappings)
+    {
+        if (w->stop)
+            break;
+        walk_segment(LIST_GET_CONTAINER(n, vm_segment_t, object_node), offset, w);
+    }
+
+    FOREACH(n, obj->shadows)
+    {
+        if (w->stop)
+            break;
+
+        vm_object_t *shadow = LIST_GET_CONTAINER(n, vm_object_t, shadow_node);
+        if (offset < shadow->source.shadow.offset)
+            continue;
+        size_t shadow_offset = offset - shadow->source.shadow.offset;
+
+        // A shadow with its own copy, resident or not, hides the page from everything above it.
+        spinlock_acquire(&shadow->slock);
+        bool hidden = vm_object_lookup_page(shadow, shadow_offset) || vm_object_is_swapped(shadow, shadow_offset);
+        spinlock_release(&shadow->slock);
+
+        if (!hidden)
+            walk_object(shadow, shadow_offset, w);
+    }
+
+    spinlock_release(&obj->rmap_slock);
+}
+
+bool vm_rmap_walk(vm_object_t *obj, size_t offset, page_t *page, vm_addrspace_t *locked_as,
+                  vm_rmap_fn_t fn, void *arg)
+{
+    walk_t w = {
+        .page = page,
+        .locked_as = locked_as,
+        .fn = fn,
+        .arg = arg,
+        .complete = true,
+        .stop = false
+    };
+
+    walk_object(obj, offset, &w);
+    return w.complete;
+}
+
+static bool unmap_one(vm_addrspace_t *as, uintptr_t vaddr, [[maybe_unused]] void *arg)
+{
+    // Only the one 4KiB page goes, not the huge page around it.
+    if (arch_paging_get_page_size(as->page_map, vaddr) != ARCH_PAGE_GRAN
+    &&  vm_thp_split(as, vaddr) != EOK)
+        return false;
+
+    arch_paging_unmap_page(as->page_map, vaddr);
+    return true;
+}
+
+bool vm_rmap_unmap(vm_object_t *obj, size_t offset, page_t *page, vm_addrspace_t *locked_as)
+{
+    return vm_rmap_walk(obj, offset, page, locked_as, unmap_one, NULL);
+}
+
+static bool referenced_one(vm_addrspace_t *as, uintptr_t vaddr, void *arg)
+{
+    if (arch_paging_test_and_clear_accessed(as->page_map, vaddr))
+        (*(size_t *)arg)++;
+    return true;
+}
+
+size_t vm_rmap_referenced(vm_object_t *obj, size_t offset, page_t *page, vm_addrspace_t *locked_as)
+{
+    size_t count = 0;
+    vm_rmap_walk(obj, offset, page, locked_as, referenced_one, &count);
+    return count;
+}
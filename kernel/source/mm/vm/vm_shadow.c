@@ -4,6 +4,10 @@
 #include "hhdm.h"
 #include "mm/mm.h"
 #include "mm/pm.h"
+#include "mm/vm/vm_ksm.h"
+#include "mm/vm/vm_rmap.h"
+#include "mm/vm/vm_swap.h"
+#include "uapi/errno.h"
 
 static bool shadow_get_page(vm_object_t *obj, size_t offset, uint32_t fault_flags, page_t **page_out)
 {
@@ -13,9 +17,22 @@ static bool shadow_get_page(vm_object_t *obj, size_t offset, uint32_t fault_flag
     page_t *page = vm_object_lookup_page(obj, offset);
     if (page)
     {
+        // Unless it got merged with identical pages since.
+        if (page->ksm && fault_flags == VM_FAULT_WRITE)
+            page = vm_ksm_unshare(obj, offset, page);
+
         *page_out = page;
         spinlock_release(&obj->slock);
-        return true;
+        return page != NULL;
+    }
+
+    // The private copy may have been swapped out.
+    int err = vm_object_swap_in(obj, offset, &page);
+    if (err != ENOENT)
+    {
+        *page_out = page;
+        spinlock_release(&obj->slock);
+        return err == EOK;
     }
 
     // If not, fetch the page from the parent object.
@@ -38,7 +55,7 @@ static bool shadow_get_page(vm_object_t *obj, size_t offset, uint32_t fault_flag
     }
 
     // For write faults perform COW.
-    page = pm_alloc(0);
+    page = vm_swap_alloc_page();
     if (!page)
         return false; // OUT OF MEM
     memcpy(
@@ -72,12 +89,10 @@ static bool shadow_put_page([[maybe_unused]] vm_object_t *obj,
 
 static void shadow_destroy(vm_object_t *obj)
 {
-    void *ptr;
-    size_t index = 0;
-    xa_foreach(&obj->cached_pages, index, ptr)
-        pm_free((page_t *)ptr);
+    vm_object_free_pages(obj);
 
     // Drop reference to parent.
+    vm_rmap_remove_shadow(obj->source.shadow.parent, obj);
     vm_object_unref(obj->source.shadow.parent);
 }
 
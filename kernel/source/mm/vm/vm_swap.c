@@ -0,0 +1,426 @@
+#include "mm/vm/vm_swap.h"
+
+#include "hhdm.h"
+#include "log.h"
+#include "mm/mm.h"
+#include "mm/shrinker.h"
+#include "mm/vm.h"
+#include "mm/vm/vm_object.h"
+#include "mm/vm/vm_rmap.h"
+#include "panic.h"
+#include "sys/proc.h"
+#include "sys/sched.h"
+#include "sys/thread.h"
+#include "uapi/errno.h"
+#include "utils/list.h"
+#include "utils/lz4.h"
+#include "utils/math.h"
+
+#define SCAN_INTERVAL_NS (500ull * 1000 * 1000)
+#define COLD_AGE 2              // Scans without an access before a page counts as cold.
+#define DIRECT_RECLAIM_PAGES 32
+
+#define POOL_CLASS_GRAN 64
+#define POOL_CLASSES (ARCH_PAGE_GRAN / POOL_CLASS_GRAN)
+#define POOL_MAX_STORED (ARCH_PAGE_GRAN * 3 / 4) // Pages that compress worse than this stay resident.
+#define POOL_SPARE_PAGES 4                       // Kept back so that reclaim can start with no free memory.
+
+/*
+ * Compressed pool
+ *
+ * Pool pages are carved into equally sized slots, one size class per 64 bytes.
+ * Each slot holds the compressed length followed by the compressed data.
+ */
+
+typedef struct
+{
+    list_node_t list_node;
+    size_t slot_size;
+    size_t used;
+    void *freelist;
+}
+pool_page_t;
+
+static list_t partial[POOL_CLASSES];
+static list_t spare = LIST_INIT;
+static lz4_workmem_t workmem;
+static uint8_t buffer[POOL_MAX_STORED];
+static vm_swap_stats_t stats;
+static spinlock_t slock = SPINLOCK_INIT;
+
+static size_t low_watermark;
+static size_t high_watermark;
+static thread_t *swap_thread;
+
+static void *slot_alloc(size_t size)
+{
+    size_t slot_size = CEIL(size, POOL_CLASS_GRAN);
+    list_t *list = &partial[slot_size / POOL_CLASS_GRAN - 1];
+
+    if (list_is_empty(list))
+    {
+        pool_page_t *pp;
+        list_node_t *n = list_pop_head(&spare);
+        if (n)
+            pp = LIST_GET_CONTAINER(n, pool_page_t, list_node);
+        else
+        {
+            page_t *page = pm_alloc(0);
+            if (!page)
+                return NULL;
+            pp = (pool_page_t *)(page->addr + HHDM);
+            stats.pool_pages++;
+        }
+
+        *pp = (pool_page_t) {
+            .list_node = LIST_NODE_INIT,
+            .slot_size = slot_size,
+            .used = 0,
+            .freelist = NULL
+        };
+
+        size_t count = (ARCH_PAGE_GRAN - sizeof(pool_page_t)) / slot_size;
+        for (size_t i = 0; i < count; i++)
+        {
+            void **slot = (void **)((uintptr_t)pp + sizeof(pool_page_t) + i * slot_size);
+            *slot = pp->freelist;
+            pp->freelist = slot;
+        }
+
+        list_append(list, &pp->list_node);
+    }
+
+    pool_page_t *pp = LIST_GET_CONTAINER(LIST_FIRST(list), pool_page_t, list_node);
+
+    void **slot = pp->freelist;
+    pp->freelist = *slot;
+    pp->used++;
+
+    // Full pages aren't tracked until a slot frees up again.
+    if (!pp->freelist)
+        list_remove(list, &pp->list_node);
+
+    return slot;
+}
+
+static void slot_free(void *slot)
+{
+    pool_page_t *pp = (pool_page_t *)FLOOR((uintptr_t)slot, ARCH_PAGE_GRAN);
+    list_t *list = &partial[pp->slot_size / POOL_CLASS_GRAN - 1];
+
+    bool was_full = pp->freelist == NULL;
+    *(void **)slot = pp->freelist;
+    pp->freelist = slot;
+    pp->used--;
+
+    if (pp->used == 0)
+    {
+        if (!was_full)
+            list_remove(list, &pp->list_node);
+
+        if (spare.length < POOL_SPARE_PAGES)
+            list_append(&spare, &pp->list_node);
+        else
+        {
+            pm_free(pm_phys_to_page((uintptr_t)pp - HHDM));
+            stats.pool_pages--;
+        }
+    }
+    else if (was_full)
+        list_append(list, &pp->list_node);
+}
+
+static inline uint8_t *entry_to_slot(void *entry)
+{
+    return (uint8_t *)((uintptr_t)entry & ~VM_SWAP_ENTRY_TAG);
+}
+
+void *vm_swap_out(page_t *page)
+{
+    spinlock_acquire(&slock);
+
+    size_t len = lz4_compress((void *)(page->addr + HHDM), ARCH_PAGE_GRAN, buffer, POOL_MAX_STORED, &workmem);
+    if (len == 0)
+    {
+        stats.rejected++;
+        spinlock_release(&slock);
+        return NULL;
+    }
+
+    uint8_t *slot = slot_alloc(sizeof(uint16_t) + len);
+    if (!slot)
+    {
+        spinlock_release(&slock);
+        return NULL;
+    }
+
+    uint16_t stored_len = (uint16_t)len;
+    memcpy(slot, &stored_len, sizeof(uint16_t));
+    memcpy(slot + sizeof(uint16_t), buffer, len);
+
+    stats.stored_pages++;
+    stats.compressed_bytes += len;
+    stats.swapped_out++;
+
+    spinlock_release(&slock);
+    return (void *)((uintptr_t)slot | VM_SWAP_ENTRY_TAG);
+}
+
+page_t *vm_swap_in(void *entry)
+{
+    // Allocate before taking the pool lock, reclaim needs it.
+    page_t *page = vm_swap_alloc_page();
+    if (!page)
+        return NULL;
+
+    uint8_t *slot = entry_to_slot(entry);
+
+    spinlock_acquire(&slock);
+
+    uint16_t len;
+    memcpy(&len, slot, sizeof(uint16_t));
+    if (lz4_decompress(slot + sizeof(uint16_t), len, (void *)(page->addr + HHDM), ARCH_PAGE_GRAN) != ARCH_PAGE_GRAN)
+        panic("Corrupted swap entry %#lx!", (uintptr_t)entry);
+
+    stats.stored_pages--;
+    stats.compressed_bytes -= len;
+    stats.swapped_in++;
+    slot_free(slot);
+
+    spinlock_release(&slock);
+    return page;
+}
+
+void vm_swap_free(void *entry)
+{
+    uint8_t *slot = entry_to_slot(entry);
+
+    spinlock_acquire(&slock);
+
+    uint16_t len;
+    memcpy(&len, slot, sizeof(uint16_t));
+
+    stats.stored_pages--;
+    stats.compressed_bytes -= len;
+    slot_free(slot);
+
+    spinlock_release(&slock);
+}
+
+/*
+ * Reclaim
+ */
+
+typedef struct
+{
+    size_t target;
+    size_t freed;
+    uint8_t cold_age;
+    bool direct; // Called from an allocation, possibly with address space or object locks held.
+}
+reclaim_t;
+
+static bool reclaim_lock(spinlock_t *lock, bool direct)
+{
+    if (direct)
+        return spinlock_try_acquire(lock);
+
+    spinlock_acquire(lock);
+    return true;
+}
+
+static void scan_segment(vm_addrspace_t *as, vm_segment_t *seg, reclaim_t *rc)
+{
+    vm_object_t *obj = seg->object;
+
+    for (uintptr_t vaddr = seg->start; vaddr < seg->start + seg->length; vaddr += ARCH_PAGE_GRAN)
+    {
+        if (rc->direct && rc->freed >= rc->target)
+            return;
+
+        // Huge pages stay resident as a whole.
+        size_t size = arch_paging_get_page_size(as->page_map, vaddr);
+        if (size != ARCH_PAGE_GRAN)
+        {
+            if (size)
+                vaddr = FLOOR(vaddr, size) + size - ARCH_PAGE_GRAN;
+            continue;
+        }
+
+        uintptr_t phys;
+        arch_paging_vaddr_to_paddr(as->page_map, vaddr, &phys);
+        size_t pgidx = ((vaddr - seg->start) / ARCH_PAGE_GRAN) + seg->offset;
+
+        if (!reclaim_lock(&obj->slock, rc->direct))
+            return;
+
+        // Only pages held by the segment's own object alone; shadowed and merged pages are skipped.
+        page_t *page = vm_object_lookup_page(obj, pgidx);
+        if (page && page->addr == phys && !page->ksm)
+        {
+            if (vm_rmap_referenced(obj, pgidx, page, as))
+                page->age = 0;
+            else if (page->age < UINT8_MAX)
+                page->age++;
+
+            if (rc->freed < rc->target && page->age >= rc->cold_age
+            &&  vm_rmap_unmap(obj, pgidx, page, as))
+            {
+                if (vm_object_swap_out(obj, pgidx))
+                    rc->freed++;
+                else
+                    page->age = 0; // Don't retry an incompressible page on every scan.
+            }
+        }
+
+        spinlock_release(&obj->slock);
+    }
+}
+
+static void scan_addrspace(vm_addrspace_t *as, reclaim_t *rc)
+{
+    if (!reclaim_lock(&as->slock, rc->direct))
+        return;
+
+    FOREACH(n, as->segments)
+    {
+        vm_segment_t *seg = LIST_GET_CONTAINER(n, vm_segment_t, list_node);
+        vm_object_t *obj = seg->object;
+
+        if (!obj || (obj->type != VM_OBJ_ANON && obj->type != VM_OBJ_SHADOW))
+            continue;
+
+        scan_segment(as, seg, rc);
+    }
+
+    spinlock_release(&as->slock);
+}
+
+/**
+ * Ages every page in user address spaces and swaps out up to `target` pages
+ * that are at least `cold_age` scans old.
+ */
+static size_t reclaim(size_t target, uint8_t cold_age, bool direct)
+{
+    reclaim_t rc = {
+        .target = target,
+        .freed = 0,
+        .cold_age = cold_age,
+        .direct = direct
+    };
+
+    if (!reclaim_lock(&vm_addrspace_list_slock, direct))
+        return 0;
+
+    FOREACH(n, vm_addrspace_list)
+    {
+        vm_addrspace_t *as = LIST_GET_CONTAINER(n, vm_addrspace_t, list_node);
+        if (as != vm_kernel_as)
+            scan_addrspace(as, &rc);
+
+        if (direct && rc.freed >= target)
+            break;
+    }
+
+    spinlock_release(&vm_addrspace_list_slock);
+    return rc.freed;
+}
+
+page_t *vm_swap_alloc_page()
+{
+    page_t *page = pm_alloc(0);
+
+    if (!page && shrinker_run(DIRECT_RECLAIM_PAGES, true))
+        page = pm_alloc(0);
+
+    // Prefer pages that have been idle for a while, but take any before failing.
+    for (int cold_age = COLD_AGE; !page && cold_age >= 0; cold_age--)
+        if (reclaim(DIRECT_RECLAIM_PAGES, cold_age, true))
+            page = pm_alloc(0);
+
+    return page;
+}
+
+static void swap_main()
+{
+    while (true)
+    {
+        size_t free = pm_get_free_pages();
+        size_t target = free < low_watermark ? high_watermark - free : 0;
+
+        // Caches go first, the rest is made up by compressing cold pages.
+        size_t dropped = shrinker_run(target, false);
+        target -= MIN(dropped, target);
+
+        size_t freed = reclaim(target, COLD_AGE, false);
+        // Still short: fall back on anything not used since the last scan.
+        if (freed < target)
+            freed += reclaim(target - freed, 1, false);
+
+        if (freed)
+        {
+            vm_swap_stats_t s;
+            vm_swap_get_stats(&s);
+            log(LOG_DEBUG, "Swapped out %lu pages, %lu stored in %lu pool pages (%lu.%02lux).",
+                freed, s.stored_pages, s.pool_pages,
+                s.pool_pages ? s.stored_pages / s.pool_pages : 0,
+                s.pool_pages ? s.stored_pages * 100 / s.pool_pages % 100 : 0);
+        }
+
+        sched_sleep(SCAN_INTERVAL_NS);
+    }
+}
+
+static void wake()
+{
+    sched_wake(swap_thread);
+}
+
+// Counters
+
+void vm_swap_get_stats(vm_swap_stats_t *out)
+{
+    spinlock_acquire(&slock);
+    *out = stats;
+    spinlock_release(&slock);
+}
+
+// Initialization
+
+void vm_swap_init()
+{
+    for (size_t i = 0; i < POOL_CLASSES; i++)
+        partial[i] = LIST_INIT;
+
+    for (size_t i = 0; i < POOL_SPARE_PAGES; i++)
+    {
+        page_t *page = pm_alloc(0);
+        if (!page)
+            panic("Could not allocate the compressed swap pool!");
+
+        pool_page_t *pp = (pool_page_t *)(page->addr + HHDM);
+        pp->list_node = LIST_NODE_INIT;
+        list_append(&spare, &pp->list_node);
+        stats.pool_pages++;
+    }
+
+    size_t total = pm_get_total_pages();
+    low_watermark = total / 64;
+    high_watermark = total / 32;
+
+    proc_t *swap_proc;
+
+    if (proc_create_kernel("Swap", &swap_proc) != EOK)
+        panic("Could not initialize the swap daemon!");
+
+    if (thread_create_kernel(swap_proc->as, (uintptr_t)&swap_main, 4096, &swap_thread) != EOK)
+        panic("Could not initialize the swap daemon!");
+    swap_thread->owner = swap_proc;
+    list_append(&swap_proc->threads, &swap_thread->proc_thread_list_node);
+
+    sched_enqueue(swap_thread);
+
+    pm_set_low_watermark(low_watermark, wake);
+
+    log(LOG_INFO, "Compressed swap initialized.");
+}
@@ -0,0 +1,213 @@
+#include "mm/vm/vm_thp.h"
+
+#include "hhdm.h"
+#include "log.h"
+#include "mm/pm.h"
+#include "mm/vm/vm_object.h"
+#include "panic.h"
+#include "sys/proc.h"
+#include "sys/sched.h"
+#include "sys/thread.h"
+#include "uapi/errno.h"
+#include "utils/list.h"
+#include "utils/math.h"
+
+#define COLLAPSE_INTERVAL_NS (1000ull * 1000 * 1000)
+
+/*
+ * Fault handling
+ */
+
+bool vm_thp_fault(vm_addrspace_t *as, vm_segment_t *seg, uintptr_t vaddr, vm_fault_type_t type)
+{
+    vm_object_t *obj = seg->object;
+    if (as == vm_kernel_as || !obj || !obj->ops->get_huge_page)
+        return false;
+
+    // The whole huge page must lie inside the segment and be aligned in the object too.
+    uintptr_t base = FLOOR(vaddr, VM_THP_SIZE);
+    if (base < seg->start || base + VM_THP_SIZE > seg->start + seg->length)
+        return false;
+
+    size_t pgidx = ((base - seg->start) / ARCH_PAGE_GRAN) + seg->offset;
+    if (pgidx % VM_THP_PAGES != 0)
+        return false;
+
+    page_t *page;
+    if (!obj->ops->get_huge_page(obj, pgidx, &page))
+        return false;
+
+    vm_protection_t prot = seg->prot;
+    if (type != VM_FAULT_WRITE)
+        prot &= ~VM_PROTECTION_WRITE;
+
+    return arch_paging_map_page(as->page_map, base, page->addr, VM_THP_SIZE, prot, VM_CACHE_STANDARD) == 0;
+}
+
+int vm_thp_split(vm_addrspace_t *as, uintptr_t vaddr)
+{
+    if (arch_paging_get_page_size(as->page_map, vaddr) != VM_THP_SIZE)
+        return EOK;
+
+    if (arch_paging_split_page(as->page_map, vaddr) != 0)
+        return ENOMEM;
+    return EOK;
+}
+
+/*
+ * Collapse daemon
+ */
+
+static page_t *old_pages[VM_THP_PAGES]; // Only ever used by the daemon's thread.
+
+/**
+ * Replaces the 4KiB mappings of a fully populated huge page range with a
+ * single huge mapping. The range's pages are moved into a contiguous block
+ * first if they aren't already laid out like one. The copy runs with no
+ * spinlock held and the range unmapped, so it can't be written to meanwhile,
+ * and is given up on if a fault brought any of it back in.
+ */
+static bool collapse(vm_addrspace_t *as, vm_segment_t *seg, uintptr_t base)
+{
+    vm_object_t *obj = seg->object;
+    size_t pgidx = ((base - seg->start) / ARCH_PAGE_GRAN) + seg->offset;
+
+    spinlock_acquire(&as->slock);
+    spinlock_acquire(&obj->slock);
+
+    bool contiguous = true;
+    for (size_t i = 0; i < VM_THP_PAGES; i++)
+    {
+        // Merged pages can't be mapped writable.
+        page_t *page = vm_object_lookup_page(obj, pgidx + i);
+        if (!page || page->ksm
+        ||  arch_paging_get_page_size(as->page_map, base + i * ARCH_PAGE_GRAN) != ARCH_PAGE_GRAN)
+            goto skip;
+
+        old_pages[i] = page;
+        if (page->addr != old_pages[0]->addr + i * ARCH_PAGE_GRAN)
+            contiguous = false;
+    }
+    if (old_pages[0]->addr % VM_THP_SIZE != 0)
+        contiguous = false;
+
+    for (size_t i = 0; i < VM_THP_PAGES; i++)
+        arch_paging_unmap_page(as->page_map, base + i * ARCH_PAGE_GRAN);
+
+    page_t *huge = old_pages[0];
+    if (!contiguous)
+    {
+        spinlock_release(&obj->slock);
+        spinlock_release(&as->slock);
+
+        // Pages left unmapped on failure are faulted back in on access.
+        huge = pm_alloc(VM_THP_ORDER);
+        if (!huge)
+            return false;
+        pm_split(huge);
+
+        for (size_t i = 0; i < VM_THP_PAGES; i++)
+            memcpy((void *)(huge->addr + i * ARCH_PAGE_GRAN + HHDM), (void *)(old_pages[i]->addr + HHDM), ARCH_PAGE_GRAN);
+
+        spinlock_acquire(&as->slock);
+        spinlock_acquire(&obj->slock);
+
+        for (size_t i = 0; i < VM_THP_PAGES; i++)
+        {
+            if (vm_object_lookup_page(obj, pgidx + i) == old_pages[i] && !old_pages[i]->ksm
+            &&  arch_paging_get_page_size(as->page_map, base + i * ARCH_PAGE_GRAN) == 0)
+                continue;
+
+            spinlock_release(&obj->slock);
+            spinlock_release(&as->slock);
+
+            for (size_t j = 0; j < VM_THP_PAGES; j++)
+                pm_free(pm_phys_to_page(huge->addr + j * ARCH_PAGE_GRAN));
+            return false;
+        }
+
+        for (size_t i = 0; i < VM_THP_PAGES; i++)
+        {
+            vm_object_insert_page(obj, pm_phys_to_page(huge->addr + i * ARCH_PAGE_GRAN), pgidx + i);
+            pm_free(old_pages[i]);
+        }
+    }
+
+    // The object is private to this address space, so there is no copy-on-write to preserve.
+    arch_paging_map_page(as->page_map, base, huge->addr, VM_THP_SIZE, seg->prot, VM_CACHE_STANDARD);
+
+    spinlock_release(&obj->slock);
+    spinlock_release(&as->slock);
+    return true;
+
+skip:
+    spinlock_release(&obj->slock);
+    spinlock_release(&as->slock);
+    return false;
+}
+
+/**
+ * Holds the layout still rather than the spinlock, which is only taken a huge
+ * page at a time.
+ */
+static void scan_addrspace(vm_addrspace_t *as)
+{
+    mutex_acquire(&as->map_mutex);
+
+    FOREACH(n, as->segments)
+    {
+        vm_segment_t *seg = LIST_GET_CONTAINER(n, vm_segment_t, list_node);
+        vm_object_t *obj = seg->object;
+
+        // Only memory private to this address space can be remapped freely.
+        if (!obj || !obj->ops->get_huge_page || ref_read(&obj->refcount) != 1)
+            continue;
+
+        for (uintptr_t base = CEIL(seg->start, VM_THP_SIZE);
+             base + VM_THP_SIZE <= seg->start + seg->length;
+             base += VM_THP_SIZE)
+        {
+            size_t pgidx = ((base - seg->start) / ARCH_PAGE_GRAN) + seg->offset;
+            if (pgidx % VM_THP_PAGES != 0)
+                break;
+
+            if (arch_paging_get_page_size(as->page_map, base) == ARCH_PAGE_GRAN)
+                collapse(as, seg, base);
+        }
+    }
+
+    mutex_release(&as->map_mutex);
+}
+
+static void collapse_main()
+{
+    while (true)
+    {
+        // Scanning can sleep, so the address space is held on to rather than the list.
+        vm_addrspace_t *as = NULL;
+        while ((as = vm_addrspace_iter_next(as)))
+            scan_addrspace(as);
+
+        sched_sleep(COLLAPSE_INTERVAL_NS);
+    }
+}
+
+// Initialization
+
+void vm_thp_init()
+{
+    proc_t *collapse_proc;
+    thread_t *collapse_thread;
+
+    if (proc_create_kernel("THP Collapse", &collapse_proc) != EOK)
+        panic("Could not initialize the huge page collapse daemon!");
+
+    if (thread_create_kernel(collapse_proc->as, (uintptr_t)&collapse_main, 4096, &collapse_thread) != EOK)
+        panic("Could not initialize the huge page collapse daemon!");
+    collapse_thread->owner = collapse_proc;
+    list_append(&collapse_proc->threads, &collapse_thread->proc_thread_list_node);
+
+    sched_enqueue(collapse_thread);
+
+    log(LOG_INFO, "Transparent huge pages initialized.");
+}
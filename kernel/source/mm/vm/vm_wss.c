@@ -0,0 +1,217 @@
+#include "mm/vm/vm_wss.h"
+
+#include "arch/paging.h"
+#include "assert.h"
+#include "log.h"
+#include "mm/mm.h"
+#include "mm/pm.h"
+#include "mm/vm.h"
+#include "mm/vm/vm_object.h"
+#include "panic.h"
+#include "sys/proc.h"
+#include "sys/sched.h"
+#include "sys/thread.h"
+#include "uapi/errno.h"
+#include "utils/list.h"
+#include "utils/math.h"
+
+#define SCAN_INTERVAL_NS (1000ull * 1000 * 1000)
+#define SCAN_BATCH 64 // Pages looked at per locking of the address space.
+
+static uint8_t pass = 0; // Never 0 once scanning started, so that fresh pages and objects look unvisited.
+
+static size_t bucket(uint8_t age)
+{
+    size_t b = 0;
+    for (; age > 0 && b < VM_WSS_BUCKETS - 1; age >>= 1)
+        b++;
+    return b;
+}
+
+static bool is_scanned(vm_segment_t *seg)
+{
+    // Physical mappings may not be backed by page structures at all.
+    return seg->object && seg->object->type != VM_OBJ_PHYS;
+}
+
+/*
+ * Scanning
+ */
+
+static void scan_segment(vm_addrspace_t *as, vm_segment_t *seg, vm_wss_histogram_t *hist)
+{
+    vm_object_t *obj = seg->object;
+    uintptr_t seg_end = seg->start + seg->length;
+
+    for (uintptr_t vaddr = seg->start; vaddr < seg_end; )
+    {
+        spinlock_acquire(&as->slock);
+        spinlock_acquire(&obj->slock);
+
+        if (obj->wss_pass != pass)
+        {
+            obj->wss = (vm_wss_histogram_t) {};
+            obj->wss_pass = pass;
+        }
+
+        uintptr_t batch_end = vaddr + MIN(seg_end - vaddr, SCAN_BATCH * ARCH_PAGE_GRAN);
+        while (vaddr < batch_end)
+        {
+            size_t size = arch_paging_get_page_size(as->page_map, vaddr);
+            if (!size)
+            {
+                vaddr += ARCH_PAGE_GRAN;
+                continue;
+            }
+
+            uintptr_t end = MIN(FLOOR(vaddr, size) + size, seg_end);
+            size_t count = (end - vaddr) / ARCH_PAGE_GRAN;
+
+            // Huge pages are aged as a whole, through their first page.
+            uintptr_t phys;
+            arch_paging_vaddr_to_paddr(as->page_map, vaddr, &phys);
+            page_t *page = pm_phys_to_page(FLOOR(phys, size));
+
+            // A page mapped more than once only ages once per pass, but any of its mappings makes it young again.
+            bool first = page->wss_pass != pass;
+            if (arch_paging_test_and_clear_accessed(as->page_map, vaddr))
+                page->age = 0;
+            else if (first && page->age < UINT8_MAX)
+                page->age++;
+            page->wss_pass = pass;
+
+            size_t b = bucket(page->age);
+            bool dirty = arch_paging_is_dirty(as->page_map, vaddr);
+
+            hist->pages[b] += count;
+            if (dirty)
+                hist->dirty += count;
+
+            if (first)
+            {
+                obj->wss.pages[b] += count;
+                if (dirty)
+                    obj->wss.dirty += count;
+            }
+
+            vaddr = end;
+        }
+
+        spinlock_release(&obj->slock);
+        spinlock_release(&as->slock);
+    }
+}
+
+/**
+ * Holds the layout still rather than the spinlock, which is only taken a batch
+ * of pages at a time.
+ */
+static void scan_addrspace(vm_addrspace_t *as)
+{
+    vm_wss_histogram_t hist = {};
+
+    mutex_acquire(&as->map_mutex);
+
+    FOREACH(n, as->segments)
+    {
+        vm_segment_t *seg = LIST_GET_CONTAINER(n, vm_segment_t, list_node);
+        if (is_scanned(seg))
+            scan_segment(as, seg, &hist);
+    }
+
+    spinlock_acquire(&as->slock);
+    as->wss = hist;
+    spinlock_release(&as->slock);
+
+    mutex_release(&as->map_mutex);
+}
+
+static void wss_main()
+{
+    while (true)
+    {
+        if (++pass == 0)
+            pass = 1;
+
+        // Scanning can sleep, so the address space is held on to rather than the list.
+        vm_addrspace_t *as = NULL;
+        while ((as = vm_addrspace_iter_next(as)))
+            scan_addrspace(as);
+
+        sched_sleep(SCAN_INTERVAL_NS);
+    }
+}
+
+// Counters
+
+void vm_wss_get_addrspace(vm_addrspace_t *as, vm_wss_histogram_t *out)
+{
+    spinlock_acquire(&as->slock);
+    *out = as->wss;
+    spinlock_release(&as->slock);
+}
+
+void vm_wss_get_object(vm_object_t *obj, vm_wss_histogram_t *out)
+{
+    spinlock_acquire(&obj->slock);
+    *out = obj->wss;
+    spinlock_release(&obj->slock);
+}
+
+// Idle page tracking
+
+size_t vm_wss_get_idle(vm_addrspace_t *as, uintptr_t vaddr, size_t length, uint8_t min_age, uint64_t *bitmap)
+{
+    ASSERT(vaddr % ARCH_PAGE_GRAN == 0);
+
+    size_t pages = CEIL(length, ARCH_PAGE_GRAN) / ARCH_PAGE_GRAN;
+    memset(bitmap, 0, CEIL(pages, 64) / 64 * sizeof(uint64_t));
+
+    size_t idle = 0;
+    FOREACH(n, as->segments)
+    {
+        vm_segment_t *seg = LIST_GET_CONTAINER(n, vm_segment_t, list_node);
+        if (!is_scanned(seg))
+            continue;
+
+        uintptr_t start = MAX(seg->start, vaddr);
+        uintptr_t end = MIN(seg->start + seg->length, vaddr + pages * ARCH_PAGE_GRAN);
+
+        for (uintptr_t addr = start; addr < end; addr += ARCH_PAGE_GRAN)
+        {
+            uintptr_t phys;
+            if (!arch_paging_vaddr_to_paddr(as->page_map, addr, &phys))
+                continue;
+
+            size_t size = arch_paging_get_page_size(as->page_map, addr);
+            if (pm_phys_to_page(FLOOR(phys, size))->age < min_age)
+                continue;
+
+            size_t i = (addr - vaddr) / ARCH_PAGE_GRAN;
+            bitmap[i / 64] |= 1ull << (i % 64);
+            idle++;
+        }
+    }
+
+    return idle;
+}
+
+// Initialization
+
+void vm_wss_init()
+{
+    proc_t *wss_proc;
+    thread_t *wss_thread;
+
+    if (proc_create_kernel("WSS", &wss_proc) != EOK)
+        panic("Could not initialize the working-set scanner!");
+
+    if (thread_create_kernel(wss_proc->as, (uintptr_t)&wss_main, 4096, &wss_thread) != EOK)
+        panic("Could not initialize the working-set scanner!");
+    wss_thread->owner = wss_proc;
+    list_append(&wss_proc->threads, &wss_thread->proc_thread_list_node);
+
+    sched_enqueue(wss_thread);
+
+    log(LOG_INFO, "Working-set scanner initialized.");
+}
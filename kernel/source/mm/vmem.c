@@ -0,0 +1,319 @@
+#include "mm/vmem.h"
+
+#include "assert.h"
+#include "mm/heap.h"
+#include "sys/percpu.h"
+#include "sys/sched.h"
+#include "utils/math.h"
+
+static inline size_t floor_log2(size_t size)
+{
+    return 63 - __builtin_clzll(size);
+}
+
+/*
+ * Free lists and hash table
+ */
+
+static void freelist_insert(vmem_t *vmem, vmem_seg_t *seg)
+{
+    list_append(&vmem->freelists[floor_log2(seg->size)], &seg->list_node);
+}
+
+static void freelist_remove(vmem_t *vmem, vmem_seg_t *seg)
+{
+    list_remove(&vmem->freelists[floor_log2(seg->size)], &seg->list_node);
+}
+
+static list_t *hash_bucket(vmem_t *vmem, uintptr_t addr)
+{
+    return &vmem->hash[(addr / vmem->quantum) % VMEM_HASH_BUCKETS];
+}
+
+/*
+ * Arena
+ */
+
+static vmem_seg_t *find_free(vmem_t *vmem, size_t size)
+{
+    // Every range on list `i` is at least 2^i bytes long, so the first tag of
+    // any list at or above the rounded up order fits without searching.
+    size_t order = floor_log2(size);
+    size_t first = (size & (size - 1)) ? order + 1 : order;
+
+    for (size_t i = first; i < VMEM_FREELISTS; i++)
+        if (!list_is_empty(&vmem->freelists[i]))
+            return LIST_GET_CONTAINER(LIST_FIRST(&vmem->freelists[i]), vmem_seg_t, list_node);
+
+    // Only the list below can still hold a fit when size isn't a power of two.
+    if (first != order)
+        FOREACH(n, vmem->freelists[order])
+        {
+            vmem_seg_t *seg = LIST_GET_CONTAINER(n, vmem_seg_t, list_node);
+            if (seg->size >= size)
+                return seg;
+        }
+
+    return NULL;
+}
+
+static uintptr_t arena_alloc(vmem_t *vmem, size_t size)
+{
+    vmem_seg_t *seg = find_free(vmem, size);
+    if (!seg)
+        return 0;
+
+    freelist_remove(vmem, seg);
+
+    if (seg->size > size)
+    {
+        vmem_seg_t *rest = heap_alloc(sizeof(vmem_seg_t));
+        if (!rest)
+        {
+            freelist_insert(vmem, seg);
+            return 0;
+        }
+        *rest = (vmem_seg_t) {
+            .base = seg->base + size,
+            .size = seg->size - size,
+            .type = VMEM_SEG_FREE,
+            .seg_node = LIST_NODE_INIT,
+            .list_node = LIST_NODE_INIT
+        };
+        list_insert_after(&vmem->segs, &seg->seg_node, &rest->seg_node);
+        freelist_insert(vmem, rest);
+
+        seg->size = size;
+    }
+
+    seg->type = VMEM_SEG_ALLOC;
+    list_append(hash_bucket(vmem, seg->base), &seg->list_node);
+    vmem->in_use += size;
+
+    return seg->base;
+}
+
+static void arena_free(vmem_t *vmem, uintptr_t addr, size_t size)
+{
+    list_t *bucket = hash_bucket(vmem, addr);
+
+    vmem_seg_t *seg = NULL;
+    FOREACH(n, (*bucket))
+    {
+        vmem_seg_t *i = LIST_GET_CONTAINER(n, vmem_seg_t, list_node);
+        if (i->base == addr)
+        {
+            seg = i;
+            break;
+        }
+    }
+    ASSERT(seg && seg->size == size);
+
+    list_remove(bucket, &seg->list_node);
+    vmem->in_use -= size;
+    seg->type = VMEM_SEG_FREE;
+
+    // Merge with free neighbours. A span always starts with its span tag, so
+    // ranges from different spans are never merged.
+    list_node_t *next = seg->seg_node.next;
+    if (next)
+    {
+        vmem_seg_t *n = LIST_GET_CONTAINER(next, vmem_seg_t, seg_node);
+        if (n->type == VMEM_SEG_FREE)
+        {
+            freelist_remove(vmem, n);
+            list_remove(&vmem->segs, &n->seg_node);
+            seg->size += n->size;
+            heap_free(n);
+        }
+    }
+
+    list_node_t *prev = seg->seg_node.prev;
+    if (prev)
+    {
+        vmem_seg_t *p = LIST_GET_CONTAINER(prev, vmem_seg_t, seg_node);
+        if (p->type == VMEM_SEG_FREE)
+        {
+            freelist_remove(vmem, p);
+            list_remove(&vmem->segs, &seg->seg_node);
+            p->size += seg->size;
+            heap_free(seg);
+            seg = p;
+        }
+    }
+
+    freelist_insert(vmem, seg);
+}
+
+/*
+ * Quantum caches
+ */
+
+static vmem_magazine_t *qcache_magazine(vmem_t *vmem, size_t size)
+{
+    // Being moved to another CPU afterwards only means using a magazine of that one, under its lock all the same.
+    vmem_magazine_t *mags = percpu_ptr(vmem->qcache, sched_get_curr_cpuid());
+    return &mags[size / vmem->quantum - 1];
+}
+
+static uintptr_t qcache_alloc(vmem_t *vmem, size_t size)
+{
+    vmem_magazine_t *mag = qcache_magazine(vmem, size);
+    spinlock_acquire(&mag->slock);
+
+    // Only fill half the magazine so that the frees that follow have room too.
+    if (mag->count == 0)
+    {
+        spinlock_acquire(&vmem->slock);
+        while (mag->count < VMEM_MAG_SIZE / 2)
+        {
+            uintptr_t addr = arena_alloc(vmem, size);
+            if (!addr)
+                break;
+            mag->ranges[mag->count++] = addr;
+        }
+        spinlock_release(&vmem->slock);
+    }
+
+    uintptr_t addr = mag->count ? mag->ranges[--mag->count] : 0;
+
+    spinlock_release(&mag->slock);
+    return addr;
+}
+
+static void qcache_free(vmem_t *vmem, uintptr_t addr, size_t size)
+{
+    vmem_magazine_t *mag = qcache_magazine(vmem, size);
+    spinlock_acquire(&mag->slock);
+
+    if (mag->count == VMEM_MAG_SIZE)
+    {
+        spinlock_acquire(&vmem->slock);
+        while (mag->count > VMEM_MAG_SIZE / 2)
+            arena_free(vmem, mag->ranges[--mag->count], size);
+        spinlock_release(&vmem->slock);
+    }
+
+    mag->ranges[mag->count++] = addr;
+
+    spinlock_release(&mag->slock);
+}
+
+/*
+ * Public API
+ */
+
+uintptr_t vmem_alloc(vmem_t *vmem, size_t size)
+{
+    size = CEIL(size, vmem->quantum);
+    if (size == 0)
+        return 0;
+
+    if (size <= VMEM_QCACHE_MAX * vmem->quantum)
+        return qcache_alloc(vmem, size);
+
+    spinlock_acquire(&vmem->slock);
+    uintptr_t addr = arena_alloc(vmem, size);
+    spinlock_release(&vmem->slock);
+
+    return addr;
+}
+
+void vmem_free(vmem_t *vmem, uintptr_t addr, size_t size)
+{
+    size = CEIL(size, vmem->quantum);
+    ASSERT(addr % vmem->quantum == 0 && size > 0);
+
+    if (size <= VMEM_QCACHE_MAX * vmem->quantum)
+    {
+        qcache_free(vmem, addr, size);
+        return;
+    }
+
+    spinlock_acquire(&vmem->slock);
+    arena_free(vmem, addr, size);
+    spinlock_release(&vmem->slock);
+}
+
+bool vmem_add(vmem_t *vmem, uintptr_t base, size_t size)
+{
+    ASSERT(base != 0 && base % vmem->quantum == 0);
+    ASSERT(size != 0 && size % vmem->quantum == 0);
+
+    vmem_seg_t *span = heap_alloc(sizeof(vmem_seg_t));
+    vmem_seg_t *free = heap_alloc(sizeof(vmem_seg_t));
+    if (!span || !free)
+    {
+        if (span)
+            heap_free(span);
+        if (free)
+            heap_free(free);
+        return false;
+    }
+
+    *span = (vmem_seg_t) {
+        .base = base,
+        .size = size,
+        .type = VMEM_SEG_SPAN,
+        .seg_node = LIST_NODE_INIT,
+        .list_node = LIST_NODE_INIT
+    };
+    *free = (vmem_seg_t) {
+        .base = base,
+        .size = size,
+        .type = VMEM_SEG_FREE,
+        .seg_node = LIST_NODE_INIT,
+        .list_node = LIST_NODE_INIT
+    };
+
+    spinlock_acquire(&vmem->slock);
+
+    // Keep tags in address order: the new span goes before the first tag past it.
+    list_node_t *pos = NULL;
+    FOREACH(n, vmem->segs)
+    {
+        vmem_seg_t *i = LIST_GET_CONTAINER(n, vmem_seg_t, seg_node);
+        ASSERT(i->base + i->size <= base || i->base >= base + size);
+        if (i->base >= base + size)
+        {
+            pos = n;
+            break;
+        }
+    }
+
+    if (pos)
+        list_insert_before(&vmem->segs, pos, &span->seg_node);
+    else
+        list_append(&vmem->segs, &span->seg_node);
+    list_insert_after(&vmem->segs, &span->seg_node, &free->seg_node);
+    freelist_insert(vmem, free);
+
+    spinlock_release(&vmem->slock);
+    return true;
+}
+
+void vmem_init(vmem_t *vmem, const char *name, size_t quantum)
+{
+    ASSERT(quantum != 0 && (quantum & (quantum - 1)) == 0);
+
+    vmem->name = name;
+    vmem->quantum = quantum;
+    vmem->segs = LIST_INIT;
+    for (size_t i = 0; i < VMEM_FREELISTS; i++)
+        vmem->freelists[i] = LIST_INIT;
+    for (size_t i = 0; i < VMEM_HASH_BUCKETS; i++)
+        vmem->hash[i] = LIST_INIT;
+    vmem->in_use = 0;
+    vmem->slock = SPINLOCK_INIT;
+
+    vmem->qcache = percpu_alloc(VMEM_QCACHE_MAX * sizeof(vmem_magazine_t));
+    for (size_t i = 0; i < percpu_cpu_count; i++)
+    {
+        vmem_magazine_t *mags = percpu_ptr(vmem->qcache, i);
+        for (size_t j = 0; j < VMEM_QCACHE_MAX; j++)
+            mags[j] = (vmem_magazine_t) {
+                .count = 0,
+                .slock = SPINLOCK_INIT
+            };
+    }
+}
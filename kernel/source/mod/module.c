@@ -80,16 +80,9 @@ int module_load(vnode_t *file, module_t **out)
 
         if (section->sh_type == SHT_PROGBITS)
         {
-            uint64_t size = CEIL(section->sh_size, ARCH_PAGE_GRAN);
-            uintptr_t mem;
-            vm_map(
-                vm_kernel_as,
-                0, size,
-                VM_PROTECTION_FULL,
-                VM_MAP_ANON | VM_MAP_POPULATE,
-                NULL, 0,
-                &mem
-            );
+            uintptr_t mem = (uintptr_t)vm_alloc_prot(section->sh_size, VM_PROTECTION_FULL);
+            if (!mem)
+                return ENOMEM;
             if (vfs_read(file, (void *)mem, section->sh_offset, section->sh_size, &count) != EOK
             ||  count != section->sh_size)
             {
@@ -100,16 +93,9 @@ int module_load(vnode_t *file, module_t **out)
         }
         else if (section->sh_type == SHT_NOBITS) // Global data.
         {
-            uint64_t size = CEIL(section->sh_size, ARCH_PAGE_GRAN);
-            uintptr_t mem;
-            vm_map(
-                vm_kernel_as,
-                0, size,
-                VM_PROTECTION_FULL,
-                VM_MAP_ANON | VM_MAP_POPULATE,
-                NULL, 0,
-                &mem
-            );
+            uintptr_t mem = (uintptr_t)vm_alloc_prot(section->sh_size, VM_PROTECTION_FULL);
+            if (!mem)
+                return ENOMEM;
 
             section_addr[i] = mem;
         }
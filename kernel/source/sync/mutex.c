@@ -0,0 +1,77 @@
+#include "sync/mutex.h"
+
+#include "arch/lcpu.h"
+#include "sys/sched.h"
+#include "sys/thread.h"
+
+#define SPIN_LIMIT 1000
+
+static bool try_lock(mutex_t *mutex)
+{
+    uint8_t expected = 0;
+    if (!__atomic_compare_exchange_n(&mutex->locked, &expected, 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return false;
+
+    __atomic_store_n(&mutex->owner, sched_get_curr_thread(), __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * Spins on the mutex for as long as its owner is running, up to a limit.
+ * Thread structures outlive the mutexes their threads hold by far, so a stale
+ * owner only ever makes for a wrong guess.
+ */
+static bool spin(mutex_t *mutex)
+{
+    for (size_t i = 0; i < SPIN_LIMIT; i++)
+    {
+        if (!__atomic_load_n(&mutex->locked, __ATOMIC_RELAXED))
+        {
+            if (try_lock(mutex))
+                return true;
+            continue;
+        }
+
+        thread_t *owner = __atomic_load_n(&mutex->owner, __ATOMIC_RELAXED);
+        if (owner && __atomic_load_n(&owner->status, __ATOMIC_RELAXED) != THREAD_STATUS_RUNNING)
+            return false;
+
+        arch_lcpu_relax();
+    }
+
+    return false;
+}
+
+void mutex_acquire(mutex_t *mutex)
+{
+    if (try_lock(mutex) || spin(mutex))
+        return;
+
+    spinlock_acquire(&mutex->slock);
+
+    // Counted before the last attempt at the lock, so that whoever lets go of it either leaves it to that attempt or sees the waiter.
+    __atomic_add_fetch(&mutex->waiters, 1, __ATOMIC_SEQ_CST);
+    WAITQUEUE_WAIT_EVENT(&mutex->wq, &mutex->slock, try_lock(mutex), WAITQUEUE_FOREVER);
+    __atomic_sub_fetch(&mutex->waiters, 1, __ATOMIC_RELAXED);
+
+    spinlock_release(&mutex->slock);
+}
+
+bool mutex_try_acquire(mutex_t *mutex)
+{
+    return try_lock(mutex);
+}
+
+void mutex_release(mutex_t *mutex)
+{
+    __atomic_store_n(&mutex->owner, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&mutex->locked, 0, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&mutex->waiters, __ATOMIC_SEQ_CST))
+    {
+        // Waiters only let go of the lock once queued up.
+        spinlock_acquire(&mutex->slock);
+        waitqueue_wake_one(&mutex->wq);
+        spinlock_release(&mutex->slock);
+    }
+}
@@ -0,0 +1,167 @@
+#include "sync/rcu.h"
+
+#include "arch/lcpu.h"
+#include "assert.h"
+#include "log.h"
+#include "panic.h"
+#include "sync/spinlock.h"
+#include "sync/waitqueue.h"
+#include "sys/percpu.h"
+#include "sys/proc.h"
+#include "sys/sched.h"
+#include "sys/thread.h"
+#include "uapi/errno.h"
+
+#define POLL_INTERVAL_NS (1000ull * 1000)
+
+typedef struct
+{
+    uint64_t qs_seq; // Latest grace period this CPU went through a quiescent state in.
+    bool online;     // CPUs that aren't running the scheduler yet are never in a read section.
+
+    size_t nesting;
+    bool prev_int_state;
+}
+rcu_cpu_t;
+
+static PERCPU_DEFINE(rcu_cpu_t, rcu_cpu);
+
+static uint64_t gp_seq = 0; // Latest grace period started.
+
+static list_t callbacks = LIST_INIT;
+static spinlock_t slock = SPINLOCK_INIT;
+static waitqueue_t wq = WAITQUEUE_INIT;
+
+/*
+ * Readers
+ */
+
+void rcu_read_lock()
+{
+    bool int_state = arch_lcpu_int_enabled();
+    arch_lcpu_int_mask();
+
+    rcu_cpu_t *rc = THIS_CPU_PTR(rcu_cpu);
+    if (rc->nesting++ == 0)
+        rc->prev_int_state = int_state;
+}
+
+void rcu_read_unlock()
+{
+    rcu_cpu_t *rc = THIS_CPU_PTR(rcu_cpu);
+    ASSERT(rc->nesting > 0);
+
+    if (--rc->nesting == 0 && rc->prev_int_state)
+        arch_lcpu_int_unmask();
+}
+
+/*
+ * Grace periods
+ */
+
+void rcu_quiescent()
+{
+    rcu_cpu_t *rc = THIS_CPU_PTR(rcu_cpu);
+    ASSERT(rc->nesting == 0); // Blocked or yielded in a read section.
+
+    // Whatever grace period started by now, this CPU can't be holding up.
+    __atomic_store_n(&rc->qs_seq, __atomic_load_n(&gp_seq, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+void synchronize_rcu()
+{
+    // Readers that start after this can't find what was taken out before.
+    uint64_t gp = __atomic_add_fetch(&gp_seq, 1, __ATOMIC_SEQ_CST);
+
+    while (true)
+    {
+        bool done = true;
+        for (size_t i = 0; i < percpu_cpu_count; i++)
+        {
+            rcu_cpu_t *rc = PERCPU_PTR(rcu_cpu, i);
+            if (!__atomic_load_n(&rc->online, __ATOMIC_ACQUIRE)
+            ||  __atomic_load_n(&rc->qs_seq, __ATOMIC_SEQ_CST) >= gp)
+                continue;
+
+            done = false;
+
+            // An idle CPU only goes through the scheduler again once something wakes it up.
+            if (i != sched_get_curr_cpuid())
+                arch_lcpu_resched(i);
+        }
+
+        if (done)
+            return;
+
+        // Sleeping also gets the calling CPU through the scheduler.
+        sched_sleep(POLL_INTERVAL_NS);
+    }
+}
+
+/*
+ * Callbacks
+ */
+
+void call_rcu(rcu_head_t *head, void (*func)(rcu_head_t *head))
+{
+    head->func = func;
+    head->list_node = LIST_NODE_INIT;
+
+    spinlock_acquire(&slock);
+    list_append(&callbacks, &head->list_node);
+    spinlock_release(&slock);
+
+    waitqueue_wake_one(&wq);
+}
+
+static void rcu_main()
+{
+    while (true)
+    {
+        spinlock_acquire(&slock);
+        WAITQUEUE_WAIT_EVENT(&wq, &slock, !list_is_empty(&callbacks), WAITQUEUE_FOREVER);
+
+        // Everything queued up to now is covered by the same grace period.
+        list_t batch = callbacks;
+        callbacks = LIST_INIT;
+
+        spinlock_release(&slock);
+
+        synchronize_rcu();
+
+        list_node_t *n;
+        while ((n = list_pop_head(&batch)))
+        {
+            rcu_head_t *head = LIST_GET_CONTAINER(n, rcu_head_t, list_node);
+            head->func(head);
+        }
+    }
+}
+
+// Initialization
+
+void rcu_init_cpu()
+{
+    rcu_cpu_t *rc = PERCPU_PTR(rcu_cpu, sched_get_curr_cpuid());
+
+    rc->qs_seq = __atomic_load_n(&gp_seq, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&rc->online, true, __ATOMIC_RELEASE);
+}
+
+void rcu_init()
+{
+    proc_t *rcu_proc;
+    thread_t *rcu_thread;
+
+    if (proc_create_kernel("RCU", &rcu_proc) != EOK)
+        panic("Could not initialize RCU!");
+
+    if (thread_create_kernel(rcu_proc->as, (uintptr_t)&rcu_main, 4096, &rcu_thread) != EOK)
+        panic("Could not initialize RCU!");
+    rcu_thread->owner = rcu_proc;
+    list_append(&rcu_proc->threads, &rcu_thread->proc_thread_list_node);
+
+    sched_enqueue(rcu_thread);
+
+    log(LOG_INFO, "RCU initialized.");
+}
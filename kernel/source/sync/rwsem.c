@@ -0,0 +1,41 @@
+#include "sync/rwsem.h"
+
+void rwsem_acquire_read(rwsem_t *sem)
+{
+    spinlock_acquire(&sem->slock);
+    WAITQUEUE_WAIT_EVENT(&sem->readers_wq, &sem->slock, !sem->writer && !sem->writers_waiting, WAITQUEUE_FOREVER);
+    sem->readers++;
+    spinlock_release(&sem->slock);
+}
+
+void rwsem_release_read(rwsem_t *sem)
+{
+    spinlock_acquire(&sem->slock);
+    if (--sem->readers == 0 && sem->writers_waiting)
+        waitqueue_wake_one(&sem->writers_wq);
+    spinlock_release(&sem->slock);
+}
+
+void rwsem_acquire_write(rwsem_t *sem)
+{
+    spinlock_acquire(&sem->slock);
+    sem->writers_waiting++;
+    WAITQUEUE_WAIT_EVENT(&sem->writers_wq, &sem->slock, !sem->writer && sem->readers == 0, WAITQUEUE_FOREVER);
+    sem->writers_waiting--;
+    sem->writer = true;
+    spinlock_release(&sem->slock);
+}
+
+void rwsem_release_write(rwsem_t *sem)
+{
+    spinlock_acquire(&sem->slock);
+    sem->writer = false;
+
+    // Writers go first, the readers are let in once none is left waiting.
+    if (sem->writers_waiting)
+        waitqueue_wake_one(&sem->writers_wq);
+    else
+        waitqueue_wake_all(&sem->readers_wq);
+
+    spinlock_release(&sem->slock);
+}
@@ -0,0 +1,33 @@
+#include "sync/semaphore.h"
+
+int semaphore_down(semaphore_t *sem, uint64_t deadline)
+{
+    spinlock_acquire(&sem->slock);
+
+    int err = WAITQUEUE_WAIT_EVENT(&sem->wq, &sem->slock, sem->count > 0, deadline);
+    if (err == EOK)
+        sem->count--;
+
+    spinlock_release(&sem->slock);
+    return err;
+}
+
+bool semaphore_try_down(semaphore_t *sem)
+{
+    spinlock_acquire(&sem->slock);
+
+    bool taken = sem->count > 0;
+    if (taken)
+        sem->count--;
+
+    spinlock_release(&sem->slock);
+    return taken;
+}
+
+void semaphore_up(semaphore_t *sem)
+{
+    spinlock_acquire(&sem->slock);
+    sem->count++;
+    waitqueue_wake_one(&sem->wq);
+    spinlock_release(&sem->slock);
+}
@@ -2,43 +2,118 @@
 
 #include "arch/lcpu.h"
 
-void spinlock_acquire(volatile spinlock_t *slock)
+#define LOCKED 1ul
+#define LOCKED_MASK 0xFFul
+
+/*
+ * Waiters queue up on nodes kept on their own stacks. A node is only needed
+ * until its owner gets the lock, so locks can nest arbitrarily deep and no
+ * per-CPU state has to be looked up first.
+ */
+
+typedef struct node
+{
+    struct node *next;
+    bool head; // Set by the predecessor once it got the lock.
+}
+node_t;
+
+// Nodes are kernel addresses, whose top byte is all ones and comes back through sign extension.
+static uintptr_t encode_tail(node_t *node)
 {
-    while (true)
+    return (uintptr_t)node << 8;
+}
+
+static node_t *decode_tail(uintptr_t word)
+{
+    return (node_t *)((intptr_t)(word & ~LOCKED_MASK) >> 8);
+}
+
+static bool try_lock(volatile spinlock_t *slock)
+{
+    uintptr_t expected = 0;
+    return __atomic_compare_exchange_n(&slock->word, &expected, LOCKED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void lock_queued(volatile spinlock_t *slock)
+{
+    node_t node = { .next = NULL, .head = false };
+
+    // Become the tail, keeping the lock byte as it is.
+    uintptr_t old = __atomic_load_n(&slock->word, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&slock->word, &old, encode_tail(&node) | (old & LOCKED_MASK), false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        ;
+
+    node_t *prev = decode_tail(old);
+    if (prev)
     {
-        if (!__atomic_test_and_set(&slock->lock, __ATOMIC_ACQUIRE))
-        {
-            slock->prev_int_state = arch_lcpu_int_enabled();
-                arch_lcpu_int_mask();
-            return;
-        }
-
-        while (__atomic_load_n(&slock->lock, __ATOMIC_RELAXED))
+        __atomic_store_n(&prev->next, &node, __ATOMIC_RELEASE);
+        while (!__atomic_load_n(&node.head, __ATOMIC_ACQUIRE))
             arch_lcpu_relax();
     }
+
+    // At the head of the queue, wait for the holder to let go.
+    while (__atomic_load_n(&slock->locked, __ATOMIC_ACQUIRE))
+        arch_lcpu_relax();
+
+    // Alone in the queue, the lock is taken by emptying it.
+    uintptr_t tail = encode_tail(&node);
+    if (__atomic_compare_exchange_n(&slock->word, &tail, LOCKED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+
+    // Otherwise nobody else may take it meanwhile, so setting the byte is enough. The successor may still be linking itself in.
+    __atomic_store_n(&slock->locked, LOCKED, __ATOMIC_RELAXED);
+
+    node_t *next;
+    while (!(next = __atomic_load_n(&node.next, __ATOMIC_ACQUIRE)))
+        arch_lcpu_relax();
+    __atomic_store_n(&next->head, true, __ATOMIC_RELEASE);
+}
+
+void spinlock_acquire(volatile spinlock_t *slock)
+{
+    // Masked before queueing up, an interrupt handler going for the same lock would wait on this CPU forever.
+    bool int_state = arch_lcpu_int_enabled();
+    arch_lcpu_int_mask();
+
+    if (!try_lock(slock))
+        lock_queued(slock);
+
+    slock->prev_int_state = int_state;
+}
+
+bool spinlock_try_acquire(volatile spinlock_t *slock)
+{
+    bool int_state = arch_lcpu_int_enabled();
+    arch_lcpu_int_mask();
+
+    if (!try_lock(slock))
+    {
+        if (int_state)
+            arch_lcpu_int_unmask();
+        return false;
+    }
+
+    slock->prev_int_state = int_state;
+    return true;
 }
 
 void spinlock_release(volatile spinlock_t *slock)
 {
     bool prev_int_state = slock->prev_int_state;
-    __atomic_clear(&slock->lock, __ATOMIC_RELEASE);
+    __atomic_store_n(&slock->locked, 0, __ATOMIC_RELEASE);
     if (prev_int_state)
         arch_lcpu_int_unmask();
 }
 
 void spinlock_primitive_acquire(volatile spinlock_t *slock)
 {
-    while (true)
-    {
-        if (!__atomic_test_and_set(&slock->lock, __ATOMIC_ACQUIRE))
-            return;
-
-        while (__atomic_load_n(&slock->lock, __ATOMIC_RELAXED))
-            arch_lcpu_relax();
-    }
+    if (!try_lock(slock))
+        lock_queued(slock);
 }
 
 void spinlock_primitive_release(volatile spinlock_t *slock)
 {
-    __atomic_clear(&slock->lock, __ATOMIC_RELEASE);
+    __atomic_store_n(&slock->locked, 0, __ATOMIC_RELEASE);
 }
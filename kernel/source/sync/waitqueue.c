@@ -0,0 +1,78 @@
+#include "sync/waitqueue.h"
+
+#include "arch/lcpu.h"
+#include "arch/timer.h"
+#include "sys/sched.h"
+#include "sys/thread.h"
+
+typedef struct
+{
+    thread_t *thread;
+    bool woken;
+
+    list_node_t list_node;
+}
+waiter_t;
+
+// Called with the queue locked, which keeps the waiter from timing out and going away meanwhile.
+static bool wake(waitqueue_t *wq)
+{
+    list_node_t *n = list_pop_head(&wq->waiters);
+    if (!n)
+        return false;
+
+    waiter_t *w = LIST_GET_CONTAINER(n, waiter_t, list_node);
+    w->woken = true;
+    sched_wake(w->thread);
+    return true;
+}
+
+int waitqueue_wait(waitqueue_t *wq, spinlock_t *lock, uint64_t deadline)
+{
+    waiter_t w = {
+        .thread = sched_get_curr_thread(),
+        .woken = false,
+        .list_node = LIST_NODE_INIT
+    };
+
+    // What the caller had before taking `lock`, interrupts are masked until after the switch.
+    bool int_state = lock->prev_int_state;
+
+    spinlock_acquire(&wq->slock);
+    list_append(&wq->waiters, &w.list_node);
+    sched_block_prepare(deadline);
+    spinlock_release(&wq->slock);
+
+    spinlock_primitive_release(lock);
+    sched_block();
+    if (int_state)
+        arch_lcpu_int_unmask();
+    spinlock_acquire(lock);
+
+    spinlock_acquire(&wq->slock);
+    bool woken = w.woken;
+    if (!woken)
+        list_remove(&wq->waiters, &w.list_node);
+    spinlock_release(&wq->slock);
+
+    if (!woken && arch_timer_get_uptime_ns() >= deadline)
+        return ETIMEDOUT;
+    return EOK;
+}
+
+bool waitqueue_wake_one(waitqueue_t *wq)
+{
+    spinlock_acquire(&wq->slock);
+    bool woken = wake(wq);
+    spinlock_release(&wq->slock);
+
+    return woken;
+}
+
+void waitqueue_wake_all(waitqueue_t *wq)
+{
+    spinlock_acquire(&wq->slock);
+    while (wake(wq))
+        ;
+    spinlock_release(&wq->slock);
+}
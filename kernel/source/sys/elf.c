@@ -133,10 +133,11 @@ int elf_load(vm_addrspace_t *as, const char *path, void **out_entry, char **out_
     *out_entry = (void *)ehdr.e_entry;
     // TODO: *out_interpreter =
 
-    vm_free(ph_table);
+    vm_free(ph_table, ehdr.e_phentsize * ehdr.e_phnum);
     return EOK;
 
 fail:
     // TODO: free loaded segments
+    vm_free(ph_table, ehdr.e_phentsize * ehdr.e_phnum);
     return err;
 }
@@ -3,6 +3,7 @@
 #include "assert.h"
 #include "mm/heap.h"
 #include "mm/vm.h"
+#include "sync/rcu.h"
 #include "sync/spinlock.h"
 #include "sys/file.h"
 
@@ -50,7 +51,7 @@ void fd_table_destroy(fd_table_t *table)
         }
     }
 
-    vm_free(table->files);
+    vm_free(table->files, sizeof(file_t *) * FD_TABLE_MAX_CAP);
     spinlock_release(&table->lock);
     heap_free(table);
 }
@@ -91,7 +92,7 @@ int fd_alloc(fd_table_t *table, file_t *file, int *out_fd)
             continue;
 
         file_ref(file);
-        table->files[i] = file;
+        RCU_ASSIGN(table->files[i], file);
         *out_fd = i;
 
         spinlock_release(&table->lock);
@@ -116,7 +117,7 @@ int fd_free(fd_table_t *table, int fd)
         return -1;
     }
 
-    table->files[fd] = NULL;
+    RCU_ASSIGN(table->files[fd], NULL);
     spinlock_release(&table->lock);
     file_unref(file);
     return true;
@@ -126,12 +127,13 @@ file_t *fd_get_file(fd_table_t *table, int fd)
 {
     ASSERT(table);
 
-    spinlock_acquire(&table->lock);
+    rcu_read_lock();
 
-    file_t *file = table->files[fd];
-    if (file)
-        file_ref(file);
+    // A file closed meanwhile can still be found, but isn't freed before the read section ends.
+    file_t *file = RCU_DEREFERENCE(table->files[fd]);
+    if (file && !file_try_ref(file))
+        file = NULL;
 
-    spinlock_release(&table->lock);
+    rcu_read_unlock();
     return file;
 }
@@ -95,8 +95,18 @@ void file_ref(file_t *file)
     ref_inc(&file->refcount);
 }
 
+bool file_try_ref(file_t *file)
+{
+    return ref_inc_not_zero(&file->refcount);
+}
+
+static void file_free(rcu_head_t *head)
+{
+    heap_free(LIST_GET_CONTAINER(head, file_t, rcu));
+}
+
 void file_unref(file_t *file)
 {
     if (ref_dec(&file->refcount))
-        heap_free(file);
+        call_rcu(&file->rcu, file_free);
 }
@@ -0,0 +1,303 @@
+#include "sys/futex.h"
+
+#include "arch/lcpu.h"
+#include "arch/paging.h"
+#include "arch/timer.h"
+#include "arch/types.h"
+#include "hhdm.h"
+#include "mm/vm.h"
+#include "sync/spinlock.h"
+#include "sys/sched.h"
+#include "sys/thread.h"
+#include "uapi/errno.h"
+#include "utils/list.h"
+
+#define BUCKETS 256
+
+typedef struct
+{
+    const void *base; // The object a shared mapping maps the word from, or else the address space. Never dereferenced.
+    uintptr_t offset;
+}
+futex_key_t;
+
+typedef struct
+{
+    list_t waiters;
+    spinlock_t slock;
+}
+bucket_t;
+
+typedef struct
+{
+    futex_key_t key;
+    uint32_t bitset;
+    thread_t *thread;
+    bucket_t *bucket; // Changes when requeued, under the locks of both buckets.
+    bool woken;
+
+    list_node_t list_node;
+}
+waiter_t;
+
+static bucket_t buckets[BUCKETS] = {
+    [0 ... BUCKETS - 1] = { .waiters = LIST_INIT, .slock = SPINLOCK_INIT }
+};
+
+static bool key_equal(futex_key_t a, futex_key_t b)
+{
+    return a.base == b.base && a.offset == b.offset;
+}
+
+static bucket_t *key_bucket(futex_key_t key)
+{
+    uint64_t hash = ((uintptr_t)key.base ^ key.offset) * 0x9E3779B97F4A7C15ull;
+    return &buckets[(hash >> 32) % BUCKETS];
+}
+
+static int get_key(vm_addrspace_t *as, uintptr_t uaddr, bool private, futex_key_t *out)
+{
+    if (uaddr % sizeof(uint32_t))
+        return EINVAL;
+
+    // The page map also holds the kernel's half, which must not be read through here.
+    if (uaddr < as->limit_low || uaddr > as->limit_high - (sizeof(uint32_t) - 1))
+        return EFAULT;
+
+    if (private)
+    {
+        *out = (futex_key_t) { .base = as, .offset = uaddr };
+        return EOK;
+    }
+
+    spinlock_acquire(&as->slock);
+
+    int err = EFAULT;
+    FOREACH(n, as->segments)
+    {
+        vm_segment_t *seg = LIST_GET_CONTAINER(n, vm_segment_t, list_node);
+        if (uaddr < seg->start || uaddr >= seg->start + seg->length)
+            continue;
+
+        // Private mappings get a new object on every fork, only shared ones keep theirs.
+        if (seg->object && (seg->flags & VM_MAP_SHARED))
+            *out = (futex_key_t) {
+                .base = seg->object,
+                .offset = seg->offset * ARCH_PAGE_GRAN + (uaddr - seg->start)
+            };
+        else
+            *out = (futex_key_t) { .base = as, .offset = uaddr };
+        err = EOK;
+        break;
+    }
+
+    spinlock_release(&as->slock);
+    return err;
+}
+
+/**
+ * Reads the word at `uaddr` without faulting it in, so that it can be done
+ * with a bucket locked.
+ */
+static bool read_word(vm_addrspace_t *as, uintptr_t uaddr, uint32_t *out)
+{
+    uintptr_t phys;
+    if (!arch_paging_vaddr_to_paddr(as->page_map, uaddr, &phys))
+        return false;
+
+    *out = __atomic_load_n((uint32_t *)(phys + HHDM), __ATOMIC_SEQ_CST);
+    return true;
+}
+
+static bucket_t *lock_waiter_bucket(waiter_t *w)
+{
+    while (true)
+    {
+        bucket_t *b = __atomic_load_n(&w->bucket, __ATOMIC_ACQUIRE);
+        spinlock_acquire(&b->slock);
+        if (w->bucket == b)
+            return b;
+        spinlock_release(&b->slock);
+    }
+}
+
+// Called with the bucket locked, which keeps the waiter from timing out and going away meanwhile.
+static void wake(bucket_t *b, waiter_t *w)
+{
+    list_remove(&b->waiters, &w->list_node);
+    w->woken = true;
+    sched_wake(w->thread);
+}
+
+// Public API
+
+int futex_wait(vm_addrspace_t *as, uintptr_t uaddr, bool private, uint32_t val, uint32_t bitset, uint64_t deadline)
+{
+    if (bitset == 0)
+        return EINVAL;
+
+    futex_key_t key;
+    int err = get_key(as, uaddr, private, &key);
+    if (err != EOK)
+        return err;
+
+    bucket_t *b = key_bucket(key);
+    uint32_t curr;
+    while (true)
+    {
+        spinlock_acquire(&b->slock);
+        if (read_word(as, uaddr, &curr))
+            break;
+        spinlock_release(&b->slock);
+
+        // Faulting may block, the bucket can't stay locked for it.
+        if (!vm_page_fault(as, uaddr, VM_FAULT_READ))
+            return EFAULT;
+    }
+
+    if (curr != val)
+    {
+        spinlock_release(&b->slock);
+        return EAGAIN;
+    }
+
+    waiter_t w = {
+        .key = key,
+        .bitset = bitset,
+        .thread = sched_get_curr_thread(),
+        .bucket = b,
+        .woken = false,
+        .list_node = LIST_NODE_INIT
+    };
+    list_append(&b->waiters, &w.list_node);
+
+    // Checked with the bucket locked every time, a wake-up that came in already ended the wait.
+    while (!w.woken && arch_timer_get_uptime_ns() < deadline)
+    {
+        // Interrupts stay masked until switched out, see sched_block_prepare().
+        bool int_state = b->slock.prev_int_state;
+        sched_block_prepare(deadline);
+        spinlock_primitive_release(&b->slock);
+        sched_block();
+        if (int_state)
+            arch_lcpu_int_unmask();
+        b = lock_waiter_bucket(&w);
+    }
+
+    bool woken = w.woken;
+    if (!woken)
+        list_remove(&b->waiters, &w.list_node);
+    spinlock_release(&b->slock);
+
+    return woken ? EOK : ETIMEDOUT;
+}
+
+int futex_wake(vm_addrspace_t *as, uintptr_t uaddr, bool private, uint32_t bitset, size_t count, size_t *out_woken)
+{
+    if (bitset == 0)
+        return EINVAL;
+
+    futex_key_t key;
+    int err = get_key(as, uaddr, private, &key);
+    if (err != EOK)
+        return err;
+
+    bucket_t *b = key_bucket(key);
+    size_t woken = 0;
+
+    spinlock_acquire(&b->slock);
+
+    for (list_node_t *n = b->waiters.head, *next; n != NULL && woken < count; n = next)
+    {
+        next = n->next;
+
+        waiter_t *w = LIST_GET_CONTAINER(n, waiter_t, list_node);
+        if (!key_equal(w->key, key) || !(w->bitset & bitset))
+            continue;
+
+        wake(b, w);
+        woken++;
+    }
+
+    spinlock_release(&b->slock);
+
+    *out_woken = woken;
+    return EOK;
+}
+
+int futex_requeue(vm_addrspace_t *as, uintptr_t uaddr, uintptr_t uaddr2, bool private,
+                  size_t wake_count, size_t requeue_count, const uint32_t *cmp, size_t *out)
+{
+    futex_key_t key, key2;
+    int err = get_key(as, uaddr, private, &key);
+    if (err == EOK)
+        err = get_key(as, uaddr2, private, &key2);
+    if (err != EOK)
+        return err;
+
+    bucket_t *b = key_bucket(key);
+    bucket_t *b2 = key_bucket(key2);
+
+    // Always in the same order, so that two requeues in opposite directions can't deadlock.
+    bucket_t *first = b < b2 ? b : b2;
+    bucket_t *second = b < b2 ? b2 : b;
+
+    while (true)
+    {
+        spinlock_acquire(&first->slock);
+        if (second != first)
+            spinlock_acquire(&second->slock);
+
+        uint32_t curr;
+        if (!cmp || read_word(as, uaddr, &curr))
+            break;
+
+        if (second != first)
+            spinlock_release(&second->slock);
+        spinlock_release(&first->slock);
+
+        if (!vm_page_fault(as, uaddr, VM_FAULT_READ))
+            return EFAULT;
+    }
+
+    uint32_t curr;
+    if (cmp && (!read_word(as, uaddr, &curr) || curr != *cmp))
+    {
+        err = EAGAIN;
+        goto cleanup;
+    }
+
+    size_t woken = 0, moved = 0;
+    for (list_node_t *n = b->waiters.head, *next; n != NULL; n = next)
+    {
+        next = n->next;
+
+        waiter_t *w = LIST_GET_CONTAINER(n, waiter_t, list_node);
+        if (!key_equal(w->key, key))
+            continue;
+
+        if (woken < wake_count)
+        {
+            wake(b, w);
+            woken++;
+        }
+        else if (moved < requeue_count)
+        {
+            list_remove(&b->waiters, &w->list_node);
+            w->key = key2;
+            __atomic_store_n(&w->bucket, b2, __ATOMIC_RELEASE);
+            list_append(&b2->waiters, &w->list_node);
+            moved++;
+        }
+        else
+            break;
+    }
+
+    *out = woken + moved;
+
+cleanup:
+    if (second != first)
+        spinlock_release(&second->slock);
+    spinlock_release(&first->slock);
+    return err;
+}
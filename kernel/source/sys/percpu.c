@@ -0,0 +1,137 @@
+#include "sys/percpu.h"
+
+#include "arch/types.h"
+#include "assert.h"
+#include "bootreq.h"
+#include "hhdm.h"
+#include "mm/mm.h"
+#include "mm/pm.h"
+#include "panic.h"
+#include "sync/spinlock.h"
+#include "utils/math.h"
+
+#define ALIGNMENT 64
+#define DYNAMIC_SIZE (16 * 1024) // Room left in every area for `percpu_alloc()`.
+
+__attribute__((section(".percpu.head"))) percpu_head_t percpu_head;
+
+size_t percpu_cpu_count = 1;
+
+static uintptr_t early_bases[1];
+static uintptr_t *bases = early_bases;
+
+static size_t area_size;
+static uintptr_t dynamic_next;
+static spinlock_t slock = SPINLOCK_INIT;
+
+uintptr_t percpu_alloc(size_t size)
+{
+    ASSERT(area_size != 0);
+
+    spinlock_acquire(&slock);
+
+    uintptr_t offset = CEIL(dynamic_next, 16);
+    if (offset + size > area_size)
+        panic("Out of per-CPU memory!");
+    dynamic_next = offset + size;
+
+    spinlock_release(&slock);
+
+    return offset;
+}
+
+void *percpu_ptr(uintptr_t offset, size_t cpu_id)
+{
+    ASSERT(cpu_id < percpu_cpu_count);
+    return (void *)(bases[cpu_id] + offset);
+}
+
+void *percpu_this_ptr(uintptr_t offset)
+{
+    return (void *)(arch_lcpu_percpu_base() + offset);
+}
+
+uint64_t percpu_sum(uintptr_t offset)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < percpu_cpu_count; i++)
+        sum += __atomic_load_n((uint64_t *)(bases[i] + offset), __ATOMIC_RELAXED);
+    return sum;
+}
+
+// Initialization
+
+void percpu_init_early(thread_t *thread)
+{
+    percpu_head = (percpu_head_t) {
+        .base = (uintptr_t)__percpu_start,
+        .cpu_id = 0,
+        .curr_thread = thread
+    };
+    early_bases[0] = (uintptr_t)__percpu_start;
+
+    arch_lcpu_percpu_set_base((uintptr_t)__percpu_start);
+}
+
+void percpu_init()
+{
+    ASSERT(PERCPU_OFFSET(percpu_head) == 0);
+
+    if (bootreq_mp.response == NULL)
+        panic("Invalid SMP info provided by the bootloader!");
+
+    size_t count = bootreq_mp.response->cpu_count;
+    size_t bsp = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        struct limine_mp_info *mp_info = bootreq_mp.response->cpus[i];
+
+#if defined(__x86_64__)
+        if (mp_info->lapic_id == bootreq_mp.response->bsp_lapic_id)
+#elif defined(__aarch64__)
+        if (mp_info->mpidr == bootreq_mp.response->bsp_mpidr)
+#endif
+            bsp = i;
+    }
+
+    size_t template_size = (uintptr_t)__percpu_end - (uintptr_t)__percpu_start;
+    dynamic_next = CEIL(template_size, ALIGNMENT);
+    area_size = dynamic_next + DYNAMIC_SIZE;
+
+    uint8_t order = pm_pagecount_to_order(CEIL(count * sizeof(uintptr_t), ARCH_PAGE_GRAN) / ARCH_PAGE_GRAN);
+    page_t *page = pm_alloc(order);
+    if (!page)
+        panic("Could not allocate the per-CPU areas!");
+    uintptr_t *new_bases = (uintptr_t *)(page->addr + HHDM);
+
+    order = pm_pagecount_to_order(CEIL(area_size, ARCH_PAGE_GRAN) / ARCH_PAGE_GRAN);
+    for (size_t i = 0; i < count; i++)
+    {
+        page = pm_alloc(order);
+        if (!page)
+            panic("Could not allocate the per-CPU areas!");
+        uintptr_t base = page->addr + HHDM;
+
+        memcpy((void *)base, __percpu_start, template_size);
+        memset((void *)(base + template_size), 0, area_size - template_size);
+        *(percpu_head_t *)base = (percpu_head_t) {
+            .base = base,
+            .cpu_id = i,
+            .curr_thread = NULL
+        };
+
+        new_bases[i] = base;
+    }
+
+    bases = new_bases;
+    percpu_cpu_count = count;
+
+    // Still running on the template up to here.
+    percpu_load(bsp, THIS_CPU_READ(percpu_head.curr_thread));
+}
+
+void percpu_load(size_t cpu_id, thread_t *thread)
+{
+    arch_lcpu_percpu_set_base(bases[cpu_id]);
+    THIS_CPU_WRITE(percpu_head.curr_thread, thread);
+}
@@ -1,15 +1,20 @@
 #include "sys/reaper.h"
 
+#include "arch/timer.h"
 #include "mm/heap.h"
 #include "panic.h"
+#include "sync/waitqueue.h"
 #include "sys/proc.h"
 #include "sys/sched.h"
 #include "sys/thread.h"
 #include "uapi/errno.h"
 #include "utils/container_of.h"
 
+#define RETRY_INTERVAL_NS (10ull * 1000 * 1000)
+
 static list_t threads_queue = LIST_INIT;
 static spinlock_t slock_threads = SPINLOCK_INIT;
+static waitqueue_t wq = WAITQUEUE_INIT;
 
 void reaper_enqueue_thread(thread_t *t)
 {
@@ -18,16 +23,20 @@ void reaper_enqueue_thread(thread_t *t)
     list_append(&threads_queue, &t->sched_thread_list_node);
 
     spinlock_release(&slock_threads);
+
+    waitqueue_wake_one(&wq);
 }
 
 static void reaper_main()
 {
+    spinlock_acquire(&slock_threads);
+
     while (true)
     {
-        spinlock_acquire(&slock_threads);
-
-        FOREACH(n, threads_queue)
+        for (list_node_t *n = threads_queue.head, *next; n != NULL; n = next)
         {
+            next = n->next;
+
             thread_t *t = container_of(n, thread_t, sched_thread_list_node);
             if (t->refcount != 0)
                 continue;
@@ -41,10 +50,16 @@ static void reaper_main()
             list_remove(&t->owner->threads, &t->proc_thread_list_node);
             spinlock_release(&t->owner->slock);
 
+            list_remove(&threads_queue, n);
             thread_destroy(t);
         }
 
-        spinlock_release(&slock_threads);
+        // Nothing tells when the last reference to a thread is dropped, so the ones left are looked at again later.
+        uint64_t deadline = WAITQUEUE_FOREVER;
+        if (!list_is_empty(&threads_queue))
+            deadline = arch_timer_get_uptime_ns() + RETRY_INTERVAL_NS;
+
+        waitqueue_wait(&wq, &slock_threads, deadline);
     }
 }
 
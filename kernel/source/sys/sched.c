@@ -3,15 +3,19 @@
 #include "assert.h"
 #include "arch/lcpu.h"
 #include "arch/timer.h"
+#include "sync/rcu.h"
 #include "sync/spinlock.h"
+#include "sys/percpu.h"
 #include "sys/smp.h"
 #include "sys/thread.h"
 #include "utils/list.h"
+#include "utils/math.h"
+#include "utils/pheap.h"
 
-#define MLFQ_LEVELS 16
+// A thread that ran this recently is left where it is, its cache is still warm there.
+#define CACHE_HOT_NS (500ull * 1000)
 
-static list_t ready_queues[MLFQ_LEVELS] = { [0 ... MLFQ_LEVELS - 1] = LIST_INIT };
-static const uint64_t timeslices[MLFQ_LEVELS] = {
+static const uint64_t timeslices[SCHED_MLFQ_LEVELS] = {
     1000,    // 1 ms
     2000,
     4000,
@@ -29,25 +33,289 @@ static const uint64_t timeslices[MLFQ_LEVELS] = {
     100000,
     100000
 };
-static spinlock_t slock = SPINLOCK_INIT;
+
+// Threads enqueued before there were any CPUs to queue them on. The first CPU to come up takes them over.
+static sched_runqueue_t boot_rq = SCHED_RUNQUEUE_INIT;
 
 // Private API
 
-static thread_t *pick_next_thread()
+static void rq_push(sched_runqueue_t *rq, thread_t *t)
+{
+    list_append(&rq->queues[t->priority], &t->sched_thread_list_node);
+    __atomic_store_n(&rq->count, rq->count + 1, __ATOMIC_RELAXED);
+}
+
+static thread_t *rq_pop(sched_runqueue_t *rq, uint64_t now, bool steal)
 {
-    for (size_t lvl = 0; lvl < MLFQ_LEVELS; lvl++)
-        FOREACH(n, ready_queues[lvl])
+    for (size_t lvl = 0; lvl < SCHED_MLFQ_LEVELS; lvl++)
+        FOREACH(n, rq->queues[lvl])
         {
             thread_t *t = LIST_GET_CONTAINER(n, thread_t, sched_thread_list_node);
-            if (t->sleep_until < arch_timer_get_uptime_ns())
-            {
-                list_remove(&ready_queues[lvl], n);
-                t->status = THREAD_STATUS_RUNNING;
-                return t;
-            }
+            if (steal && t->last_ran && now - t->last_ran < CACHE_HOT_NS)
+                continue;
+
+            list_remove(&rq->queues[lvl], n);
+            __atomic_store_n(&rq->count, rq->count - 1, __ATOMIC_RELAXED);
+            return t;
+        }
+
+    return NULL;
+}
+
+/*
+ * Idling and wake-ups
+ *
+ * Idle CPUs halt, with their timer only armed for the earliest local sleeper,
+ * or briefly when other CPUs have threads queued that are still too hot to
+ * steal.
+ *
+ * Threads becoming runnable are queued on the CPU they last ran on if that one
+ * idles, else on any idle CPU, else on the one they last ran on anyway. That
+ * CPU is then woken up if it idles, or sent the reschedule IPI if it runs a
+ * thread of lower priority. Otherwise some idle CPU is woken up to steal it.
+ */
+
+// The timer can't be set arbitrarily far out. Waking up early only means going back to sleep.
+#define IDLE_MAX_US (1000ull * 1000)
+
+static size_t idle_count = 0; // CPUs with their idle flag set.
+
+static bool clear_idle(smp_cpu_t *cpu)
+{
+    if (!__atomic_load_n(&cpu->idle, __ATOMIC_RELAXED)
+    ||  !__atomic_exchange_n(&cpu->idle, false, __ATOMIC_SEQ_CST))
+        return false;
+
+    __atomic_sub_fetch(&idle_count, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static bool kick(smp_cpu_t *cpu)
+{
+    if (!clear_idle(cpu))
+        return false;
+
+    arch_lcpu_wake(cpu->id);
+    return true;
+}
+
+static void kick_idle(smp_cpu_t *except)
+{
+    if (!__atomic_load_n(&idle_count, __ATOMIC_RELAXED))
+        return;
+
+    FOREACH(n, smp_cpus)
+    {
+        smp_cpu_t *cpu = LIST_GET_CONTAINER(n, smp_cpu_t, cpu_list_node);
+        if (cpu != except && kick(cpu))
+            return;
+    }
+}
+
+static bool is_idle(smp_cpu_t *cpu)
+{
+    return __atomic_load_n(&cpu->idle, __ATOMIC_RELAXED)
+        || __atomic_load_n(&cpu->curr_thread, __ATOMIC_RELAXED) == cpu->idle_thread;
+}
+
+static smp_cpu_t *least_loaded_cpu()
+{
+    smp_cpu_t *idlest = NULL;
+    size_t least = SIZE_MAX;
+
+    FOREACH(n, smp_cpus)
+    {
+        smp_cpu_t *cpu = LIST_GET_CONTAINER(n, smp_cpu_t, cpu_list_node);
+        size_t count = __atomic_load_n(&cpu->rq.count, __ATOMIC_RELAXED);
+        if (count < least)
+        {
+            idlest = cpu;
+            least = count;
+        }
+    }
+
+    return idlest;
+}
+
+/**
+ * Picks the CPU to queue a thread that becomes runnable on.
+ *
+ * @param prev The CPU the thread last ran on, if any.
+ */
+static smp_cpu_t *select_cpu(smp_cpu_t *prev)
+{
+    if (prev && is_idle(prev))
+        return prev;
+
+    // Idle CPUs that already got something queued are about to be busy.
+    FOREACH(n, smp_cpus)
+    {
+        smp_cpu_t *cpu = LIST_GET_CONTAINER(n, smp_cpu_t, cpu_list_node);
+        if (is_idle(cpu) && !__atomic_load_n(&cpu->rq.count, __ATOMIC_RELAXED))
+            return cpu;
+    }
+
+    return prev ? prev : least_loaded_cpu();
+}
+
+/**
+ * Gets a thread of the given priority, just queued on `cpu`, looked at.
+ */
+static void notify(smp_cpu_t *cpu, size_t priority)
+{
+    // An idle CPU that didn't raise its flag yet still checks its queue before halting.
+    thread_t *curr = __atomic_load_n(&cpu->curr_thread, __ATOMIC_RELAXED);
+    if (kick(cpu) || curr == cpu->idle_thread)
+        return;
+
+    if (priority < curr->priority)
+    {
+        __atomic_store_n(&cpu->need_resched, true, __ATOMIC_RELEASE);
+        arch_lcpu_resched(cpu->id);
+    }
+    else
+        kick_idle(cpu);
+}
+
+static bool has_remote_work(smp_cpu_t *self)
+{
+    FOREACH(n, smp_cpus)
+    {
+        smp_cpu_t *cpu = LIST_GET_CONTAINER(n, smp_cpu_t, cpu_list_node);
+        if (cpu != self && __atomic_load_n(&cpu->rq.count, __ATOMIC_RELAXED))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Sleepers
+ *
+ * Sleeping and blocked threads wait in a heap on the CPU they last ran on,
+ * ordered by deadline, and the one-shot timer is never set past the earliest
+ * one. Only the expired sleepers are looked at when scheduling. Threads blocked
+ * without a timeout sink to the bottom, with a deadline that never comes.
+ */
+
+static bool sleeper_less(const pheap_node_t *a, const pheap_node_t *b)
+{
+    return PHEAP_GET_CONTAINER(a, thread_t, sleep_node)->sleep_until
+         < PHEAP_GET_CONTAINER(b, thread_t, sleep_node)->sleep_until;
+}
+
+static bool is_asleep(sched_runqueue_t *rq, thread_t *t)
+{
+    // Only the root of a heap has no predecessor.
+    return t->sleep_node.prev || rq->sleepers.root == &t->sleep_node;
+}
+
+/**
+ * Moves the expired sleepers over to the ready queues. Called with the run queue locked.
+ *
+ * @return The earliest deadline left, or UINT64_MAX.
+ */
+static uint64_t wake_expired(sched_runqueue_t *rq, uint64_t now)
+{
+    pheap_node_t *n;
+    while ((n = pheap_peek(&rq->sleepers)))
+    {
+        thread_t *t = PHEAP_GET_CONTAINER(n, thread_t, sleep_node);
+        if (t->sleep_until > now)
+            return t->sleep_until;
+
+        pheap_pop(&rq->sleepers, sleeper_less);
+        t->status = THREAD_STATUS_READY;
+        rq_push(rq, t);
+    }
+
+    return UINT64_MAX;
+}
+
+/**
+ * Pulls a thread over from the CPU with the most threads queued. Contended
+ * queues are skipped rather than waited for.
+ */
+static thread_t *steal(smp_cpu_t *self, uint64_t now)
+{
+    smp_cpu_t *busiest = NULL;
+    size_t most = 0;
+
+    FOREACH(n, smp_cpus)
+    {
+        smp_cpu_t *cpu = LIST_GET_CONTAINER(n, smp_cpu_t, cpu_list_node);
+        size_t count = __atomic_load_n(&cpu->rq.count, __ATOMIC_RELAXED);
+        if (cpu != self && count > most)
+        {
+            busiest = cpu;
+            most = count;
         }
+    }
+
+    if (!busiest || !spinlock_try_acquire(&busiest->rq.slock))
+        return NULL;
+
+    thread_t *t = rq_pop(&busiest->rq, now, true);
+
+    spinlock_release(&busiest->rq.slock);
+    return t;
+}
+
+/**
+ * @param next_wake Set to the earliest deadline of the sleepers left on the CPU.
+ */
+static thread_t *pick_next_thread(smp_cpu_t *cpu, uint64_t now, uint64_t *next_wake)
+{
+    // Whatever the reschedule IPI was sent for gets looked at now.
+    __atomic_store_n(&cpu->need_resched, false, __ATOMIC_RELAXED);
 
-    return sched_get_curr_thread()->assigned_cpu->idle_thread;
+    spinlock_acquire(&cpu->rq.slock);
+    *next_wake = wake_expired(&cpu->rq, now);
+    thread_t *t = rq_pop(&cpu->rq, now, false);
+    size_t left = cpu->rq.count;
+    spinlock_release(&cpu->rq.slock);
+
+    // More than this CPU can run right now, see if an idle one can take some.
+    if (t && left)
+        kick_idle(cpu);
+
+    if (!t)
+        t = steal(cpu, now);
+    if (!t)
+        return cpu->idle_thread;
+
+    // The timer may have gone off while idling, there's no need to be woken up anymore.
+    clear_idle(cpu);
+
+    t->status = THREAD_STATUS_RUNNING;
+    __atomic_store_n(&t->assigned_cpu, cpu, __ATOMIC_RELEASE);
+    return t;
+}
+
+static void arm_timer(smp_cpu_t *cpu, thread_t *next, uint64_t now, uint64_t next_wake)
+{
+    uint64_t us;
+    if (next != cpu->idle_thread)
+        us = timeslices[next->priority];
+    else if (has_remote_work(cpu))
+        us = CACHE_HOT_NS / 1000; // Try stealing again once they cooled down.
+    else if (next_wake != UINT64_MAX)
+        us = IDLE_MAX_US;
+    else
+        return; // Nothing to wake up for, the timer stays off.
+
+    if (next_wake != UINT64_MAX)
+        us = MIN(us, (next_wake - MIN(next_wake, now)) / 1000 + 1);
+
+    arch_timer_oneshot(us);
+}
+
+// Run by the reschedule IPI.
+static void resched()
+{
+    smp_cpu_t *cpu = sched_get_curr_thread()->assigned_cpu;
+    if (__atomic_exchange_n(&cpu->need_resched, false, __ATOMIC_ACQUIRE))
+        sched_yield(THREAD_STATUS_READY);
 }
 
 // This function will be called from the assembly function `__thread_context_switch`.
@@ -60,78 +328,230 @@ void sched_drop(thread_t *t)
     if (t == t->assigned_cpu->idle_thread)
         return;
 
-    if (t->status != THREAD_STATUS_READY)
+    bool asleep = t->status == THREAD_STATUS_SLEEPING || t->status == THREAD_STATUS_BLOCKED;
+    if (t->status != THREAD_STATUS_READY && !asleep)
         return;
 
-    t->assigned_cpu = NULL;
+    // The thread stays with the CPU it ran on until another one steals it.
+    smp_cpu_t *cpu = t->assigned_cpu;
+    sched_runqueue_t *rq = &cpu->rq;
+    spinlock_acquire(&rq->slock);
 
-    spinlock_acquire(&slock);
-    list_append(&ready_queues[t->priority], &t->sched_thread_list_node);
-    spinlock_release(&slock);
+    bool queued = !(asleep && t->sleep_until != 0);
+    if (!queued)
+        pheap_insert(&rq->sleepers, &t->sleep_node, sleeper_less);
+    else
+    {
+        // Sleepers woken before they even got switched out go straight back.
+        t->status = THREAD_STATUS_READY;
+        rq_push(rq, t);
+    }
+
+    spinlock_release(&rq->slock);
+
+    // It only waits because this CPU runs something else, an idle one may take it.
+    if (queued && cpu->curr_thread != cpu->idle_thread)
+        kick_idle(cpu);
 }
 
 // Public API
 
 thread_t *sched_get_curr_thread()
 {
-    return (thread_t *)arch_lcpu_thread_reg_read();
+    return THIS_CPU_READ(percpu_head.curr_thread);
 }
 
 uint32_t sched_get_curr_cpuid()
 {
-    return sched_get_curr_thread()->assigned_cpu->id;
+    return THIS_CPU_READ(percpu_head.cpu_id);
 }
 
 void sched_enqueue(thread_t *t)
 {
-    spinlock_acquire(&slock);
     t->last_ran = 0;
     t->sleep_until = 0;
     t->status = THREAD_STATUS_READY;
-    list_append(&ready_queues[0], &t->sched_thread_list_node);
-    spinlock_release(&slock);
+
+    smp_cpu_t *cpu = select_cpu(t->assigned_cpu);
+    t->assigned_cpu = cpu;
+    sched_runqueue_t *rq = cpu ? &cpu->rq : &boot_rq;
+
+    spinlock_acquire(&rq->slock);
+    list_append(&rq->queues[0], &t->sched_thread_list_node);
+    __atomic_store_n(&rq->count, rq->count + 1, __ATOMIC_RELAXED);
+    spinlock_release(&rq->slock);
+
+    if (cpu)
+        notify(cpu, 0);
 }
 
 void sched_preempt()
 {
     arch_timer_stop();
+    rcu_quiescent();
 
-    spinlock_acquire(&slock);
+    uint64_t now = arch_timer_get_uptime_ns();
     thread_t *old = sched_get_curr_thread();
-    old->last_ran = arch_timer_get_uptime_ns();
-    if (old->priority < MLFQ_LEVELS - 1)
+    smp_cpu_t *cpu = old->assigned_cpu;
+    old->last_ran = now;
+    if (old->priority < SCHED_MLFQ_LEVELS - 1)
         old->priority++;
     old->status = THREAD_STATUS_READY;
-    thread_t *new = pick_next_thread();
-    new->assigned_cpu = old->assigned_cpu;
-    spinlock_release(&slock);
+    uint64_t next_wake;
+    thread_t *new = pick_next_thread(cpu, now, &next_wake);
+    cpu->curr_thread = new;
 
-    arch_timer_oneshot(timeslices[new->priority]);
+    arm_timer(cpu, new, now, next_wake);
 
-    vm_addrspace_load(new->owner->as);
+    vm_addrspace_switch(new->owner->as);
     arch_thread_context_switch(&old->context, &new->context); // this calls sched_drop()
 }
 
 void sched_yield(thread_status_t status)
 {
+    // The reschedule IPI mustn't come in halfway through.
+    bool int_state = arch_lcpu_int_enabled();
+    arch_lcpu_int_mask();
     arch_timer_stop();
+    rcu_quiescent();
 
-    spinlock_acquire(&slock);
+    uint64_t now = arch_timer_get_uptime_ns();
     thread_t *old = sched_get_curr_thread();
-    old->last_ran = arch_timer_get_uptime_ns();
+    smp_cpu_t *cpu = old->assigned_cpu;
+    old->last_ran = now;
     old->status = status;
-    thread_t *new = pick_next_thread();
-    new->assigned_cpu = old->assigned_cpu;
-    spinlock_release(&slock);
+    uint64_t next_wake;
+    thread_t *new = pick_next_thread(cpu, now, &next_wake);
+    cpu->curr_thread = new;
 
-    arch_timer_oneshot(timeslices[new->priority]);
+    // The old thread only joins the sleepers once it's switched out, but the timer has to cover it already.
+    if ((status == THREAD_STATUS_SLEEPING || status == THREAD_STATUS_BLOCKED) && old->sleep_until != 0)
+        next_wake = MIN(next_wake, old->sleep_until);
+    arm_timer(cpu, new, now, next_wake);
 
-    vm_addrspace_load(new->owner->as);
+    vm_addrspace_switch(new->owner->as);
     arch_thread_context_switch(&old->context, &new->context); // this calls sched_drop()
+
+    if (int_state)
+        arch_lcpu_int_unmask();
+}
+
+void sched_sleep(uint64_t ns)
+{
+    thread_t *self = sched_get_curr_thread();
+    self->sleep_until = arch_timer_get_uptime_ns() + ns;
+    sched_yield(THREAD_STATUS_SLEEPING);
+}
+
+void sched_block_prepare(uint64_t deadline)
+{
+    ASSERT(!arch_lcpu_int_enabled());
+
+    thread_t *self = sched_get_curr_thread();
+    self->sleep_until = deadline;
+    __atomic_store_n(&self->status, THREAD_STATUS_BLOCKED, __ATOMIC_RELEASE);
+}
+
+void sched_block()
+{
+    sched_yield(THREAD_STATUS_BLOCKED);
+}
+
+void sched_wake(thread_t *t)
+{
+    /*
+     * A sleeper waits in the heap of the CPU it's assigned to and can't be moved while in there, but it may
+     * have moved on between reading its CPU and locking it.
+     */
+    smp_cpu_t *prev;
+    while (true)
+    {
+        prev = __atomic_load_n(&t->assigned_cpu, __ATOMIC_ACQUIRE);
+        if (!prev)
+            return;
+
+        spinlock_acquire(&prev->rq.slock);
+        if (__atomic_load_n(&t->assigned_cpu, __ATOMIC_RELAXED) == prev)
+            break;
+        spinlock_release(&prev->rq.slock);
+    }
+
+    bool woken = false;
+    if (t->status == THREAD_STATUS_SLEEPING || t->status == THREAD_STATUS_BLOCKED)
+    {
+        if (is_asleep(&prev->rq, t))
+        {
+            pheap_remove(&prev->rq.sleepers, &t->sleep_node, sleeper_less);
+            t->status = THREAD_STATUS_READY;
+            woken = true;
+        }
+        else
+            t->sleep_until = 0; // Not switched out yet, sched_drop() queues it as ready.
+    }
+
+    spinlock_release(&prev->rq.slock);
+
+    if (!woken)
+        return;
+
+    // Being ready keeps it from being woken twice while it's in no queue.
+    smp_cpu_t *cpu = select_cpu(prev);
+    size_t priority = t->priority;
+
+    spinlock_acquire(&cpu->rq.slock);
+    __atomic_store_n(&t->assigned_cpu, cpu, __ATOMIC_RELEASE);
+    rq_push(&cpu->rq, t);
+    spinlock_release(&cpu->rq.slock);
+
+    notify(cpu, priority);
+}
+
+void sched_idle()
+{
+    smp_cpu_t *cpu = sched_get_curr_thread()->assigned_cpu;
+
+    while (true)
+    {
+        arch_lcpu_int_mask();
+        rcu_quiescent();
+        __atomic_store_n(&cpu->idle, true, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&idle_count, 1, __ATOMIC_SEQ_CST);
+
+        // Threads queued before the flag went up are seen here, whoever queues one after that wakes this CPU.
+        if (__atomic_load_n(&cpu->rq.count, __ATOMIC_SEQ_CST) == 0)
+            arch_lcpu_idle(&cpu->idle);
+        else
+            arch_lcpu_int_unmask();
+
+        clear_idle(cpu);
+        sched_yield(THREAD_STATUS_READY);
+    }
 }
 
 void sched_init_cpu()
 {
     arch_timer_stop();
     arch_timer_set_handler_per_cpu(sched_preempt);
+    arch_lcpu_set_resched_handler(resched);
+
+    // Whatever was enqueued during boot starts out here, the other CPUs steal from it as they come up.
+    smp_cpu_t *cpu = sched_get_curr_thread()->assigned_cpu;
+
+    spinlock_acquire(&boot_rq.slock);
+    spinlock_acquire(&cpu->rq.slock);
+
+    for (size_t lvl = 0; lvl < SCHED_MLFQ_LEVELS; lvl++)
+    {
+        list_node_t *n;
+        while ((n = list_pop_head(&boot_rq.queues[lvl])))
+        {
+            thread_t *t = LIST_GET_CONTAINER(n, thread_t, sched_thread_list_node);
+            t->assigned_cpu = cpu;
+            rq_push(&cpu->rq, t);
+        }
+    }
+    boot_rq.count = 0;
+
+    spinlock_release(&cpu->rq.slock);
+    spinlock_release(&boot_rq.slock);
 }
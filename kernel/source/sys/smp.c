@@ -5,6 +5,8 @@
 #include "log.h"
 #include "mm/heap.h"
 #include "panic.h"
+#include "sync/rcu.h"
+#include "sys/percpu.h"
 #include "sys/proc.h"
 #include "sys/sched.h"
 #include "sys/thread.h"
@@ -17,18 +19,21 @@ static spinlock_t slock;
 
 [[noreturn]] [[gnu::noinline]] static void thread_idle_func(struct limine_mp_info *mp_info)
 {
+    // Spinning on the lock already needs to know which CPU this is.
+    thread_t *idle_thread = (thread_t *)mp_info->extra_argument;
+    percpu_load(idle_thread->assigned_cpu->id, idle_thread);
+
     // Sequentially initializing CPU cores allows for easier debugging.
     spinlock_acquire(&slock);
 
-    arch_lcpu_thread_reg_write((size_t)mp_info->extra_argument);
     arch_lcpu_init();
     sched_init_cpu();
-    log(LOG_INFO, "CPU #%02d initialized. Idling...", ((thread_t *)mp_info->extra_argument)->assigned_cpu->id);
+    rcu_init_cpu();
+    log(LOG_INFO, "CPU #%02d initialized. Idling...", idle_thread->assigned_cpu->id);
 
     spinlock_release(&slock);
 
-    while (true)
-        sched_yield(THREAD_STATUS_READY);
+    sched_idle();
 }
 
 void smp_init()
@@ -54,6 +59,9 @@ void smp_init()
             .id = i,
             .idle_thread = idle_thread,
             .curr_thread = idle_thread,
+            .rq = SCHED_RUNQUEUE_INIT,
+            .idle = false,
+            .need_resched = false,
             .cpu_list_node = LIST_NODE_INIT
         };
         list_append(&smp_cpus, &cpu->cpu_list_node);
@@ -4,10 +4,12 @@
 #include "log.h"
 #include "mm/heap.h"
 #include "mm/mm.h"
+#include "sync/rcu.h"
 #include "sync/spinlock.h"
+#include "sync/waitqueue.h"
 #include "sys/file.h"
-#include "sys/sched.h"
 #include "sys/socket.h"
+#include "sys/thread.h"
 #include "uapi/errno.h"
 #include "utils/container_of.h"
 #include "utils/list.h"
@@ -47,6 +49,7 @@ struct socket_unix
     list_node_t pending_node; // membership in server->pending
 
     spinlock_t lock;
+    waitqueue_t wq; // connections to accept if listening, else the connection to be accepted or data to receive
     ref_t refcount;
 };
 
@@ -70,12 +73,12 @@ enum
 
 typedef struct
 {
-    spinlock_t slock;
+    spinlock_t slock; // Only taken by writers, lookups walk the table in RCU read sections.
     list_t sockets;
 }
 unix_table_t;
 
-static unix_table_t unix_table = { 0 };
+static unix_table_t unix_table = { .slock = SPINLOCK_INIT, .sockets = LIST_INIT };
 
 /* Socket table operations */
 
@@ -96,18 +99,17 @@ static int unix_table_register(socket_unix_t *so)
         node = node->next;
     }
 
-    list_append(&unix_table.sockets, &so->table_node);
+    list_append_rcu(&unix_table.sockets, &so->table_node);
 
     spinlock_release(&unix_table.slock);
     return EOK;
 }
 
+// The caller is in a read section, which the socket found stays valid for.
 static socket_unix_t *unix_table_lookup(const struct sockaddr_un *addr)
 {
-    spinlock_acquire(&unix_table.slock);
-
     socket_unix_t *found = NULL;
-    FOREACH(node, unix_table.sockets)
+    FOREACH_RCU(node, unix_table.sockets)
     {
         socket_unix_t *entry = LIST_GET_CONTAINER(node, socket_unix_t, table_node);
         if (strncmp(entry->addr->sun_path, addr->sun_path, UNIX_PATH_MAX) == 0)
@@ -117,15 +119,17 @@ static socket_unix_t *unix_table_lookup(const struct sockaddr_un *addr)
         }
     }
 
-    spinlock_release(&unix_table.slock);
     return found;
 }
 
 static void unix_table_unregister(socket_unix_t *so)
 {
     spinlock_acquire(&unix_table.slock);
-    list_remove(&unix_table.sockets, &so->table_node);
+    list_remove_rcu(&unix_table.sockets, &so->table_node);
     spinlock_release(&unix_table.slock);
+
+    // Lookups that found the socket are done with it, and with its address, after this.
+    synchronize_rcu();
 }
 
 /*
@@ -143,30 +147,44 @@ int unix_accept(socket_t *server, const struct sockaddr *addr, socklen_t addr_le
         return EINVAL;
 
     bool nonblock = (flags & SOCK_NONBLOCK) || (server->flags & SOCK_NONBLOCK);
-    while (list_is_empty(&server_unix->pending))
-    {
-        if (nonblock)
-            return EAGAIN;
 
-        sched_yield(THREAD_STATUS_READY);
-    }
+    spinlock_acquire(&server_unix->lock);
 
-    socket_t *new;
-    int err = socket_create(AF_UNIX, SOCK_STREAM, 0, &new);
-    if (err != EOK)
-        return err;
+    if (nonblock && list_is_empty(&server_unix->pending))
+    {
+        spinlock_release(&server_unix->lock);
+        return EAGAIN;
+    }
 
+    WAITQUEUE_WAIT_EVENT(&server_unix->wq, &server_unix->lock, !list_is_empty(&server_unix->pending), WAITQUEUE_FOREVER);
     socket_unix_t *peer = container_of(
         list_pop_head(&server_unix->pending),
         socket_unix_t,
         pending_node
     );
-    peer->state = UNIX_STATE_CONNECTED;
-    peer->peer = (socket_unix_t *)new;
+
+    spinlock_release(&server_unix->lock);
+
+    socket_t *new;
+    int err = socket_create(AF_UNIX, SOCK_STREAM, 0, &new);
+    if (err != EOK)
+    {
+        // Left for the next accept.
+        spinlock_acquire(&server_unix->lock);
+        list_prepend(&server_unix->pending, &peer->pending_node);
+        spinlock_release(&server_unix->lock);
+        return err;
+    }
 
     ((socket_unix_t *)new)->peer = peer;
     ((socket_unix_t *)new)->state = UNIX_STATE_CONNECTED;
 
+    spinlock_acquire(&peer->lock);
+    peer->state = UNIX_STATE_CONNECTED;
+    peer->peer = (socket_unix_t *)new;
+    spinlock_release(&peer->lock);
+
+    waitqueue_wake_all(&peer->wq);
 
     *out = new;
     return EOK;
@@ -201,23 +219,42 @@ int unix_connect(socket_t *client, const struct sockaddr *addr)
     const struct sockaddr_un *addr_un = (const struct sockaddr_un*)addr;
     socket_unix_t *server;
 
+    rcu_read_lock();
+
     server = unix_table_lookup(addr_un);
     if (!server)
+    {
+        rcu_read_unlock();
         return ENOENT;
+    }
+
+    spinlock_acquire(&server->lock);
 
     if (server->state != UNIX_STATE_LISTEN
     ||  server->pending.length >= UNIX_BACKLOG_MAX)
+    {
+        spinlock_release(&server->lock);
+        rcu_read_unlock();
         return ECONNREFUSED;
+    }
 
     client_unix->state = UNIX_STATE_CONNECTING;
     client_unix->peer = NULL;
 
     list_append(&server->pending, &client_unix->pending_node);
 
-    while (client_unix->state == UNIX_STATE_CONNECTING)
-        sched_yield(THREAD_STATUS_READY);
+    spinlock_release(&server->lock);
 
-    return (client_unix->state == UNIX_STATE_CONNECTED) ? EOK : ECONNREFUSED;
+    waitqueue_wake_one(&server->wq);
+
+    rcu_read_unlock();
+
+    spinlock_acquire(&client_unix->lock);
+    WAITQUEUE_WAIT_EVENT(&client_unix->wq, &client_unix->lock, client_unix->state != UNIX_STATE_CONNECTING, WAITQUEUE_FOREVER);
+    int err = (client_unix->state == UNIX_STATE_CONNECTED) ? EOK : ECONNREFUSED;
+    spinlock_release(&client_unix->lock);
+
+    return err;
 }
 
 int unix_listen(socket_t *so, int backlog)
@@ -238,13 +275,26 @@ int unix_recv(socket_t *so, void *buf, size_t len, int flags,
               thread_t *t, uint64_t *recv_bytes)
 {
     socket_unix_t *u = (socket_unix_t *)so;
+    bool nonblock = (flags & MSG_DONTWAIT) || (so->flags & SOCK_NONBLOCK);
 
     spinlock_acquire(&u->lock);
 
     if (u->length == 0)
     {
-        spinlock_release(&u->lock);
-        return EAGAIN;
+        if (nonblock)
+        {
+            spinlock_release(&u->lock);
+            return EAGAIN;
+        }
+
+        // Until there is data, or nobody left to send any.
+        WAITQUEUE_WAIT_EVENT(&u->wq, &u->lock, u->length > 0 || !u->peer, WAITQUEUE_FOREVER);
+        if (u->length == 0)
+        {
+            *recv_bytes = 0;
+            spinlock_release(&u->lock);
+            return EOK;
+        }
     }
 
     if (len > u->length)
@@ -332,6 +382,8 @@ int unix_send(socket_t *so, const void *buf, size_t len, int flags,
     *sent_bytes = len;
 
     spinlock_release(&peer->lock);
+
+    waitqueue_wake_all(&peer->wq);
     return EOK;
 }
 
@@ -381,6 +433,7 @@ int socket_create_unix(int type, [[maybe_unused]] int protocol, socket_t **so)
         .length   = 0,
 
         .lock     = SPINLOCK_INIT,
+        .wq       = WAITQUEUE_INIT,
         .refcount = 1
     };
 
@@ -402,11 +455,29 @@ int socket_destroy_unix(socket_t *so)
 
     if (u->buffer)
     {
-        vm_free(u->buffer);
+        vm_free(u->buffer, u->capacity);
         u->buffer = NULL;
     }
 
-    // break peer linkage
+    // refuse the connections nobody accepted
+    if (u->state == UNIX_STATE_LISTEN)
+    {
+        spinlock_acquire(&u->lock);
+        list_node_t *n;
+        while ((n = list_pop_head(&u->pending)))
+        {
+            socket_unix_t *client = container_of(n, socket_unix_t, pending_node);
+
+            spinlock_acquire(&client->lock);
+            client->state = UNIX_STATE_CLOSED;
+            spinlock_release(&client->lock);
+
+            waitqueue_wake_all(&client->wq);
+        }
+        spinlock_release(&u->lock);
+    }
+
+    // break peer linkage, waking up a receiver waiting for more
     if (u->peer)
     {
         spinlock_acquire(&u->peer->lock);
@@ -414,6 +485,7 @@ int socket_destroy_unix(socket_t *so)
             u->peer->peer = NULL;
         spinlock_release(&u->peer->lock);
 
+        waitqueue_wake_all(&u->peer->wq);
         u->peer = NULL;
     }
 
@@ -1,8 +1,13 @@
 #include "sys/syscall.h"
 
+#include "arch/types.h"
 #include "fs/vfs.h"
 #include "log.h"
 #include "mm/mm.h"
+#include "mm/vm.h"
+#include "mm/vm/vm_wss.h"
+#include "sys/fd.h"
+#include "sys/file.h"
 #include "sys/proc.h"
 #include "sys/sched.h"
 #include "sys/thread.h"
@@ -20,12 +25,83 @@
 #define MAP_PRIVATE  0x02
 #define MAP_FIXED    0x10
 #define MAP_ANON     0x20
+#define MAP_HUGETLB  0x40000
+
+#define MAP_HUGE_SHIFT 26
+#define MAP_HUGE_MASK  0x3F
+#define MAP_HUGE_2MB   (21 << MAP_HUGE_SHIFT)
+#define MAP_HUGE_1GB   (30 << MAP_HUGE_SHIFT)
+
+#define MADV_MERGEABLE   12
+#define MADV_UNMERGEABLE 13
+
+#define IDLE_CHUNK_PAGES 4096 // Pages looked at per locking of the address space.
+
+static int mmap_file(vm_addrspace_t *as, uintptr_t addr, size_t length, int prot, int flags, int fd, size_t offset, uintptr_t *out)
+{
+    file_t *file = fd_get_file(sys_curr_proc()->fd_table, fd);
+    if (!file)
+        return EBADF;
+
+    int vm_flags = (flags & MAP_SHARED) ? VM_MAP_SHARED : VM_MAP_PRIVATE;
+    if (flags & MAP_FIXED)
+        vm_flags |= VM_MAP_FIXED;
+
+    int err = ENODEV;
+    if (file->type == FILE_TYPE_VNODE)
+        err = vfs_mmap(file->backend, as, addr, length, prot, vm_flags, offset, out);
+
+    file_unref(file);
+
+    // Files whose driver can't map them at all.
+    if (err == ENOTSUP)
+        return ENODEV;
+    return err;
+}
 
 sys_ret_t syscall_mmap(uintptr_t addr, size_t length, int prot, int flags, int fd, size_t offset)
 {
     proc_t *proc = sched_get_curr_thread()->owner;
     vm_addrspace_t *as = proc->as;
 
+    if (!(flags & MAP_ANON))
+    {
+        uintptr_t value;
+        int err = mmap_file(as, addr, length, prot, flags, fd, offset, &value);
+        return (sys_ret_t) {
+            err == EOK ? value : 0,
+            err
+        };
+    }
+
+    if (flags & MAP_HUGETLB)
+    {
+        int vm_flags = VM_MAP_ANON | VM_MAP_HUGETLB;
+        vm_flags |= (flags & MAP_SHARED) ? VM_MAP_SHARED : VM_MAP_PRIVATE;
+        if (flags & MAP_FIXED)
+            vm_flags |= VM_MAP_FIXED;
+
+        switch (flags & (MAP_HUGE_MASK << MAP_HUGE_SHIFT))
+        {
+            case 0:
+            case MAP_HUGE_2MB:
+                break;
+            case MAP_HUGE_1GB:
+                vm_flags |= VM_MAP_HUGE_1GB;
+                break;
+            default:
+                return (sys_ret_t) {0, EINVAL};
+        }
+
+        // Pages are reserved when the mapping is created, so faulting them in lazily can't fail.
+        uintptr_t value = 0;
+        int err = vm_map(as, addr, length, VM_PROTECTION_FULL, vm_flags, NULL, 0, &value);
+        return (sys_ret_t) {
+            value,
+            err
+        };
+    }
+
     size_t value, err;
     err = vm_map(
         as,
@@ -41,3 +117,61 @@ sys_ret_t syscall_mmap(uintptr_t addr, size_t length, int prot, int flags, int f
         err
     };
 }
+
+sys_ret_t syscall_madvise(uintptr_t addr, size_t length, int advice)
+{
+    vm_addrspace_t *as = sys_curr_as();
+
+    if (addr % ARCH_PAGE_GRAN)
+        return (sys_ret_t) {0, EINVAL};
+    length = CEIL(length, ARCH_PAGE_GRAN);
+
+    int err;
+    switch (advice)
+    {
+        case MADV_MERGEABLE:
+            err = vm_set_mergeable(as, addr, length, true);
+            break;
+        case MADV_UNMERGEABLE:
+            err = vm_set_mergeable(as, addr, length, false);
+            break;
+        default:
+            return (sys_ret_t) {0, EINVAL};
+    }
+
+    return (sys_ret_t) {
+        0,
+        err == ENOENT ? ENOMEM : err
+    };
+}
+
+sys_ret_t syscall_get_idle_pages(uintptr_t addr, size_t length, unsigned min_age, uint64_t *bitmap)
+{
+    vm_addrspace_t *as = sys_curr_as();
+
+    if (addr % ARCH_PAGE_GRAN || min_age > UINT8_MAX || length > as->limit_high - MIN(addr, as->limit_high))
+        return (sys_ret_t) {0, EINVAL};
+    length = CEIL(length, ARCH_PAGE_GRAN);
+
+    // One bit per page, set for those not accessed for at least `min_age` working-set passes.
+    uint64_t chunk[IDLE_CHUNK_PAGES / 64];
+    size_t idle = 0;
+    for (size_t done = 0; done < length; done += IDLE_CHUNK_PAGES * ARCH_PAGE_GRAN)
+    {
+        size_t len = MIN(length - done, IDLE_CHUNK_PAGES * ARCH_PAGE_GRAN);
+
+        spinlock_acquire(&as->slock);
+        idle += vm_wss_get_idle(as, addr + done, len, min_age, chunk);
+        spinlock_release(&as->slock);
+
+        vm_copy_to_user(
+            as, (uintptr_t)bitmap + done / ARCH_PAGE_GRAN / 8,
+            chunk, CEIL(len / ARCH_PAGE_GRAN, 64) / 64 * sizeof(uint64_t)
+        );
+    }
+
+    return (sys_ret_t) {
+        idle,
+        EOK
+    };
+}
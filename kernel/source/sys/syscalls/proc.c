@@ -1,6 +1,6 @@
 #include "sys/proc.h"
+#include "arch/lcpu.h"
 #include "arch/misc.h"
-#include "arch/timer.h"
 #include "log.h"
 #include "mm/vm.h"
 #include "sys/elf.h"
@@ -9,6 +9,7 @@
 #include "sys/syscall.h"
 #include "sys/thread.h"
 #include "uapi/errno.h"
+#include "utils/list.h"
 #include "utils/math.h"
 #include "utils/string.h"
 #include <stddef.h>
@@ -31,6 +32,36 @@ sys_ret_t syscall_exit(int code)
 {
     log(LOG_DEBUG, "Process exited with code: %i.", code);
 
+    proc_t *proc = sys_curr_proc();
+    thread_t *self = sys_curr_thread();
+
+    // The last thread out hands the address space over to the teardown worker. Each one is marked terminated under
+    // the lock, so that of two exiting at once exactly one sees the other gone. Interrupts stay masked until it's
+    // switched out, being preempted would mark it ready again.
+    bool last = true;
+    arch_lcpu_int_mask();
+    spinlock_acquire(&proc->slock);
+    self->status = THREAD_STATUS_TERMINATED;
+    FOREACH(n, proc->threads)
+    {
+        thread_t *t = LIST_GET_CONTAINER(n, thread_t, proc_thread_list_node);
+        if (t->status != THREAD_STATUS_TERMINATED)
+            last = false;
+    }
+    vm_addrspace_t *as = last ? proc->as : NULL;
+    if (last)
+    {
+        proc->as = NULL;
+        proc->status = PROC_STATUS_TERMINATED;
+    }
+    spinlock_release(&proc->slock);
+
+    if (as)
+    {
+        vm_addrspace_load(vm_kernel_as);
+        vm_addrspace_destroy(as);
+    }
+
     sched_yield(THREAD_STATUS_TERMINATED);
 
     unreachable();
@@ -80,7 +111,26 @@ sys_ret_t syscall_tcb_set(void *ptr)
 // sleep in microseconds
 sys_ret_t syscall_sleep(unsigned us)
 {
-    sys_curr_thread()->sleep_until = arch_timer_get_uptime_ns() + (uint64_t) us * 1000;
-    sched_yield(THREAD_STATUS_SLEEPING);
+    sched_sleep((uint64_t) us * 1000);
+    return (sys_ret_t) {0, EOK};
+}
+
+sys_ret_t syscall_nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    struct timespec ts;
+    if (vm_copy_from_user(sys_curr_as(), &ts, (uintptr_t)req, sizeof(ts)) != sizeof(ts))
+        return (sys_ret_t) {0, EFAULT};
+    if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1'000'000'000)
+        return (sys_ret_t) {0, EINVAL};
+
+    sched_sleep((uint64_t)ts.tv_sec * 1'000'000'000 + (uint64_t)ts.tv_nsec);
+
+    // There are no signals to cut the sleep short.
+    if (rem)
+    {
+        struct timespec zero = { 0, 0 };
+        vm_copy_to_user(sys_curr_as(), (uintptr_t)rem, &zero, sizeof(zero));
+    }
+
     return (sys_ret_t) {0, EOK};
 }
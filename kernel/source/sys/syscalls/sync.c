@@ -0,0 +1,74 @@
+#include "sys/syscall.h"
+
+#include "arch/timer.h"
+#include "sys/futex.h"
+#include "uapi/errno.h"
+#include "uapi/futex.h"
+#include "uapi/time.h"
+
+static int get_deadline(const struct timespec *timeout, bool relative, uint64_t *out)
+{
+    if (!timeout)
+    {
+        *out = UINT64_MAX;
+        return EOK;
+    }
+
+    struct timespec ts;
+    if (vm_copy_from_user(sys_curr_as(), &ts, (uintptr_t)timeout, sizeof(ts)) != sizeof(ts))
+        return EFAULT;
+    if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1'000'000'000)
+        return EINVAL;
+
+    uint64_t ns = (uint64_t)ts.tv_sec * 1'000'000'000 + (uint64_t)ts.tv_nsec;
+    if (!relative)
+        *out = ns;
+    else if (__builtin_add_overflow(arch_timer_get_uptime_ns(), ns, out))
+        *out = UINT64_MAX;
+    return EOK;
+}
+
+sys_ret_t syscall_futex(uint32_t *uaddr, int op, uint32_t val, const struct timespec *timeout, uint32_t *uaddr2, uint32_t val3)
+{
+    // Absolute timeouts count from boot, there is no wall clock to go by.
+    if (op & FUTEX_CLOCK_REALTIME)
+        return (sys_ret_t) {0, ENOSYS};
+
+    vm_addrspace_t *as = sys_curr_as();
+    bool private = op & FUTEX_PRIVATE_FLAG;
+    size_t count = 0;
+    int err;
+
+    switch (op & FUTEX_CMD_MASK)
+    {
+        case FUTEX_WAIT:
+            val3 = FUTEX_BITSET_MATCH_ANY;
+            [[fallthrough]];
+        case FUTEX_WAIT_BITSET:
+        {
+            uint64_t deadline;
+            err = get_deadline(timeout, (op & FUTEX_CMD_MASK) == FUTEX_WAIT, &deadline);
+            if (err == EOK)
+                err = futex_wait(as, (uintptr_t)uaddr, private, val, val3, deadline);
+            break;
+        }
+        case FUTEX_WAKE:
+            val3 = FUTEX_BITSET_MATCH_ANY;
+            [[fallthrough]];
+        case FUTEX_WAKE_BITSET:
+            err = futex_wake(as, (uintptr_t)uaddr, private, val3, val, &count);
+            break;
+        // The requeue count is passed in place of the timeout.
+        case FUTEX_REQUEUE:
+            err = futex_requeue(as, (uintptr_t)uaddr, (uintptr_t)uaddr2, private, val, (size_t)timeout, NULL, &count);
+            break;
+        case FUTEX_CMP_REQUEUE:
+            err = futex_requeue(as, (uintptr_t)uaddr, (uintptr_t)uaddr2, private, val, (size_t)timeout, &val3, &count);
+            break;
+        default:
+            err = ENOSYS;
+            break;
+    }
+
+    return (sys_ret_t) {count, err};
+}
@@ -27,7 +27,12 @@ const void* syscall_table[] = {
     (void *)syscall_recv,
     (void *)syscall_send,
     (void *)syscall_shutdown,
-    (void *)syscall_socket
+    (void *)syscall_socket,
+    (void *)syscall_madvise,
+    (void *)syscall_sleep,
+    (void *)syscall_nanosleep,
+    (void *)syscall_futex,
+    (void *)syscall_get_idle_pages
 };
 
 const uint64_t syscall_table_length = sizeof(syscall_table) / sizeof(void *);
@@ -39,6 +39,7 @@ int thread_create_kernel(vm_addrspace_t *as, uintptr_t entry, size_t stack_size,
     thread->assigned_cpu = NULL;
     thread->proc_thread_list_node = LIST_NODE_INIT;
     thread->sched_thread_list_node = LIST_NODE_INIT;
+    thread->sleep_node = PHEAP_NODE_INIT;
     thread->slock = SPINLOCK_INIT;
     thread->refcount = REF_INIT;
     const char *argv[] = { "test", NULL };
@@ -76,6 +77,7 @@ int thread_create_user(vm_addrspace_t *as, uintptr_t entry, size_t stack_size,
     thread->assigned_cpu = NULL;
     thread->proc_thread_list_node = LIST_NODE_INIT;
     thread->sched_thread_list_node = LIST_NODE_INIT;
+    thread->sleep_node = PHEAP_NODE_INIT;
     thread->slock = SPINLOCK_INIT;
     thread->refcount = REF_INIT;
     err = arch_thread_context_init(&thread->context, as, true, entry,
@@ -116,6 +118,7 @@ thread_t *thread_duplicate(thread_t *thread)
 
     new_thread->proc_thread_list_node = LIST_NODE_INIT;
     new_thread->sched_thread_list_node = LIST_NODE_INIT;
+    new_thread->sleep_node = PHEAP_NODE_INIT;
     new_thread->slock = SPINLOCK_INIT;
     new_thread->refcount = REF_INIT;
 
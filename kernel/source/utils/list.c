@@ -107,3 +107,34 @@ list_node_t *list_pop_tail(list_t *list)
 
     return node;
 }
+
+void list_append_rcu(list_t *list, list_node_t *node)
+{
+    node->prev = list->tail;
+    node->next = NULL;
+
+    // The node is only linked in once it's set up.
+    if (list->tail != NULL)
+        __atomic_store_n(&list->tail->next, node, __ATOMIC_RELEASE);
+    else
+        __atomic_store_n(&list->head, node, __ATOMIC_RELEASE);
+    list->tail = node;
+
+    list->length++;
+}
+
+void list_remove_rcu(list_t *list, list_node_t *node)
+{
+    // The node's own links stay as they are, so that readers standing on it can still move on.
+    if (node->prev != NULL)
+        __atomic_store_n(&node->prev->next, node->next, __ATOMIC_RELEASE);
+    else
+        __atomic_store_n(&list->head, node->next, __ATOMIC_RELEASE);
+
+    if (node->next != NULL)
+        node->next->prev = node->prev;
+    else
+        list->tail = node->prev;
+
+    list->length--;
+}
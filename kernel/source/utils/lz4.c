@@ -0,0 +1,202 @@
+#include "utils/lz4.h"
+
+#include "assert.h"
+#include "mm/mm.h"
+#include "utils/math.h"
+
+#define MIN_MATCH 4
+#define MF_LIMIT 12      // A match may not start closer than this to the end of the input.
+#define LAST_LITERALS 5  // The input always ends with at least this many literals.
+#define MAX_OFFSET 0xFFFF
+
+// Helpers
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+static uint8_t *write_length(uint8_t *op, size_t len)
+{
+    if (len < 15)
+        return op;
+
+    len -= 15;
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+
+    return op;
+}
+
+/**
+ * Emits a sequence of literals followed by a match. A `match_len` of 0 emits
+ * the final, literals-only sequence.
+ */
+static bool write_sequence(uint8_t **opp, const uint8_t *oend,
+                           const uint8_t *literals, size_t lit_len,
+                           size_t offset, size_t match_len)
+{
+    uint8_t *op = *opp;
+
+    size_t worst = 1 + lit_len / 255 + 1 + lit_len;
+    if (match_len)
+        worst += 2 + match_len / 255 + 1;
+    if (worst > (size_t)(oend - op))
+        return false;
+
+    size_t ml = match_len ? match_len - MIN_MATCH : 0;
+
+    uint8_t *token = op++;
+    *token = (uint8_t)((MIN(lit_len, 15) << 4) | MIN(ml, 15));
+
+    op = write_length(op, lit_len);
+    memcpy(op, literals, lit_len);
+    op += lit_len;
+
+    if (match_len)
+    {
+        *op++ = (uint8_t)(offset & 0xFF);
+        *op++ = (uint8_t)(offset >> 8);
+        op = write_length(op, ml);
+    }
+
+    *opp = op;
+    return true;
+}
+
+static bool read_length(const uint8_t **ipp, const uint8_t *iend, size_t *len)
+{
+    if (*len != 15)
+        return true;
+
+    uint8_t byte;
+    do
+    {
+        if (*ipp >= iend)
+            return false;
+        byte = *(*ipp)++;
+        *len += byte;
+    }
+    while (byte == 255);
+
+    return true;
+}
+
+// Compression
+
+size_t lz4_compress(const void *src, size_t src_len, void *dst, size_t dst_cap, lz4_workmem_t *workmem)
+{
+    ASSERT(src_len <= LZ4_MAX_INPUT_SIZE);
+
+    const uint8_t *base = src;
+    const uint8_t *iend = base + src_len;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    uint8_t *op = dst;
+    const uint8_t *oend = op + dst_cap;
+
+    memset(workmem->table, 0, sizeof(workmem->table));
+
+    if (src_len > MF_LIMIT)
+    {
+        const uint8_t *mf_limit = iend - MF_LIMIT;
+        const uint8_t *match_limit = iend - LAST_LITERALS;
+
+        while (ip < mf_limit)
+        {
+            uint32_t h = hash(read32(ip));
+            const uint8_t *ref = base + workmem->table[h];
+            workmem->table[h] = (uint16_t)(ip - base);
+
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != read32(ip))
+            {
+                ip++;
+                continue;
+            }
+
+            // Extend the match backwards over pending literals, then forwards.
+            while (ip > anchor && ref > base && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+
+            size_t match_len = MIN_MATCH;
+            while (ip + match_len < match_limit && ip[match_len] == ref[match_len])
+                match_len++;
+
+            if (!write_sequence(&op, oend, anchor, ip - anchor, ip - ref, match_len))
+                return 0;
+
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+
+    if (!write_sequence(&op, oend, anchor, iend - anchor, 0, 0))
+        return 0;
+
+    return op - (uint8_t *)dst;
+}
+
+// Decompression
+
+size_t lz4_decompress(const void *src, size_t src_len, void *dst, size_t dst_cap)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + src_len;
+    uint8_t *op = dst;
+    uint8_t *oend = op + dst_cap;
+
+    while (ip < iend)
+    {
+        uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (!read_length(&ip, iend, &lit_len))
+            return 0;
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op))
+            return 0;
+
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+
+        // The last sequence has no match.
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return 0;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst))
+            return 0;
+
+        size_t match_len = token & 0xF;
+        if (!read_length(&ip, iend, &match_len))
+            return 0;
+        match_len += MIN_MATCH;
+        if (match_len > (size_t)(oend - op))
+            return 0;
+
+        // Matches may overlap their own output, so copy byte by byte.
+        const uint8_t *ref = op - offset;
+        for (size_t i = 0; i < match_len; i++)
+            op[i] = ref[i];
+        op += match_len;
+    }
+
+    return op - (uint8_t *)dst;
+}
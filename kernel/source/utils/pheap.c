@@ -0,0 +1,98 @@
+#include "utils/pheap.h"
+
+static pheap_node_t *meld(pheap_node_t *a, pheap_node_t *b, pheap_less_t less)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+
+    if (less(b, a))
+    {
+        pheap_node_t *tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    // The larger root becomes the first child of the smaller one.
+    b->prev = a;
+    b->next = a->child;
+    if (a->child)
+        a->child->prev = b;
+    a->child = b;
+
+    return a;
+}
+
+/**
+ * Melds a list of siblings into one heap: pairwise from left to right, then
+ * the pairs from right to left.
+ */
+static pheap_node_t *merge_pairs(pheap_node_t *first, pheap_less_t less)
+{
+    pheap_node_t *pairs = NULL; // Linked through `next`, rightmost first.
+
+    while (first)
+    {
+        pheap_node_t *a = first;
+        pheap_node_t *b = a->next;
+        first = b ? b->next : NULL;
+
+        a->next = a->prev = NULL;
+        if (b)
+            b->next = b->prev = NULL;
+
+        pheap_node_t *pair = meld(a, b, less);
+        pair->next = pairs;
+        pairs = pair;
+    }
+
+    pheap_node_t *root = NULL;
+    while (pairs)
+    {
+        pheap_node_t *next = pairs->next;
+        pairs->next = NULL;
+        root = meld(root, pairs, less);
+        pairs = next;
+    }
+
+    return root;
+}
+
+void pheap_insert(pheap_t *heap, pheap_node_t *node, pheap_less_t less)
+{
+    *node = PHEAP_NODE_INIT;
+    heap->root = meld(heap->root, node, less);
+}
+
+pheap_node_t *pheap_pop(pheap_t *heap, pheap_less_t less)
+{
+    pheap_node_t *root = heap->root;
+    if (!root)
+        return NULL;
+
+    heap->root = merge_pairs(root->child, less);
+    *root = PHEAP_NODE_INIT;
+    return root;
+}
+
+void pheap_remove(pheap_t *heap, pheap_node_t *node, pheap_less_t less)
+{
+    if (node == heap->root)
+    {
+        pheap_pop(heap, less);
+        return;
+    }
+
+    // Cut the node's subtree out of its parent's children.
+    if (node->prev->child == node)
+        node->prev->child = node->next;
+    else
+        node->prev->next = node->next;
+    if (node->next)
+        node->next->prev = node->prev;
+
+    pheap_node_t *sub = merge_pairs(node->child, less);
+    heap->root = meld(heap->root, sub, less);
+    *node = PHEAP_NODE_INIT;
+}